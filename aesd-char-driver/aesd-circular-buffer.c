@@ -31,13 +31,13 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    int buff_index/*0,..,9*/, cmd_n = buffer->out_offs/*0,..,n,n+1,n+out_offs,...*/;
+    uint32_t buff_index/*0,..,9*/, cmd_n = buffer->out_offs/*0,..,n,n+1,n+out_offs,...*/;
     for (; cmd_n < (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + buffer->out_offs); ++cmd_n) {
         buff_index = cmd_n % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
         if (buffer->entry[buff_index].size > char_offset) {
             *entry_offset_byte_rtn = char_offset;
             // #ifdef __KERNEL__
-            // printk(KERN_DEBUG "Circular buffer: Read command %d at index %d: %s", cmd_n, buff_index, buffer->entry[buff_index].buffptr + char_offset);
+            // printk(KERN_DEBUG "Circular buffer: Read command %u at index %u: %s", cmd_n, buff_index, buffer->entry[buff_index].buffptr + char_offset);
             // #endif
             return &(buffer->entry[buff_index]);
         } else {
@@ -48,16 +48,40 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     return NULL;
 }
 
+static size_t aesd_circular_buffer_used(struct aesd_circular_buffer *buffer)
+{
+    return buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
+        (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static size_t aesd_circular_buffer_end_offset(struct aesd_circular_buffer *buffer, size_t used)
+{
+    /**
+     * @return the offset following the newest entry, which its owner may have grown in place
+     */
+    const struct aesd_buffer_entry *newest;
+    if (used == 0) {
+        return 0;
+    }
+    newest = &buffer->entry[(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    return newest->offset + newest->size;
+}
+
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the overwritten oldest entry for the caller to release, or NULL if the buffer wasn't full
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    const char *displaced = NULL;
+    size_t offset = aesd_circular_buffer_end_offset(buffer, aesd_circular_buffer_used(buffer));
+
     if (buffer->full) {
+        displaced = buffer->entry[buffer->out_offs].buffptr;
         buffer->full = false;
 
         // Override oldest entry
@@ -71,13 +95,74 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     }
 
     // Add new entry
-    buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
-    buffer->entry[buffer->in_offs].size = add_entry->size;
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].offset = offset;
     // #ifdef __KERNEL__
     // printk(KERN_DEBUG "Circular buffer: Added command[%d]: %s",  buffer->in_offs, buffer->entry[buffer->in_offs].buffptr);
     // #endif
     buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; // Advance in-offset pos
-    
+
+    return displaced;
+}
+
+/**
+* Adds the @param n entries of @param add_entries to @param buffer, oldest first, updating the
+* buffer offsets once for the whole batch.
+* Every entry displaced by the batch is passed to @param evict with @param ctx (if not NULL): the oldest
+* entries of the buffer, and the first entries of the batch itself when n exceeds the buffer capacity.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entries,
+            size_t n, aesd_circular_buffer_evict_t evict, void *ctx)
+{
+    size_t used = aesd_circular_buffer_used(buffer);
+    size_t offset = aesd_circular_buffer_end_offset(buffer, used);
+    size_t overwritten, i, index;
+
+    // Entries which don't fit even in an empty buffer are displaced right away
+    for (; n > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; --n, ++add_entries) {
+        if (evict) {
+            evict(add_entries, ctx);
+        }
+    }
+
+    overwritten = used + n > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? used + n - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+    for (i = 0, index = buffer->out_offs; i < overwritten; ++i) {
+        if (evict) {
+            evict(&buffer->entry[index], ctx);
+        }
+        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+
+    for (i = 0, index = buffer->in_offs; i < n; ++i) {
+        buffer->entry[index] = add_entries[i];
+        buffer->entry[index].offset = offset;
+        offset += add_entries[i].size;
+        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+
+    buffer->in_offs = index;
+    buffer->out_offs = (buffer->out_offs + overwritten) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = used + n >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Removes the oldest entry of @param buffer, to bound the buffer below its capacity.
+* The entry is stored in @param removed_rtn so its owner can release buffptr.
+* Any necessary locking must be handled by the caller
+* @return true if an entry was removed, false if the buffer was empty
+*/
+bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_rtn)
+{
+    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+        return false;
+    }
+
+    *removed_rtn = buffer->entry[buffer->out_offs];
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+    buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = false;
+    return true;
 }
 
 /**
@@ -87,3 +172,93 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
+
+/**
+ * @param buffer the buffer to export.  Any necessary locking must be performed by caller, the spans
+ *      are only valid until the next buffer update.
+ * @param char_offset the zero referenced character index of the first byte, as for
+ *      aesd_circular_buffer_find_entry_offset_for_fpos
+ * @param max_len the maximal number of bytes to cover
+ * @param spans an array receiving one (ptr, len) span per entry overlapping the requested range,
+ *      oldest first and across the wraparound of the entry array
+ * @param max_spans the number of elements of spans, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED covers any range
+ * @param total_len_rtn is a pointer to store the number of bytes covered by the spans, may be NULL
+ * @return the number of spans stored, 0 if char_offset is beyond the buffered data
+ */
+size_t aesd_circular_buffer_spans(struct aesd_circular_buffer *buffer, size_t char_offset, size_t max_len,
+            struct aesd_buffer_span *spans, size_t max_spans, size_t *total_len_rtn)
+{
+    size_t n = 0, total = 0;
+    size_t used = aesd_circular_buffer_used(buffer);
+    size_t cmd_n, buff_index = buffer->out_offs;
+
+    for (cmd_n = 0; cmd_n < used && n < max_spans && total < max_len; ++cmd_n) {
+        const struct aesd_buffer_entry *entry = &buffer->entry[buff_index];
+        if (entry->size <= char_offset) {
+            char_offset -= entry->size; // Range starts in a later entry
+        } else {
+            size_t len = entry->size - char_offset;
+            if (len > max_len - total) {
+                len = max_len - total;
+            }
+            spans[n].ptr = entry->buffptr + char_offset;
+            spans[n].len = len;
+            total += len;
+            n++;
+            char_offset = 0;
+        }
+        buff_index = (buff_index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+
+    if (total_len_rtn) {
+        *total_len_rtn = total;
+    }
+    return n;
+}
+
+static size_t aesd_circular_buffer_lower_bound(struct aesd_circular_buffer *buffer, size_t used, bool by_seq, uint64_t key)
+{
+    /**
+     * @return the number of entries, from the oldest, whose key is lower than key
+     */
+    size_t lo = 0, hi = used;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + mid) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        if ((by_seq ? entry->seq : entry->timestamp_ns) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param by_seq compare the seq of the entries with the range instead of their timestamp_ns
+ * @param from the first key in range
+ * @param to the first key after the range
+ * @param start_fpos_rtn is a pointer to store the zero referenced character index of the first byte in range,
+ *      as for aesd_circular_buffer_find_entry_offset_for_fpos
+ * @param end_fpos_rtn is a pointer to store the character index following the last byte in range
+ * @param first_rtn is a pointer to store the position of the first entry in range, counted from the oldest entry
+ * @return the number of entries whose key is in [from, to). The keys never decrease from the oldest to the
+ *      newest entry, both ends of the range are found by binary search and their character indexes
+ *      come from the entry offsets, without walking the entries.
+ */
+size_t aesd_circular_buffer_key_range(struct aesd_circular_buffer *buffer, bool by_seq, uint64_t from, uint64_t to,
+            size_t *start_fpos_rtn, size_t *end_fpos_rtn, size_t *first_rtn)
+{
+    size_t used = aesd_circular_buffer_used(buffer);
+    size_t first = aesd_circular_buffer_lower_bound(buffer, used, by_seq, from);
+    size_t last = to > from ? aesd_circular_buffer_lower_bound(buffer, used, by_seq, to) : first;
+    size_t base = used ? buffer->entry[buffer->out_offs].offset : 0;
+    size_t end = aesd_circular_buffer_end_offset(buffer, used);
+
+    // An empty range is positioned where its entries would start
+    *start_fpos_rtn = (first < used ? buffer->entry[(buffer->out_offs + first) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].offset : end) - base;
+    *end_fpos_rtn = (last < used ? buffer->entry[(buffer->out_offs + last) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].offset : end) - base;
+    *first_rtn = first;
+    return last - first;
+}
@@ -16,7 +16,9 @@
 #include <stdbool.h>
 #endif
 
-#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10 // Overridden at build time by larger user space buffers
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,6 +30,34 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Monotonic time in nanoseconds when the entry was committed, never decreasing from the oldest entry
+     */
+    uint64_t timestamp_ns;
+    /**
+     * Sequence number of the entry, increasing by one per entry committed
+     */
+    uint64_t seq;
+    /**
+     * Bytes of the entries added before this one, set by the buffer when the entry is added.
+     * The character index of the first byte of an entry is its offset minus the offset of the oldest entry.
+     */
+    size_t offset;
+};
+
+/**
+ * A contiguous byte range of one buffer entry, see aesd_circular_buffer_spans
+ */
+struct aesd_buffer_span
+{
+    /**
+     * First byte of the range, inside the buffptr of an entry
+     */
+    const char *ptr;
+    /**
+     * Number of bytes of the range
+     */
+    size_t len;
 };
 
 struct aesd_circular_buffer
@@ -40,11 +70,11 @@ struct aesd_circular_buffer
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -54,18 +84,34 @@ struct aesd_circular_buffer
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+/**
+ * Called with each entry displaced by aesd_circular_buffer_add_entries, so its owner can release buffptr
+ */
+typedef void (*aesd_circular_buffer_evict_t)(const struct aesd_buffer_entry *evicted, void *ctx);
+
+extern void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entries,
+            size_t n, aesd_circular_buffer_evict_t evict, void *ctx);
+
+extern size_t aesd_circular_buffer_key_range(struct aesd_circular_buffer *buffer, bool by_seq, uint64_t from, uint64_t to,
+            size_t *start_fpos_rtn, size_t *end_fpos_rtn, size_t *first_rtn);
+
+extern bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_rtn);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern size_t aesd_circular_buffer_spans(struct aesd_circular_buffer *buffer, size_t char_offset, size_t max_len,
+            struct aesd_buffer_span *spans, size_t max_spans, size_t *total_len_rtn);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -0,0 +1,55 @@
+/*
+ * aesd_ioctl.h
+ *
+ * ioctl interface of the aesdchar driver, shared with user space.
+ */
+
+#ifndef AESD_IOCTL_H
+#define AESD_IOCTL_H
+
+#ifdef __KERNEL__
+#include <asm-generic/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+
+/**
+ * Select the entries of a range query by their commit time or by their sequence number
+ */
+enum aesd_range_key
+{
+    AESD_RANGE_BY_TIME = 0, /* CLOCK_MONOTONIC nanoseconds, as clock_gettime(CLOCK_MONOTONIC) in user space */
+    AESD_RANGE_BY_SEQ = 1, /* Sequence number, counted from 0 since the driver was loaded */
+};
+
+/**
+ * Range query: the entries whose key is in [from, to) are the bytes [start_fpos, end_fpos) of the device.
+ * Keys only grow from the oldest to the newest entry, so the range is resolved by binary search.
+ * The file positions are valid until the next write evicts an entry, compare first_seq with the
+ * query to detect it.
+ */
+struct aesd_range_query
+{
+    /* Query, set by the caller */
+    uint32_t key; /* enum aesd_range_key */
+    uint32_t reserved;
+    uint64_t from; /* First key included */
+    uint64_t to; /* First key excluded, UINT64_MAX up to the newest entry */
+    /* Result, set by the driver */
+    uint64_t start_fpos; /* File position of the first byte of the first entry in range */
+    uint64_t end_fpos; /* File position following the last entry in range */
+    uint64_t first_seq; /* Sequence number of the first entry in range, or of the entry following an empty range */
+    uint64_t entries; /* Number of entries in range, 0 if none */
+    uint64_t now_ns; /* Time of the query on the entries clock, to build windows relative to now */
+};
+
+// Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
+#define AESD_IOC_MAGIC 0x16
+
+#define AESDCHAR_IOCRANGE _IOWR(AESD_IOC_MAGIC, 2, struct aesd_range_query)
+
+#define AESDCHAR_IOC_MAXNR 2
+
+#endif /* AESD_IOCTL_H */
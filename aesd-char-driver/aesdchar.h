@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug (per call tracing uses the aesdchar tracepoints)
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -32,15 +32,27 @@ struct aesd_dev
      */
      struct mutex lock; /* mutual exclusion semaphore     */
      struct cdev cdev; /* Char device structure      */
+     char *partial; /* Pending command, not yet newline terminated */
+     size_t partial_size; /* Number of bytes in partial */
+     uint64_t next_seq; /* Sequence number of the next committed command */
   
 };
 
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entries,
+            size_t n, aesd_circular_buffer_evict_t evict, void *ctx);
 
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+size_t aesd_circular_buffer_spans(struct aesd_circular_buffer *buffer, size_t char_offset, size_t max_len,
+            struct aesd_buffer_span *spans, size_t max_spans, size_t *total_len_rtn);
+
+size_t aesd_circular_buffer_key_range(struct aesd_circular_buffer *buffer, bool by_seq, uint64_t from, uint64_t to,
+            size_t *start_fpos_rtn, size_t *end_fpos_rtn, size_t *first_rtn);
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,91 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Tracepoints of the aesdchar driver, enabled at runtime through
+ * /sys/kernel/tracing/events/aesdchar or with perf/bpftrace
+ * (e.g. tracepoint:aesdchar:aesd_write).
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesd_read,
+
+    TP_PROTO(size_t count, loff_t pos, ssize_t retval, u64 duration_ns),
+
+    TP_ARGS(count, pos, retval, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, retval)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->retval = retval;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("count=%zu pos=%lld retval=%zd duration_ns=%llu",
+        __entry->count, __entry->pos, __entry->retval, __entry->duration_ns)
+);
+
+TRACE_EVENT(aesd_write,
+
+    TP_PROTO(size_t count, unsigned int lines, size_t partial_size, ssize_t retval, u64 duration_ns),
+
+    TP_ARGS(count, lines, partial_size, retval, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(unsigned int, lines)
+        __field(size_t, partial_size)
+        __field(ssize_t, retval)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->lines = lines;
+        __entry->partial_size = partial_size;
+        __entry->retval = retval;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("count=%zu lines=%u partial=%zu retval=%zd duration_ns=%llu",
+        __entry->count, __entry->lines, __entry->partial_size, __entry->retval, __entry->duration_ns)
+);
+
+TRACE_EVENT(aesd_evict,
+
+    TP_PROTO(size_t size),
+
+    TP_ARGS(size),
+
+    TP_STRUCT__entry(
+        __field(size_t, size)
+    ),
+
+    TP_fast_assign(
+        __entry->size = size;
+    ),
+
+    TP_printk("size=%zu", __entry->size)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
@@ -17,7 +17,15 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/slab.h>
+#include <linux/string.h> // memchr
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
 #include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -28,9 +36,6 @@ MODULE_DESCRIPTION("AESD character device driver");
 
 struct aesd_dev aesd_device;
 struct aesd_circular_buffer cbuf; // Circular  buffer
-struct aesd_buffer_entry *cmd; // NULL initialzed
-struct aesd_buffer_entry *cmds[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]; // Track allocated memory to free at teardown
-int cmds_cnt;
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
@@ -60,131 +65,180 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = 0;
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
-    /**
-     * TODO: handle read
-     */
-
-    //struct aesd_dev *dev = filp->private_data; 
+    struct aesd_buffer_span spans[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t n, i;
+    ktime_t start = ktime_get();
 
     if (mutex_lock_interruptible(&aesd_device.lock))
         return -ERESTARTSYS;
 
-    size_t *byte_rtn; /*byte count from offset*/
-    byte_rtn = kmalloc(sizeof(size_t), GFP_KERNEL);
-    if (!byte_rtn) {
-        printk(KERN_ERR "Failed to allocate byte_rtn memory");
-        return retval;
-    }
-
-    struct aesd_buffer_entry *cmd; // NULL initialzed
-    
-    cmd = aesd_circular_buffer_find_entry_offset_for_fpos(&cbuf, *f_pos, byte_rtn);
-    if (!cmd) {
-        PDEBUG("No entry found for offset %lld", *f_pos);
-        goto out;
-    }
-
-    cmd->size = strlen(cmd->buffptr);
-    if (count > cmd->size) {
-        count = cmd->size;
-    }
-    //PDEBUG("Copy to user: %s", cmd->buffptr);
-    if (copy_to_user(buf, cmd->buffptr, count) != 0) {
-        if (0 < retval < count) {
-            printk(KERN_ERR "Failed to copy all bytes to user (remaining: %ld ; total: %ld)", retval, count);
-        } else {
+    // Gather every entry overlapping [f_pos, f_pos+count) and copy them in a single pass
+    n = aesd_circular_buffer_spans(&cbuf, *f_pos, count, spans, ARRAY_SIZE(spans), NULL);
+    for (i = 0; i < n; ++i) {
+        unsigned long left = copy_to_user(buf + retval, spans[i].ptr, spans[i].len);
+        retval += spans[i].len - left;
+        if (left) {
             printk(KERN_ERR "Failed to copy to user");
-            retval = -EFAULT;
+            break;
         }
+    }
+    if (n && !retval) {
+        retval = -EFAULT; // Nothing could be copied
         goto out;
     }
-    /*Copy to user returned 0 -> success*/
+    /*Copy to user succeeded at least partially*/
 
-    *f_pos += count;
-    retval = count;
+    *f_pos += retval;
 
 out:
     mutex_unlock(&aesd_device.lock);
-    if (byte_rtn) {
-        kfree(byte_rtn);
-    }
+    trace_aesd_read(count, *f_pos, retval, ktime_to_ns(ktime_sub(ktime_get(), start)));
     return retval;
 }
 
+static int aesd_append_partial(struct aesd_dev *dev, const char *data, size_t len)
+{
+    /**
+     * Append bytes to the pending (not yet newline terminated) command of the device
+     * @return Return 0 on success, or -ENOMEM if the command can't be grown
+     */
+
+    char *partial = krealloc(dev->partial, dev->partial_size + len, GFP_KERNEL);
+    if (!partial) {
+        printk(KERN_ERR "Failed to allocate command memory");
+        return -ENOMEM;
+    }
+    memcpy(partial + dev->partial_size, data, len);
+    dev->partial = partial;
+    dev->partial_size += len;
+    return 0;
+}
+
+static void aesd_evict_entry(const struct aesd_buffer_entry *evicted, void *ctx)
+{
+    // Displaced commands are owned by the driver, free them as soon as they leave the buffer
+    trace_aesd_evict(evicted->size);
+    kfree(evicted->buffptr);
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
-    static int cmd_offset = 0;
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-    /**
-     * TODO: handle write
-     */
+    struct aesd_dev *dev = &aesd_device;
+    struct aesd_buffer_entry batch[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    const char *start, *end, *nl;
+    char *chunk;
+    unsigned int lines = 0;
+    ktime_t start_time = ktime_get();
+    u64 commit_ns;
+
+    if (count == 0) {
+        return 0; // kmalloc(0) gives ZERO_SIZE_PTR, nothing to copy nor commit
+    }
 
-    //struct aesd_dev *dev = filp->private_data;
+    // Copy the user data before taking the lock, faults must not stall readers
+    chunk = kmalloc(count, GFP_KERNEL);
+    if (!chunk) {
+        printk(KERN_ERR "Failed to allocate write buffer memory");
+        return retval;
+    }
+    if (copy_from_user(chunk, buf, count) != 0) {
+        printk(KERN_ERR "Failed to copy from user");
+        kfree(chunk);
+        return -EFAULT;
+    }
+    /*Copy from user returned 0 -> success*/
 
-    char *tmp_cmd;
+    if (mutex_lock_interruptible(&dev->lock)) {
+        kfree(chunk);
+        return -ERESTARTSYS;
+    }
 
-    if (!cmd_offset) {
-        cmd = kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-        if (!cmd) {
-            printk(KERN_ERR "Failed to allocate entry memory");
-            return retval;
+    // Every newline terminates a command, all of them are committed under this single lock.
+    // Stamped under the lock, so timestamps never decrease from the oldest entry and range queries can bisect.
+    commit_ns = ktime_get_ns();
+    start = chunk;
+    end = chunk + count;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        if (aesd_append_partial(dev, start, nl + 1 - start)) {
+            goto out;
         }
-        cmd->buffptr = kmalloc(count, GFP_KERNEL);
-        if (!cmd->buffptr) {
-            printk(KERN_ERR "Failed to allocate entry-buffer memory");
-            kfree(cmd);
-            return retval;
-        }
-
-        cmds[cmds_cnt++] = cmd;
-        if (cmds_cnt == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-            cmds_cnt = 0;
+        batch[lines % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].buffptr = dev->partial;
+        batch[lines % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size = dev->partial_size;
+        batch[lines % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].timestamp_ns = commit_ns;
+        batch[lines % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].seq = dev->next_seq++;
+        dev->partial = NULL;
+        dev->partial_size = 0;
+        lines++;
+        start = nl + 1;
+
+        if (lines % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED == 0) {
+            // A full batch replaces the whole buffer
+            aesd_circular_buffer_add_entries(&cbuf, batch, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_evict_entry, NULL);
         }
     }
-
-    if (mutex_lock_interruptible(&aesd_device.lock))
-		return -ERESTARTSYS;
-    
-    tmp_cmd = cmd->buffptr;
-    if (copy_from_user(tmp_cmd + cmd_offset, buf, count) != 0) {
-        printk(KERN_ERR "Failed to copy from user (remaining: %ld ; total: %ld)", retval, count);
-        retval = -EFAULT;
+    // Keep the unterminated tail for the next write
+    if (start < end && aesd_append_partial(dev, start, end - start)) {
         goto out;
     }
-    /*Copy from user returned 0 -> success*/
-
-    cmd_offset += count;
-    if (*(cmd->buffptr + (cmd_offset-1)) == '\n') {
-        *(tmp_cmd + cmd_offset) = '\0';
-        cmd->size = cmd_offset;
-        cmd_offset = 0;
-       
-        // if (cbuf.entry[cbuf.in_offs].buffptr != NULL) {
-        //     // Free old memory before writing new value
-        //     kfree(cbuf.entry[cbuf.in_offs].buffptr);
-        // }
-
-        aesd_circular_buffer_add_entry(&cbuf, cmd);
-        // if (cbuf.in_offs) {
-        //     PDEBUG("Cmd (size = %ld) at %d is %s", cmd->size, (cbuf.in_offs-1), cbuf.entry[(cbuf.in_offs-1)].buffptr);
-        // }
-    } 
-
-    retval = count;
+    start = end;
 
 out:
-    mutex_unlock(&aesd_device.lock);
+    // Commit the remaining lines with a single buffer update
+    aesd_circular_buffer_add_entries(&cbuf, batch, lines % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_evict_entry, NULL);
+    mutex_unlock(&dev->lock);
+    kfree(chunk);
+    if (start > chunk) {
+        retval = start - chunk; // Report the committed bytes even if a later line failed
+    }
+    trace_aesd_write(count, lines, dev->partial_size, retval, ktime_to_ns(ktime_sub(ktime_get(), start_time)));
     return retval;
 }
+
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    /**
+     * AESDCHAR_IOCRANGE: resolve a time window or sequence range to the file positions of its
+     * entries, so it is read with a single pread() of end_fpos - start_fpos bytes at start_fpos
+     * @return 0 on success, or a negative errno
+     */
+
+    struct aesd_range_query query;
+    size_t start_fpos, end_fpos, first, used;
+
+    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR || cmd != AESDCHAR_IOCRANGE)
+        return -ENOTTY;
+    if (copy_from_user(&query, (const void __user *)arg, sizeof(query)))
+        return -EFAULT;
+    if (query.key != AESD_RANGE_BY_TIME && query.key != AESD_RANGE_BY_SEQ)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&aesd_device.lock))
+        return -ERESTARTSYS;
+    query.now_ns = ktime_get_ns();
+    query.entries = aesd_circular_buffer_key_range(&cbuf, query.key == AESD_RANGE_BY_SEQ, query.from, query.to,
+        &start_fpos, &end_fpos, &first);
+    // Sequence numbers are contiguous up to the newest entry, also valid for an empty range
+    used = cbuf.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
+        (cbuf.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - cbuf.out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    query.first_seq = aesd_device.next_seq - used + first;
+    mutex_unlock(&aesd_device.lock);
+
+    query.start_fpos = start_fpos;
+    query.end_fpos = end_fpos;
+    if (copy_to_user((void __user *)arg, &query, sizeof(query)))
+        return -EFAULT;
+    return 0;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
     .write =    aesd_write,
     .open =     aesd_open,
     .release =  aesd_release,
+    .unlocked_ioctl = aesd_unlocked_ioctl,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
@@ -215,7 +269,6 @@ int aesd_init_module(void)
 	memset(&aesd_device, 0, sizeof(struct aesd_dev));
     aesd_circular_buffer_init(&cbuf);
     mutex_init(&aesd_device.lock);
-    cmds_cnt = 0;
 
     result = aesd_setup_cdev(&aesd_device);
     if( result ) {
@@ -228,17 +281,15 @@ void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
     cdev_del(&aesd_device.cdev);
 
-    cmds_cnt = 0;
-    for (; cmds_cnt < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ++cmds_cnt) {  
-        if (cmds[cmds_cnt] != NULL) {
-            if (cmds[cmds_cnt]->buffptr != NULL) {
-                kfree(cmds[cmds_cnt]->buffptr);
-            }
-            kfree(cmds[cmds_cnt]);
-        }
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &cbuf, index) {
+        kfree(entry->buffptr); // NULL for unused entries
     }
+    kfree(aesd_device.partial);
 
     unregister_chrdev_region(devno, 1);
 }
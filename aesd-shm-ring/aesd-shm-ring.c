@@ -0,0 +1,465 @@
+/**
+ * @file aesd-shm-ring.c
+ * @brief Recent-commands log shared between processes, built on the aesd circular buffer
+ *
+ * The memfd holds a header page followed by the payload arena. The header keeps a
+ * struct aesd_circular_buffer whose buffptr are arena positions rather than addresses,
+ * since every process maps the memfd at its own address. Readers translate them into a
+ * local view pointing into their mapping. The arena is mapped twice back to back, so a
+ * command wrapping around the end of the arena is still contiguous in memory.
+ *
+ * Writers reserve arena bytes with an atomic add, copy their commands, then publish them
+ * in reservation order. The index is updated under a sequence counter: readers retry
+ * their snapshot while it is odd or changed, and check after copying that the bytes
+ * weren't reserved again by a later writer.
+ *
+ * A writer killed between its reservation and its publication would block every later
+ * writer. A reservation left unpublished for SHM_RING_STALL_NS is skipped by the writers
+ * waiting behind it, and its writer fails with ETIMEDOUT if it was only stalled.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aesd-shm-ring.h"
+
+#define SHM_RING_MAGIC 0x52534541 // "AESR"
+#define SHM_RING_CACHE_LINE 64
+#define SHM_RING_PUBLISHING (1ULL << 63) // Set in committed while a writer updates the index
+#define SHM_RING_STALL_NS 1000000000ULL // A reservation unpublished for this long is presumed dead
+
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t header_size; // Offset of the arena in the memfd
+    uint64_t data_size; // Size of the arena
+    _Alignas(SHM_RING_CACHE_LINE) _Atomic uint64_t reserved; // Arena bytes reserved by writers since creation
+    _Alignas(SHM_RING_CACHE_LINE) _Atomic uint64_t committed; // Arena bytes published or skipped, always <= reserved
+    _Atomic uint64_t seq; // Odd while index is updated
+    uint64_t commands; // Commands published since creation
+    struct aesd_circular_buffer index; // buffptr holds the arena position of the command
+};
+
+struct aesd_shm_ring {
+    int fd;
+    struct shm_ring_header *hdr;
+    size_t header_size;
+    char *data; // Arena, mapped twice in a row
+    size_t data_size;
+    char *partial; // Pending command of this handle, not yet newline terminated
+    size_t partial_size;
+};
+
+static size_t page_round(size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (len + page - 1) / page * page;
+}
+
+static int ring_map(struct aesd_shm_ring *ring)
+{
+    /**
+     * Map the header and the arena twice back to back
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    ring->hdr = mmap(NULL, ring->header_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->hdr == MAP_FAILED) {
+        ring->hdr = NULL;
+        return -1;
+    }
+
+    // Reserve the address range first so both arena mappings are adjacent
+    ring->data = mmap(NULL, 2 * ring->data_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->data == MAP_FAILED) {
+        ring->data = NULL;
+        return -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (mmap(ring->data + i * ring->data_size, ring->data_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, ring->fd, ring->header_size) == MAP_FAILED) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct aesd_shm_ring *aesd_shm_ring_create(const char *name, size_t data_size)
+{
+    struct aesd_shm_ring *ring = calloc(1, sizeof (*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->header_size = page_round(sizeof (struct shm_ring_header));
+    ring->data_size = page_round(data_size ? data_size : 1);
+
+    ring->fd = memfd_create(name, MFD_CLOEXEC);
+    if (ring->fd == -1 || ftruncate(ring->fd, ring->header_size + ring->data_size) == -1 || ring_map(ring) == -1) {
+        aesd_shm_ring_close(ring);
+        return NULL;
+    }
+
+    // The memfd is zero filled: empty index, no command
+    ring->hdr->header_size = ring->header_size;
+    ring->hdr->data_size = ring->data_size;
+    aesd_circular_buffer_init(&ring->hdr->index);
+    ring->hdr->magic = SHM_RING_MAGIC;
+    return ring;
+}
+
+struct aesd_shm_ring *aesd_shm_ring_attach(int fd)
+{
+    struct stat st;
+    struct shm_ring_header *hdr;
+    struct aesd_shm_ring *ring = calloc(1, sizeof (*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->fd = dup(fd);
+    if (ring->fd == -1 || fstat(ring->fd, &st) == -1) {
+        aesd_shm_ring_close(ring);
+        return NULL;
+    }
+
+    // Read the geometry from the header before mapping the arena
+    hdr = st.st_size >= (off_t)sizeof (*hdr) ?
+        mmap(NULL, sizeof (*hdr), PROT_READ, MAP_SHARED, ring->fd, 0) : MAP_FAILED;
+    if (hdr == MAP_FAILED) {
+        aesd_shm_ring_close(ring);
+        errno = EINVAL;
+        return NULL;
+    }
+    int valid = hdr->magic == SHM_RING_MAGIC && hdr->header_size > 0 && hdr->data_size > 0 &&
+        (uint64_t)st.st_size == hdr->header_size + hdr->data_size;
+    ring->header_size = hdr->header_size;
+    ring->data_size = hdr->data_size;
+    munmap(hdr, sizeof (*hdr));
+    if (!valid) {
+        aesd_shm_ring_close(ring);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (ring_map(ring) == -1) {
+        aesd_shm_ring_close(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+int aesd_shm_ring_fd(const struct aesd_shm_ring *ring)
+{
+    return ring->fd;
+}
+
+void aesd_shm_ring_close(struct aesd_shm_ring *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->hdr != NULL) {
+        munmap(ring->hdr, ring->header_size);
+    }
+    if (ring->data != NULL) {
+        munmap(ring->data, 2 * ring->data_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    free(ring->partial);
+    free(ring);
+}
+
+static uint64_t ring_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int ring_wait_committed(struct aesd_shm_ring *ring, uint64_t start, uint64_t target)
+{
+    /**
+     * Wait until the writers which reserved before start published their bytes up to target.
+     * When committed doesn't move for SHM_RING_STALL_NS, the writer it waits for is presumed
+     * dead and committed is moved to start, skipping every reservation before this one.
+     * A writer dead while it updates the index isn't skipped, the index may be half updated.
+     * @return Return 0 once committed reached target, or -1 if this reservation was skipped (errno ETIMEDOUT)
+     */
+
+    struct shm_ring_header *hdr = ring->hdr;
+    uint64_t seen = UINT64_MAX, since = 0;
+
+    for (;;) {
+        uint64_t committed = atomic_load_explicit(&hdr->committed, memory_order_acquire);
+        uint64_t pos = committed & ~SHM_RING_PUBLISHING;
+        if (pos > start) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (pos >= target) {
+            return 0;
+        }
+        if (committed != seen) {
+            seen = committed;
+            since = ring_now_ns();
+        } else if (!(committed & SHM_RING_PUBLISHING) && ring_now_ns() - since > SHM_RING_STALL_NS) {
+            atomic_compare_exchange_strong_explicit(&hdr->committed, &committed, start,
+                memory_order_acq_rel, memory_order_acquire);
+            continue;
+        }
+        sched_yield();
+    }
+}
+
+static int ring_commit(struct aesd_shm_ring *ring, const char *data, size_t len, const size_t *sizes, size_t n)
+{
+    /**
+     * Copy n commands stored back to back in data into the arena and publish them together
+     * @param len Total size of the commands, at most the arena size
+     * @return Return 0 on success, or -1 if the reservation was skipped as stalled (errno ETIMEDOUT)
+     */
+
+    struct shm_ring_header *hdr = ring->hdr;
+    struct aesd_buffer_entry entries[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint64_t start = atomic_fetch_add(&hdr->reserved, len);
+    uint64_t pos = start, seq, expected = start;
+    size_t i;
+
+    // Readers check the reservation after copying: it must be visible before the bytes change
+    atomic_thread_fence(memory_order_release);
+
+    // Don't overwrite bytes of writers which reserved earlier and are still copying
+    if (ring_wait_committed(ring, start, start + len > ring->data_size ? start + len - ring->data_size : 0) == -1) {
+        return -1;
+    }
+    memcpy(ring->data + start % ring->data_size, data, len);
+
+    // Publish in reservation order, claiming the index so that a waiting writer can't skip this reservation anymore
+    if (ring_wait_committed(ring, start, start) == -1 || !atomic_compare_exchange_strong_explicit(&hdr->committed,
+            &expected, start | SHM_RING_PUBLISHING, memory_order_acq_rel, memory_order_acquire)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        entries[i] = (struct aesd_buffer_entry){ .buffptr = (const char *)(uintptr_t)pos, .size = sizes[i] };
+        pos += sizes[i];
+    }
+    seq = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+    atomic_store_explicit(&hdr->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    aesd_circular_buffer_add_entries(&hdr->index, entries, n, NULL, NULL); // Evicted bytes need no release
+    hdr->commands += n;
+    atomic_store_explicit(&hdr->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&hdr->committed, start + len, memory_order_release);
+    return 0;
+}
+
+static int ring_append_partial(struct aesd_shm_ring *ring, const char *data, size_t len)
+{
+    char *partial = realloc(ring->partial, ring->partial_size + len);
+    if (partial == NULL) {
+        return -1;
+    }
+    memcpy(partial + ring->partial_size, data, len);
+    ring->partial = partial;
+    ring->partial_size += len;
+    return 0;
+}
+
+ssize_t aesd_shm_ring_write(struct aesd_shm_ring *ring, const char *buf, size_t len)
+{
+    const char *start = buf, *end = buf + len, *nl, *batch = buf;
+    size_t sizes[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t n = 0;
+
+    // Complete the pending command of this handle first
+    if (ring->partial_size && (nl = memchr(start, '\n', end - start)) != NULL) {
+        if (ring_append_partial(ring, start, nl + 1 - start) == -1) {
+            return -1;
+        }
+        size_t size = ring->partial_size;
+        ring->partial_size = 0;
+        if (size > ring->data_size) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (ring_commit(ring, ring->partial, size, &size, 1) == -1) {
+            return -1;
+        }
+        start = batch = nl + 1;
+    }
+
+    // Every newline terminates a command, batches are bounded by the index and the arena
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        size_t size = nl + 1 - start;
+        if (size > ring->data_size) {
+            if (n && ring_commit(ring, batch, start - batch, sizes, n) == -1) {
+                return -1;
+            }
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (n == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED || (size_t)(start - batch) + size > ring->data_size) {
+            if (ring_commit(ring, batch, start - batch, sizes, n) == -1) {
+                return -1;
+            }
+            batch = start;
+            n = 0;
+        }
+        sizes[n++] = size;
+        start = nl + 1;
+    }
+    if (n && ring_commit(ring, batch, start - batch, sizes, n) == -1) {
+        return -1;
+    }
+
+    // Keep the unterminated tail for the next write
+    if (start < end && ring_append_partial(ring, start, end - start) == -1) {
+        return -1;
+    }
+    return len;
+}
+
+static uint64_t ring_snapshot(struct aesd_shm_ring *ring, struct aesd_circular_buffer *view,
+            uint64_t *positions, uint64_t *commands_rtn)
+{
+    /**
+     * Copy the index under its sequence counter and translate it into a local view.
+     * Commands already overwritten in the arena are dropped from the view (size 0).
+     * @param positions Receives the arena position of the command of every view entry
+     * @return Return the arena position of the oldest command of the view
+     */
+
+    struct shm_ring_header *hdr = ring->hdr;
+    struct aesd_circular_buffer index;
+    uint64_t seq, commands, reserved, oldest;
+
+    for (;;) {
+        seq = atomic_load_explicit(&hdr->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield(); // A writer is updating the index
+            continue;
+        }
+        memcpy(&index, &hdr->index, sizeof (index));
+        commands = hdr->commands;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&hdr->seq, memory_order_relaxed) == seq) {
+            break;
+        }
+    }
+
+    reserved = atomic_load_explicit(&hdr->reserved, memory_order_acquire);
+    oldest = reserved;
+    *view = index;
+    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ++i) {
+        uint64_t pos = (uintptr_t)index.entry[i].buffptr;
+        positions[i] = pos;
+        view->entry[i].buffptr = ring->data + pos % ring->data_size;
+        if (index.entry[i].size == 0 || reserved - pos > ring->data_size) {
+            view->entry[i].size = 0;
+        } else if (pos < oldest) {
+            oldest = pos;
+        }
+    }
+    if (commands_rtn) {
+        *commands_rtn = commands;
+    }
+    return oldest;
+}
+
+int aesd_shm_ring_view_valid(struct aesd_shm_ring *ring, uint64_t oldest)
+{
+    atomic_thread_fence(memory_order_acquire); // Order the reads of the arena before the check
+    return atomic_load_explicit(&ring->hdr->reserved, memory_order_relaxed) - oldest <= ring->data_size;
+}
+
+uint64_t aesd_shm_ring_view(struct aesd_shm_ring *ring, struct aesd_circular_buffer *view, uint64_t *commands_rtn)
+{
+    uint64_t positions[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    return ring_snapshot(ring, view, positions, commands_rtn);
+}
+
+ssize_t aesd_shm_ring_read(struct aesd_shm_ring *ring, size_t fpos, char *buf, size_t len)
+{
+    struct aesd_circular_buffer view;
+    uint64_t positions[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    size_t offset, copied, slot;
+
+    do {
+        ring_snapshot(ring, &view, positions, NULL);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&view, fpos, &offset);
+        if (entry == NULL) {
+            return 0;
+        }
+
+        // Copy from the entry holding fpos up to the newest command
+        copied = 0;
+        slot = entry - view.entry;
+        do {
+            size_t n = view.entry[slot].size - offset;
+            if (n > len - copied) {
+                n = len - copied;
+            }
+            memcpy(buf + copied, view.entry[slot].buffptr + offset, n);
+            copied += n;
+            offset = 0;
+            slot = (slot + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        } while (slot != view.in_offs && copied < len);
+    } while (!aesd_shm_ring_view_valid(ring, positions[entry - view.entry]));
+
+    return copied;
+}
+
+ssize_t aesd_shm_ring_tail(struct aesd_shm_ring *ring, uint64_t *cursor, char *buf, size_t len)
+{
+    struct aesd_circular_buffer view;
+    uint64_t positions[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint64_t commands, first, next, oldest;
+    size_t used, copied, k;
+
+    do {
+        ring_snapshot(ring, &view, positions, &commands);
+        used = view.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
+            (view.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - view.out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        first = commands - used; // Number of the oldest buffered command
+        next = *cursor < first ? first : *cursor;
+        if (next >= commands) {
+            *cursor = next > *cursor ? next : *cursor;
+            return 0;
+        }
+
+        // Copy whole commands, skipping the ones already overwritten in the arena
+        copied = 0;
+        oldest = UINT64_MAX;
+        for (k = next - first; k < used; ++k, ++next) {
+            const struct aesd_buffer_entry *entry = &view.entry[(view.out_offs + k) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+            if (entry->size == 0) {
+                continue;
+            }
+            if (copied + entry->size > len) {
+                break;
+            }
+            if (oldest == UINT64_MAX) {
+                oldest = positions[(view.out_offs + k) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+            }
+            memcpy(buf + copied, entry->buffptr, entry->size);
+            copied += entry->size;
+        }
+    } while (copied && !aesd_shm_ring_view_valid(ring, oldest));
+
+    if (copied == 0 && k < used) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    *cursor = next;
+    return copied;
+}
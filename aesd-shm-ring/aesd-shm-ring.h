@@ -0,0 +1,87 @@
+/*
+ * aesd-shm-ring.h
+ *
+ * Bounded recent-commands log shared between processes through a memfd,
+ * with the newline command semantics of /dev/aesdchar but without syscalls
+ * on the write and read paths.
+ */
+
+#ifndef AESD_SHM_RING_H
+#define AESD_SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+struct aesd_shm_ring;
+
+/**
+ * Create a ring in a new memfd, share it with aesd_shm_ring_fd (fork, SCM_RIGHTS or /proc/<pid>/fd/<fd>)
+ * @param name Name of the memfd, shown in /proc/<pid>/fd
+ * @param data_size Bytes of the payload arena, rounded up to the page size. Commands are dropped once
+ *      either AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED newer commands or data_size newer bytes were written.
+ * @return Return the ring handle, or NULL if an error occure
+ */
+struct aesd_shm_ring *aesd_shm_ring_create(const char *name, size_t data_size);
+
+/**
+ * Map a ring created by another process (or another handle of this one)
+ * @return Return the ring handle, or NULL if an error occure (errno EINVAL if fd doesn't hold a ring)
+ */
+struct aesd_shm_ring *aesd_shm_ring_attach(int fd);
+
+/**
+ * File descriptor of the memfd backing the ring
+ */
+int aesd_shm_ring_fd(const struct aesd_shm_ring *ring);
+
+/**
+ * Unmap the ring and close the handle. The ring lives on while another process maps it.
+ */
+void aesd_shm_ring_close(struct aesd_shm_ring *ring);
+
+/**
+ * Write bytes to the ring. Every newline terminates a command, the commands of one call are
+ * published together. An unterminated tail is kept by this handle until a later write completes it.
+ * Concurrent writers (threads or processes) are ordered by their reservation of the arena.
+ * A writer dying in the middle of a write would block the later writers: a reservation left
+ * unpublished for a second is skipped, so a writer stalled that long fails with ETIMEDOUT.
+ * A writer dying while it publishes its commands, a few stores, still wedges the ring.
+ * @return Return len, or -1 if an error occure (errno EMSGSIZE if a command is larger than the arena,
+ *      ETIMEDOUT if the commands were skipped as stalled)
+ */
+ssize_t aesd_shm_ring_write(struct aesd_shm_ring *ring, const char *buf, size_t len);
+
+/**
+ * Read bytes at fpos of the concatenation of the buffered commands, like a read of /dev/aesdchar
+ * @return Return the number of bytes read, 0 if fpos is beyond the buffered commands
+ */
+ssize_t aesd_shm_ring_read(struct aesd_shm_ring *ring, size_t fpos, char *buf, size_t len);
+
+/**
+ * Copy the whole commands published since *cursor (a command number, 0 for the first command
+ * ever written) and advance *cursor past them. Commands already dropped are skipped.
+ * @return Return the number of bytes copied, 0 if no new command, or -1 if an error occure
+ *      (errno ENOBUFS if the next command doesn't fit in len)
+ */
+ssize_t aesd_shm_ring_tail(struct aesd_shm_ring *ring, uint64_t *cursor, char *buf, size_t len);
+
+/**
+ * Snapshot the buffered commands into a local circular buffer whose buffptr point into the shared
+ * arena, for aesd_circular_buffer_find_entry_offset_for_fpos and aesd_circular_buffer_spans.
+ * The bytes may be overwritten by later writes, check aesd_shm_ring_view_valid after using them.
+ * @param commands_rtn is a pointer to store the number of commands written since the ring was created,
+ *      may be NULL
+ * @return the arena position of the oldest command of the view, to pass to aesd_shm_ring_view_valid
+ */
+uint64_t aesd_shm_ring_view(struct aesd_shm_ring *ring, struct aesd_circular_buffer *view, uint64_t *commands_rtn);
+
+/**
+ * Check the commands of a view weren't overwritten since aesd_shm_ring_view returned oldest
+ * @return Return 1 if every command of the view is intact, or 0 if not
+ */
+int aesd_shm_ring_view_valid(struct aesd_shm_ring *ring, uint64_t oldest);
+
+#endif /* AESD_SHM_RING_H */
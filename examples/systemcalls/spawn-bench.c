@@ -0,0 +1,88 @@
+/*
+ * Launch latency of do_exec (posix_spawn) against fork + execv as the parent RSS grows.
+ * fork copies the page tables of the parent, posix_spawn shares them until the exec.
+ *
+ * Usage: spawn-bench [launches]
+ * The RSS steps larger than the available memory are skipped.
+ */
+
+#include "systemcalls.h"
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define MB (1024UL * 1024UL)
+
+static const size_t rss_steps[] = { 10 * MB, 100 * MB, 1024 * MB, 4096 * MB };
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool fork_exec(char *command[])
+{
+    /**
+     * The fork + execv launch do_exec used before posix_spawn
+     * @return true if the command exited with status 0
+     */
+
+    int status;
+    pid_t pid = fork();
+    if (pid == 0/*Child*/) {
+        execv(command[0], command);
+        _exit(EXIT_FAILURE);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) == -1) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int launches = argc > 1 ? atoi(argv[1]) : 200;
+    char *command[] = { "/bin/true", NULL };
+    size_t available = (size_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    char *rss = NULL;
+    size_t rss_size = 0;
+
+    if (launches < 1) launches = 1;
+    /*do_exec reports every child on stdout, the results go to stderr*/
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0 || dup2(null_fd, 1/*stdout*/) < 0) { perror("open() failed"); return 1; }
+
+    fprintf(stderr, "%10s %16s %16s\n", "RSS_MB", "FORK_EXEC_us", "POSIX_SPAWN_us");
+    for (size_t i = 0; i < sizeof (rss_steps) / sizeof (rss_steps[0]); ++i) {
+        size_t size = rss_steps[i];
+        if (size > rss_size + available * 3 / 4) {
+            fprintf(stderr, "%10zu %16s %16s\n", size / MB, "skipped", "skipped");
+            continue;
+        }
+        char *grown = realloc(rss, size);
+        if (grown == NULL) { perror("realloc() failed"); break; }
+        rss = grown;
+        memset(rss, 1, size); /*Touch every page so it is resident and mapped*/
+        available -= size - rss_size;
+        rss_size = size;
+
+        double start = now_us();
+        for (int j = 0; j < launches; ++j) {
+            if (!fork_exec(command)) { fprintf(stderr, "fork_exec failed\n"); return 1; }
+        }
+        double forked = (now_us() - start) / launches;
+
+        start = now_us();
+        for (int j = 0; j < launches; ++j) {
+            if (!do_exec(1, command[0])) { fprintf(stderr, "do_exec failed\n"); return 1; }
+        }
+        double spawned = (now_us() - start) / launches;
+        fprintf(stderr, "%10zu %16.1f %16.1f\n", size / MB, forked, spawned);
+    }
+    free(rss);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <unistd.h>
 #include <sys/wait.h>
@@ -6,6 +7,14 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+extern char **environ;
 
 /**
  * @param cmd the command to execute with system()
@@ -21,6 +30,52 @@ bool do_system(const char *cmd)
     return true;
 }
 
+static bool spawn_and_wait(char *command[], int out_fd)
+{
+    /**
+     * Launch command with posix_spawn, which clones the parent without copying its page tables
+     * (CLONE_VM|CLONE_VFORK in glibc) so the launch cost doesn't grow with the parent RSS.
+     * @param out_fd File descriptor the stdout of the command is redirected to, or -1 to keep stdout
+     * @return true if the command was launched and exited with status 0
+     */
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *actions_ptr = NULL;
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_init(&actions);
+        if (posix_spawn_file_actions_adddup2(&actions, out_fd, 1/*stdout*/) != 0) {
+            perror("posix_spawn_file_actions_adddup2() failed");
+            posix_spawn_file_actions_destroy(&actions);
+            return false;
+        }
+        actions_ptr = &actions;
+    }
+
+    bool success = true;
+    pid_t pid;
+    fflush(stdout);
+    int rc = posix_spawn(&pid, command[0], actions_ptr, NULL, command, environ);
+    if (actions_ptr) posix_spawn_file_actions_destroy(actions_ptr);
+    if (rc != 0) {
+        /*The exec failure of the child is reported to the parent by posix_spawn*/
+        fprintf(stderr, "***ERROR: posix_spawn() failed with return value %d: %s\n", rc, strerror(rc));
+        return false;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1/*Wait for child to terminate*/) { perror("wait() failed"); success = false; }
+    else { 
+        if (WIFEXITED(status)) { 
+            rc = WEXITSTATUS(status);
+            printf("Child exited, rc=%d\n", rc); 
+            success = (rc == 0) ? true : false;
+        } else if (WIFSIGNALED(status)) { printf("Child killed by signal %d\n", WTERMSIG(status)); success = false;
+        } else if (WIFSTOPPED(status)) { printf("Child stopped by signal %d\n", WSTOPSIG(status)); 
+        } else if (WIFCONTINUED(status)) { printf("Child continued\n"); }
+     }
+    return success;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -30,8 +85,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of the
+*   posix_spawn or waitpid command, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -46,39 +101,14 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-
-    bool success = true;
-    int pid;
-    fflush(stdout);
-    pid = fork();
-    if (pid == 0/*Child*/) {
-        int rc;
-        rc = execv (command[0], command); /*Replace Child process with shell command process*/
-        /*This code below is reached means that execv() failed with rc=-1*/
-        fprintf(stderr, "***ERROR: execv() failed with return value %d: %s\n", rc, strerror(errno));
-        exit(EXIT_FAILURE); 
-    } else if (pid > 0/*Parent*/) {
-        int status;
-        if (waitpid(pid, &status, 0) == -1/*Wait for child to terminate*/) { perror("wait() failed"); success = false; }
-        else { 
-            if (WIFEXITED(status)) { 
-                int rc = WEXITSTATUS(status);
-                printf("Child exited, rc=%d\n", rc); 
-                success = (rc == 0) ? true : false;
-            } else if (WIFSIGNALED(status)) { printf("Child killed by signal %d\n", WTERMSIG(status)); 
-            } else if (WIFSTOPPED(status)) { printf("Child stopped by signal %d\n", WSTOPSIG(status)); 
-            } else if (WIFCONTINUED(status)) { printf("Child continued\n"); }
-         }
-    } else { perror ("fork() failed"); success = false; }
-
     va_end(args);
 
-    return success;
+    return spawn_and_wait(command, -1);
 }
 
 /**
 * @param outputfile - The full path to the file to write with command output.
-*   This file will be closed at completion of the function call.
+*   The file is truncated, and closed at completion of the function call.
 * All other parameters, see do_exec above
 */
 bool do_exec_redirect(const char *outputfile, int count, ...)
@@ -92,38 +122,214 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
 
-    int fd = open (outputfile, O_WRONLY | O_CREAT, 644);
+    /*O_CLOEXEC keeps the descriptor out of the command, which only gets it as stdout*/
+    int fd = open (outputfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
     if (fd < 0) { perror ("open() failed"); return false; }
 
+    bool success = spawn_and_wait(command, fd);
+    close(fd);
+
+    return success;
+}
+
+#define BATCH_EVENT_EXIT 0x1 /*Tag of the pidfd events, the pipe events are tagged 0*/
+
+struct batch_child {
+    pid_t pid;
+    int pidfd;              /*-1 without pidfd support, the exit is then awaited on the pipe EOF*/
+    int pipe_fd;            /*-1 once the EOF was read*/
+    bool exited;
+    bool failed;            /*The output couldn't be captured, the command fails whatever its status*/
+    size_t output_cap;
+};
+
+static uint64_t batch_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool batch_launch(struct exec_command *command, struct batch_child *child, int epfd, size_t index)
+{
+    /**
+     * Spawn a command with its stdout on a pipe, and watch the pipe and the pidfd of the child
+     * @return true if the command was launched
+     */
+
+    int fds[2];
+    posix_spawn_file_actions_t actions;
+    child->pid = 0;
+    child->pidfd = child->pipe_fd = -1;
+    if (pipe2(fds, O_CLOEXEC) != 0) { perror("pipe2() failed"); return false; }
+    posix_spawn_file_actions_init(&actions);
+    int rc = posix_spawn_file_actions_adddup2(&actions, fds[1], 1/*stdout*/);
+    if (rc == 0) rc = posix_spawn(&child->pid, command->argv[0], &actions, NULL, command->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (rc != 0) {
+        fprintf(stderr, "***ERROR: posix_spawn() failed with return value %d: %s\n", rc, strerror(rc));
+        close(fds[0]);
+        return false;
+    }
+
+    child->pipe_fd = fds[0];
+    child->pidfd = syscall(SYS_pidfd_open, child->pid, 0);
+    child->exited = false;
+    child->failed = false;
+    child->output_cap = 0;
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = index << 1 };
+    bool watched = epoll_ctl(epfd, EPOLL_CTL_ADD, child->pipe_fd, &event) == 0;
+    if (watched && child->pidfd >= 0) {
+        event.data.u64 = (index << 1) | BATCH_EVENT_EXIT;
+        watched = epoll_ctl(epfd, EPOLL_CTL_ADD, child->pidfd, &event) == 0;
+    }
+    if (!watched) {
+        /*The batch would wait forever for a child it doesn't watch, stop it right away*/
+        perror("epoll_ctl() failed");
+        kill(child->pid, SIGKILL);
+        while (waitpid(child->pid, NULL, 0) == -1 && errno == EINTR);
+        close(child->pipe_fd); /*Removes it from the epoll set*/
+        if (child->pidfd >= 0) close(child->pidfd);
+        child->pid = 0;
+        child->pidfd = child->pipe_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void batch_read(struct exec_command *command, struct batch_child *child)
+{
+    /**
+     * Append the bytes available on the pipe of a child to its output, close the pipe on EOF
+     */
+
+    for (;;) {
+        if (command->output_len + 4096 + 1 > child->output_cap) {
+            size_t cap = child->output_cap ? 2 * child->output_cap : 8192;
+            char *output = realloc(command->output, cap);
+            if (output == NULL) {
+                /*Stop capturing, the child gets EPIPE or SIGPIPE on its next write*/
+                fprintf(stderr, "***ERROR: Failed to allocate %zu bytes of output\n", cap);
+                child->failed = true;
+                close(child->pipe_fd);
+                child->pipe_fd = -1;
+                break;
+            }
+            command->output = output;
+            child->output_cap = cap;
+        }
+        ssize_t sz = read(child->pipe_fd, command->output + command->output_len,
+            child->output_cap - command->output_len - 1);
+        if (sz > 0) {
+            command->output_len += sz;
+            if (poll(&(struct pollfd){ .fd = child->pipe_fd, .events = POLLIN }, 1, 0) <= 0) break;
+            continue;
+        }
+        if (sz == -1 && errno == EINTR) continue;
+        close(child->pipe_fd); /*Removes it from the epoll set*/
+        child->pipe_fd = -1;
+        break;
+    }
+    if (command->output) command->output[command->output_len] = '\0';
+}
+
+static void batch_reap(struct exec_command *command, struct batch_child *child, uint64_t batch_start)
+{
+    /**
+     * Collect the wait status of an exited child, the pid is waited for explicitly so
+     * children launched outside of the batch are left alone
+     */
+
+    int status;
+    while (waitpid(child->pid, &status, 0) == -1 && errno == EINTR);
+    command->duration_ns = batch_now_ns() - batch_start - command->start_ns;
+    command->status = status;
+    command->success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (child->pidfd >= 0) close(child->pidfd);
+    child->pidfd = -1;
+    child->exited = true;
+}
+
+bool do_exec_batch(struct exec_command *commands, size_t count, int max_running)
+{
+    for (size_t i = 0; i < count; ++i) {
+        commands[i].success = false;
+        commands[i].status = -1;
+        commands[i].output = NULL;
+        commands[i].output_len = 0;
+        commands[i].start_ns = commands[i].duration_ns = 0;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { perror("epoll_create1() failed"); return false; }
+    struct batch_child *children = calloc(count ? count : 1, sizeof (struct batch_child));
+    if (children == NULL) {
+        fprintf(stderr, "***ERROR: Failed to allocate the batch of %zu commands\n", count);
+        close(epfd);
+        return false;
+    }
+    uint64_t batch_start = batch_now_ns();
+    size_t next = 0, done = 0;
+    int running = 0;
     bool success = true;
-    int pid;
+
+    if (max_running < 1) max_running = 1;
+
     fflush(stdout);
-    pid = fork();
-    if (pid == 0/*Child*/) {
-        if (dup2(fd, 1/*stdout*/) < 0) { perror("dups() failed"); success = false; }
-        else {
-            int rc;
-            rc = execv (command[0], command); /*Replace Child process with shell command process*/
-            /*This code below is reached means that execv() failed with rc=-1*/
-            fprintf(stderr, "***ERROR: execv() failed with return value %d: %s\n", rc, strerror(errno));
+    while (done < count) {
+        while (running < max_running && next < count) {
+            commands[next].start_ns = batch_now_ns() - batch_start;
+            if (batch_launch(&commands[next], &children[next], epfd, next)) {
+                running++;
+            } else {
+                success = false;
+                done++;
+            }
+            next++;
         }
-    } else if (pid > 0/*Parent*/) {
-        int status;
-        if (wait(&status) == -1/*Wait for child to terminate*/) { perror("wait() failed"); success = false; }
-        else { 
-            if (WIFEXITED(status)) { 
-                int rc = WEXITSTATUS(status);
-                printf("Child exited, rc=%d\n", rc); 
-                success = rc == 0 ? true : false;
-            } else if (WIFSIGNALED(status)) { printf("Child killed by signal %d\n", WTERMSIG(status)); 
-            } else if (WIFSTOPPED(status)) { printf("Child stopped by signal %d\n", WSTOPSIG(status)); 
-            } else if (WIFCONTINUED(status)) { printf("Child continued\n"); }
-         }
-    } else { perror ("fork() failed"); success = false; }
+        if (running == 0) continue;
 
-    close(fd);
-    va_end(args);
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() failed");
+            success = false;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            size_t index = events[i].data.u64 >> 1;
+            struct exec_command *command = &commands[index];
+            struct batch_child *child = &children[index];
+            if (events[i].data.u64 & BATCH_EVENT_EXIT) {
+                if (!child->exited) batch_reap(command, child, batch_start);
+            } else if (child->pipe_fd >= 0) {
+                batch_read(command, child);
+                /*Without pidfd the EOF of the pipe stands for the exit*/
+                if (child->pipe_fd < 0 && child->pidfd < 0 && !child->exited) batch_reap(command, child, batch_start);
+            }
+            /*A command is done once exited and its pipe drained up to EOF*/
+            if (child->exited && child->pipe_fd < 0 && child->pid > 0) {
+                child->pid = 0;
+                if (child->failed) command->success = false;
+                success = success && command->success;
+                running--;
+                done++;
+            }
+        }
+    }
 
+    if (done < count) {
+        /*epoll failed, don't leave zombies behind*/
+        for (size_t i = 0; i < next; ++i) {
+            if (children[i].pid > 0 && !children[i].exited) batch_reap(&commands[i], &children[i], batch_start);
+            if (children[i].pipe_fd >= 0) close(children[i].pipe_fd);
+        }
+    }
+    free(children);
+    close(epfd);
     return success;
 }
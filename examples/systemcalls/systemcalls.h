@@ -1,9 +1,31 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * A command of do_exec_batch, argv is set by the caller, the other fields are results
+ */
+struct exec_command {
+    char **argv;            /*NULL terminated, argv[0] is the full path of the command*/
+    bool success;           /*The command was launched and exited with status 0*/
+    int status;             /*Wait status of the command, -1 if it couldn't be launched*/
+    char *output;           /*Null terminated stdout of the command, malloc'd, free it after use*/
+    size_t output_len;
+    uint64_t start_ns;      /*Launch time since the start of the batch*/
+    uint64_t duration_ns;   /*Launch to exit*/
+};
+
+/**
+ * Run a batch of commands, at most max_running at a time, capturing the stdout of each
+ * in exec_command.output. The exits are tracked with a pidfd per command in an epoll set.
+ * @return true if every command was executed successfully, false otherwise (see exec_command.success)
+ */
+bool do_exec_batch(struct exec_command *commands, size_t count, int max_running);
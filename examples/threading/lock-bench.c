@@ -0,0 +1,359 @@
+/*
+ * Lock contention benchmark: threads repeatedly think, lock, hold and unlock a shared lock,
+ * the way start_thread_obtaining_mutex threads obtain and hold their mutex, but in a loop
+ * and with busy waits so the numbers measure the lock rather than the scheduler.
+ * Every lock reports its throughput, its fairness (acquisitions per thread and Jain's index)
+ * and percentiles of the time taken to acquire it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define ERROR_LOG(msg,...) printf("lock-bench ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define MAX_THREADS 256
+#define HIST_SUB_BITS 2 // 4 buckets per power of 2, percentiles are within 19%
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+struct ticket_lock {
+    atomic_uint next;
+    atomic_uint serving;
+};
+
+/*Futex lock of "Futexes Are Tricky": 0 unlocked, 1 locked, 2 locked with waiters*/
+struct futex_lock {
+    atomic_int state;
+};
+
+union lock {
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spin;
+    struct ticket_lock ticket;
+    struct futex_lock futex;
+};
+
+struct lock_ops {
+    const char *name;
+    void (*init)(union lock *);
+    void (*lock)(union lock *);
+    void (*unlock)(union lock *);
+    void (*destroy)(union lock *);
+};
+
+struct bench_thread {
+    _Alignas(64) pthread_t id; // Keep the counters of threads on distinct cache lines
+    unsigned long acquisitions;
+    uint64_t hist[HIST_BUCKETS]; // Acquire latencies in ns
+};
+
+static int help_flag;
+static int threads_cnt = 4;
+static long hold_ns = 100;
+static long think_ns = 500;
+static double duration_s = 1.0;
+static const char *locks_list = "mutex,adaptive,spin,ticket,futex";
+
+static const struct lock_ops *ops;
+static union lock shared_lock;
+static volatile unsigned long shared_counter; // The data the lock protects
+static atomic_bool stop;
+static pthread_barrier_t start_barrier;
+static struct bench_thread threads[MAX_THREADS];
+
+static void print_usage (const char*);
+static void parse_cmdline_args (int, char *[]);
+static void run_bench (const struct lock_ops *);
+
+static void mutex_init (union lock *l) { pthread_mutex_init(&l->mutex, NULL); }
+static void mutex_lock (union lock *l) { pthread_mutex_lock(&l->mutex); }
+static void mutex_unlock (union lock *l) { pthread_mutex_unlock(&l->mutex); }
+static void mutex_destroy (union lock *l) { pthread_mutex_destroy(&l->mutex); }
+
+static void adaptive_init (union lock *l) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP); // Spins a while before sleeping
+    pthread_mutex_init(&l->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void spin_init (union lock *l) { pthread_spin_init(&l->spin, PTHREAD_PROCESS_PRIVATE); }
+static void spin_lock (union lock *l) { pthread_spin_lock(&l->spin); }
+static void spin_unlock (union lock *l) { pthread_spin_unlock(&l->spin); }
+static void spin_destroy (union lock *l) { pthread_spin_destroy(&l->spin); }
+
+static void ticket_init (union lock *l) {
+    atomic_init(&l->ticket.next, 0);
+    atomic_init(&l->ticket.serving, 0);
+}
+
+static void ticket_lock (union lock *l) {
+    unsigned int ticket = atomic_fetch_add_explicit(&l->ticket.next, 1, memory_order_relaxed);
+    while (atomic_load_explicit(&l->ticket.serving, memory_order_acquire) != ticket) {
+        cpu_relax();
+    }
+}
+
+static void ticket_unlock (union lock *l) {
+    unsigned int serving = atomic_load_explicit(&l->ticket.serving, memory_order_relaxed);
+    atomic_store_explicit(&l->ticket.serving, serving + 1, memory_order_release);
+}
+
+static void no_destroy (union lock *l) { (void)l; }
+
+static void futex_init (union lock *l) { atomic_init(&l->futex.state, 0); }
+
+static void futex_lock (union lock *l) {
+    int c = 0;
+    if (atomic_compare_exchange_strong(&l->futex.state, &c, 1)) {
+        return;
+    }
+    if (c != 2) {
+        c = atomic_exchange(&l->futex.state, 2);
+    }
+    while (c != 0) {
+        syscall(SYS_futex, &l->futex.state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = atomic_exchange(&l->futex.state, 2);
+    }
+}
+
+static void futex_unlock (union lock *l) {
+    if (atomic_fetch_sub(&l->futex.state, 1) != 1) {
+        atomic_store(&l->futex.state, 0);
+        syscall(SYS_futex, &l->futex.state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static const struct lock_ops all_locks[] = {
+    { "mutex", mutex_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "adaptive", adaptive_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "spin", spin_init, spin_lock, spin_unlock, spin_destroy },
+    { "ticket", ticket_init, ticket_lock, ticket_unlock, no_destroy },
+    { "futex", futex_init, futex_lock, futex_unlock, no_destroy },
+};
+
+int main(int argc, char* argv[]) {
+    parse_cmdline_args(argc, argv);
+
+    printf("%d threads, hold %ld ns, think %ld ns, %.1f s per lock\n", threads_cnt, hold_ns, think_ns, duration_s);
+    printf("%-9s %12s %8s %10s %10s %8s %8s %8s %8s\n", "LOCK", "ACQUIRES/s", "JAIN", "MIN_ACQ", "MAX_ACQ",
+        "P50_ns", "P90_ns", "P99_ns", "P999_ns");
+    char *list = strdup(locks_list);
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        const struct lock_ops *found = NULL;
+        for (size_t i = 0; i < sizeof (all_locks) / sizeof (all_locks[0]); ++i) {
+            if (strcmp(all_locks[i].name, name) == 0) {
+                found = &all_locks[i];
+            }
+        }
+        if (found == NULL) {
+            ERROR_LOG("Unknown lock %s.", name);
+            exit(1);
+        }
+        run_bench(found);
+    }
+    free(list);
+    return 0;
+}
+
+static void print_usage (const char* command_name) {
+    printf ("Usage: %s [-n <threads>] [-H <hold_ns>] [-T <think_ns>] [-d <seconds>] [-l <locks>]\n", command_name);
+    printf ( "Parameters:\n");
+    printf ( "-n, --threads <threads> : Number of contending threads (default: 4).\n");
+    printf ( "-H, --hold <hold_ns> : Busy time holding the lock per acquisition (default: 100).\n");
+    printf ( "-T, --think <think_ns> : Busy time between a release and the next acquisition (default: 500).\n");
+    printf ( "-d, --duration <seconds> : Duration of the run of every lock (default: 1).\n");
+    printf ( "-l, --locks <locks> : Comma separated locks among mutex,adaptive,spin,ticket,futex (default: all).\n");
+    exit(1);
+}
+
+static void parse_cmdline_args (int argc, char *argv[]) {
+    static struct option long_options[] =
+    {
+        /* These options set a flag. */
+        {"help",        no_argument,            &help_flag,       1},
+        /* These options don’t set a flag.*/
+        {"threads",     required_argument,      0,              'n'},
+        {"hold",        required_argument,      0,              'H'},
+        {"think",       required_argument,      0,              'T'},
+        {"duration",    required_argument,      0,              'd'},
+        {"locks",       required_argument,      0,              'l'},
+        {0, 0, 0, 0}
+    };
+
+    int option;
+    int option_index = 0;
+    while ((option = getopt_long (argc, argv, "hn:H:T:d:l:", long_options, &option_index)) != -1){
+        switch (option)
+        {
+        case 'h':
+            print_usage (argv[0]);
+            break;
+        case 'n':
+            threads_cnt = atoi(optarg);
+            break;
+        case 'H':
+            hold_ns = atol(optarg);
+            break;
+        case 'T':
+            think_ns = atol(optarg);
+            break;
+        case 'd':
+            duration_s = atof(optarg);
+            break;
+        case 'l':
+            locks_list = optarg;
+            break;
+        }
+    }
+
+    if (help_flag || optind != argc) print_usage (argv[0]);
+    if (threads_cnt < 1) threads_cnt = 1;
+    if (threads_cnt > MAX_THREADS) threads_cnt = MAX_THREADS;
+    if (duration_s <= 0) duration_s = 1.0;
+}
+
+static inline uint64_t now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void busy_wait (long ns) {
+    if (ns <= 0) {
+        return;
+    }
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end) {
+        cpu_relax();
+    }
+}
+
+static inline int hist_bucket (uint64_t ns) {
+    if (ns < (1 << HIST_SUB_BITS)) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_value (int bucket) {
+    /**
+     * Lower bound of the latencies counted in a bucket
+     */
+
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    return (1ULL << msb) | (sub << (msb - HIST_SUB_BITS));
+}
+
+static void* contend (void *_args) {
+    /**
+     * Contending thread: think, lock, hold, unlock until the run stops
+     * @param _args The bench_thread of this thread
+     * @return NULL
+     */
+
+    struct bench_thread *self = (struct bench_thread *)_args;
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        busy_wait(think_ns);
+        uint64_t start = now_ns();
+        ops->lock(&shared_lock);
+        uint64_t acquired = now_ns();
+        shared_counter++;
+        busy_wait(hold_ns);
+        ops->unlock(&shared_lock);
+        self->acquisitions++;
+        self->hist[hist_bucket(acquired - start)]++;
+    }
+    return NULL;
+}
+
+static void run_bench (const struct lock_ops *lock_ops) {
+
+    /**
+     * Run the contending threads on a lock and print its line of results
+     */
+
+    uint64_t hist[HIST_BUCKETS] = {0};
+    unsigned long total = 0, min_acq = ~0UL, max_acq = 0;
+    double sum_sq = 0;
+
+    ops = lock_ops;
+    ops->init(&shared_lock);
+    shared_counter = 0;
+    atomic_store(&stop, false);
+    memset(threads, 0, sizeof (threads));
+    pthread_barrier_init(&start_barrier, NULL, threads_cnt + 1);
+    for (int i = 0; i < threads_cnt; ++i) {
+        if (pthread_create(&threads[i].id, NULL, contend, &threads[i]) != 0) {
+            ERROR_LOG("Failed to start thread.");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    usleep(duration_s * 1000000);
+    atomic_store(&stop, true);
+    for (int i = 0; i < threads_cnt; ++i) {
+        pthread_join(threads[i].id, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+    ops->destroy(&shared_lock);
+
+    for (int i = 0; i < threads_cnt; ++i) {
+        unsigned long acq = threads[i].acquisitions;
+        total += acq;
+        sum_sq += (double)acq * acq;
+        if (acq < min_acq) min_acq = acq;
+        if (acq > max_acq) max_acq = acq;
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            hist[b] += threads[i].hist[b];
+        }
+    }
+    if (total != shared_counter) {
+        ERROR_LOG("%s lost updates: %lu acquisitions, counter %lu.", ops->name, total, shared_counter);
+    }
+
+    const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t values[4] = {0};
+    uint64_t seen = 0;
+    int p = 0;
+    for (int b = 0; b < HIST_BUCKETS && p < 4; ++b) {
+        seen += hist[b];
+        while (p < 4 && total > 0 && seen >= percentiles[p] * total) {
+            values[p++] = hist_value(b);
+        }
+    }
+
+    // Jain's fairness index: 1 when every thread acquired as often, 1/threads when one thread did
+    double jain = sum_sq > 0 ? (double)total * total / (threads_cnt * sum_sq) : 0;
+    printf("%-9s %12.0f %8.3f %10lu %10lu %8lu %8lu %8lu %8lu\n", ops->name, total / elapsed, jain, min_acq, max_acq,
+        (unsigned long)values[0], (unsigned long)values[1], (unsigned long)values[2], (unsigned long)values[3]);
+    fflush(stdout);
+}
@@ -3,6 +3,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
@@ -20,7 +28,7 @@ void* threadfunc(void* thread_param)
     DEBUG_LOG("Locking mutex");
     pthread_mutex_lock(pthread_data->mutex);
     DEBUG_LOG("Sleeping for %d ms", pthread_data->wait_to_release_ms);
-    usleep(pthread_data->wait_to_release_ms*100);
+    usleep(pthread_data->wait_to_release_ms*1000);
     DEBUG_LOG("Unlocking mutex");
     pthread_mutex_unlock(pthread_data->mutex);
 
@@ -59,3 +67,282 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     return false;
 }
 
+
+
+/*
+ * Bounded MPMC queue of D. Vyukov: every cell holds a sequence number telling producers
+ * and consumers whether it is theirs for the current lap, so a single CAS on the head
+ * or tail claims a cell.
+ */
+
+struct mpmc_cell {
+    atomic_size_t sequence;
+    void *data;
+};
+
+struct mpmc_queue {
+    struct mpmc_cell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t tail; /*Enqueue position*/
+    _Alignas(64) atomic_size_t head; /*Dequeue position*/
+};
+
+#define FUTURE_PENDING 0
+#define FUTURE_DONE 1
+#define FUTURE_WAITED 2 /*Pending with a waiter sleeping on the state*/
+
+struct thread_future {
+    struct thread_pool *pool;
+    thread_task_fn task;
+    void *arg;
+    void *result;
+    atomic_int state;
+    atomic_int refs; /*The submitter and the worker, the last one to drop it recycles it*/
+    struct thread_data data; /*Argument of the thread_pool_submit_obtaining_mutex tasks*/
+};
+
+struct thread_pool {
+    struct mpmc_queue tasks;
+    struct mpmc_queue free_futures;
+    struct thread_future *futures;
+    sem_t queued; /*Counts the queued tasks, workers sleep on it when the queue is empty*/
+    pthread_t *workers;
+    int workers_cnt;
+};
+
+static bool mpmc_init(struct mpmc_queue *queue, size_t size)
+{
+    queue->cells = malloc(size * sizeof (struct mpmc_cell));
+    if (queue->cells == NULL) return false;
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    return true;
+}
+
+static bool mpmc_enqueue(struct mpmc_queue *queue, void *data)
+{
+    /**
+     * @return true if data was queued, false if the queue is full
+     */
+
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    for (;;) {
+        struct mpmc_cell *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = data;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static bool mpmc_dequeue(struct mpmc_queue *queue, void **data)
+{
+    /**
+     * @return true if an element was dequeued in @param data, false if the queue is empty
+     */
+
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (;;) {
+        struct mpmc_cell *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *data = cell->data;
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+static void future_put(struct thread_future *future)
+{
+    if (atomic_fetch_sub_explicit(&future->refs, 1, memory_order_acq_rel) == 1) {
+        mpmc_enqueue(&future->pool->free_futures, future); /*Never full, it has room for every future*/
+    }
+}
+
+static void* pool_worker(void* pool_param)
+{
+    /**
+     * Run the queued tasks until a NULL task asks the worker to stop
+     */
+
+    struct thread_pool *pool = (struct thread_pool *) pool_param;
+    for (;;) {
+        void *data;
+        while (sem_wait(&pool->queued) != 0);
+        while (!mpmc_dequeue(&pool->tasks, &data)) {
+            sched_yield(); /*The task is being enqueued, sem_post follows the enqueue*/
+        }
+        struct thread_future *future = data;
+        if (future == NULL) break;
+
+        future->result = future->task(future->arg);
+        if (atomic_exchange_explicit(&future->state, FUTURE_DONE, memory_order_acq_rel) == FUTURE_WAITED) {
+            syscall(SYS_futex, &future->state, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+        }
+        future_put(future);
+    }
+    return NULL;
+}
+
+struct thread_pool *thread_pool_create(int workers, size_t queue_size)
+{
+    size_t size = 2;
+    while (size < queue_size) size <<= 1;
+    if (workers < 1) workers = 1;
+
+    struct thread_pool *pool = calloc(1, sizeof (struct thread_pool));
+    if (pool == NULL) return NULL;
+    pool->futures = calloc(size, sizeof (struct thread_future));
+    pool->workers = calloc(workers, sizeof (pthread_t));
+    if (pool->futures == NULL || pool->workers == NULL || !mpmc_init(&pool->tasks, size)
+            || !mpmc_init(&pool->free_futures, size)) {
+        ERROR_LOG("Failed to allocate the thread pool.");
+        free(pool->tasks.cells);
+        free(pool->futures);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        pool->futures[i].pool = pool;
+        mpmc_enqueue(&pool->free_futures, &pool->futures[i]);
+    }
+    sem_init(&pool->queued, 0, 0);
+
+    for (; pool->workers_cnt < workers; ++pool->workers_cnt) {
+        int rc = pthread_create(&pool->workers[pool->workers_cnt], NULL, pool_worker, pool);
+        if (rc != 0) {
+            ERROR_LOG("Failed to start thread. %s", strerror(rc));
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+static struct thread_future *future_take(struct thread_pool *pool)
+{
+    void *data;
+    if (!mpmc_dequeue(&pool->free_futures, &data)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    return data;
+}
+
+static void future_queue(struct thread_future *future, thread_task_fn task, void *arg)
+{
+    future->task = task;
+    future->arg = arg;
+    future->result = NULL;
+    atomic_store_explicit(&future->state, FUTURE_PENDING, memory_order_relaxed);
+    atomic_store_explicit(&future->refs, 2, memory_order_relaxed);
+    /*Every held future has a cell in the task queue, both have the same size*/
+    mpmc_enqueue(&future->pool->tasks, future);
+    sem_post(&future->pool->queued);
+}
+
+struct thread_future *thread_pool_submit(struct thread_pool *pool, thread_task_fn task, void *arg)
+{
+    struct thread_future *future = future_take(pool);
+    if (future) future_queue(future, task, arg);
+    return future;
+}
+
+struct thread_future *thread_pool_submit_obtaining_mutex(struct thread_pool *pool, pthread_mutex_t *mutex,
+        int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct thread_future *future = future_take(pool);
+    if (future == NULL) return NULL;
+    future->data.mutex = mutex;
+    future->data.wait_to_obtain_ms = wait_to_obtain_ms;
+    future->data.wait_to_release_ms = wait_to_release_ms;
+    future->data.thread_complete_success = false;
+    future_queue(future, threadfunc, &future->data);
+    return future;
+}
+
+bool thread_future_wait(struct thread_future *future, int timeout_ms, void **result)
+{
+    struct timespec deadline, now, remaining;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+
+    int state = atomic_load_explicit(&future->state, memory_order_acquire);
+    while (state != FUTURE_DONE) {
+        if (state == FUTURE_PENDING && !atomic_compare_exchange_weak_explicit(&future->state, &state,
+                FUTURE_WAITED, memory_order_acquire, memory_order_acquire)) {
+            continue;
+        }
+        struct timespec *timeout = NULL;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) { remaining.tv_sec--; remaining.tv_nsec += 1000000000L; }
+            if (remaining.tv_sec < 0) return false;
+            timeout = &remaining;
+        }
+        syscall(SYS_futex, &future->state, FUTEX_WAIT_PRIVATE, FUTURE_WAITED, timeout, NULL, 0);
+        state = atomic_load_explicit(&future->state, memory_order_acquire);
+    }
+    if (result) *result = future->result;
+    return true;
+}
+
+void thread_future_release(struct thread_future *future)
+{
+    /*Once the task is done the worker only has to drop its reference, wait for it so that the
+      future is back in the pool when the release returns*/
+    if (atomic_load_explicit(&future->state, memory_order_acquire) == FUTURE_DONE) {
+        while (atomic_load_explicit(&future->refs, memory_order_acquire) > 1) {
+            sched_yield();
+        }
+    }
+    future_put(future);
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    /*A NULL task per worker, queued after the pending tasks*/
+    for (int i = 0; i < pool->workers_cnt; ++i) {
+        while (!mpmc_enqueue(&pool->tasks, NULL)) {
+            sched_yield();
+        }
+        sem_post(&pool->queued);
+    }
+    for (int i = 0; i < pool->workers_cnt; ++i) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    sem_destroy(&pool->queued);
+    free(pool->tasks.cells);
+    free(pool->free_futures.cells);
+    free(pool->futures);
+    free(pool->workers);
+    free(pool);
+}
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <pthread.h>
 
 /**
@@ -53,3 +54,53 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+
+/**
+ * Pool of persistent worker threads running submitted tasks, an alternative to starting a
+ * thread per task. Tasks go through a bounded lock-free MPMC queue, and the future of every
+ * submission comes from a recycled set of descriptors, so a short task costs microseconds.
+ */
+struct thread_pool;
+struct thread_future;
+
+typedef void *(*thread_task_fn)(void *arg);
+
+/**
+* Start @param workers worker threads taking tasks from a queue of @param queue_size tasks
+* (rounded up to a power of 2), which is also the number of futures that can be held at once.
+* @return the pool, or NULL if a failure occurred.
+*/
+struct thread_pool *thread_pool_create(int workers, size_t queue_size);
+
+/**
+* Queue @param task to be called with @param arg by a worker.
+* @return the future of the task, or NULL if every future of the pool is held (errno EAGAIN).
+*/
+struct thread_future *thread_pool_submit(struct thread_pool *pool, thread_task_fn task, void *arg);
+
+/**
+* Same as start_thread_obtaining_mutex, as a task of @param pool. The thread_data is part of the
+* future, the result of the future points to it until the future is released.
+*/
+struct thread_future *thread_pool_submit_obtaining_mutex(struct thread_pool *pool, pthread_mutex_t *mutex,
+        int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Wait up to @param timeout_ms milliseconds (forever if negative) for the task of @param future
+* to complete, and store what it returned in @param result if not NULL.
+* @return true if the task completed, false on timeout.
+*/
+bool thread_future_wait(struct thread_future *future, int timeout_ms, void **result);
+
+/**
+* Give the future back to its pool, whether the task completed or not. The future must not be used after.
+* A future whose task completed is back in the pool when this returns, one released before its
+* task completes is recycled by the worker once the task completes.
+*/
+void thread_future_release(struct thread_future *future);
+
+/**
+* Run the queued tasks, stop the workers and free the pool. Every future must have been released.
+*/
+void thread_pool_destroy(struct thread_pool *pool);
@@ -55,10 +55,8 @@ fi
 # make clean
 # make
 
-for i in $( seq 1 $NUMFILES)
-do
-	/usr/bin/writer -f "$WRITEDIR/${username}$i.txt" -s "$WRITESTR"
-done
+# A single writer process creates all the files, instead of one process per file
+/usr/bin/writer -d "$WRITEDIR" -n "$NUMFILES" -p "${username}%d.txt" -s "$WRITESTR"
 
 OUTPUTSTRING=$(/usr/bin/finder.sh "$WRITEDIR" "$WRITESTR")
 
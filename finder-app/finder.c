@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MMAP_THRESHOLD (64*1024) // Smaller files are read, an mmap costs more than the copy
+#define MAX_WORKERS 256
+#define FILES_CHUNK 64 // Files of a directory searched per task, the next chunks can be stolen while the directory is read
+#define CACHE_MAGIC "AFC1"
+#define CACHE_QUERIES 8 // Search strings whose counts are kept, the least recently used is replaced
+#define CACHE_QUERY_MAX 240
+#define CACHE_UNKNOWN UINT32_MAX
+
+/*
+ * Native replacement of finder.sh: a single parallel walk counts the regular files
+ * (find -type f) and the lines holding the search string (grep -r | wc -l).
+ * Every worker owns a deque of tasks, a directory to read or a chunk of the files of
+ * a directory to search: it pops the newest task it pushed and steals the oldest one
+ * of another worker when its own deque is empty, and sleeps when every deque is empty.
+ *
+ * With -c the counts of every file are kept in a cache file for the next runs:
+ * a header with the cached search strings, then the records sorted by (dev, inode)
+ * and the paths they were found at. The cache is mapped read-only, a file whose
+ * size, mtime and ctime didn't change since is only stat'ed, not read. The cache
+ * is rewritten with the files of this walk, so a cache serves a single tree.
+ * As git does for its index, a file changed at or after the time the cache was
+ * written is read anyway: with coarse timestamps, a rewrite of the same size in
+ * the same tick as the previous run leaves size, mtime and ctime unchanged.
+ */
+
+struct cache_query {
+    uint64_t last_used; // Run number this search string was last searched at, 0 if the slot is free
+    uint32_t len;
+    char str[CACHE_QUERY_MAX];
+};
+
+struct cache_header {
+    char magic[4];
+    uint32_t queries_cnt;
+    uint64_t runs; // Run number of the last run that wrote the cache
+    uint64_t records_cnt;
+    uint64_t paths_size; // Bytes of the paths following the records
+    struct cache_query queries[CACHE_QUERIES];
+};
+
+struct cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t path_off; // Offset of the path in the paths, not null terminated
+    uint32_t path_len;
+    uint32_t counts[CACHE_QUERIES]; // Matching lines of each cached search string, or CACHE_UNKNOWN
+};
+
+struct dir {
+    DIR *handle;
+    int fd;
+    char *path;
+    size_t path_len;
+    atomic_int refs; // The worker reading the directory and every chunk of its files not searched yet
+};
+
+struct task {
+    struct dir *dir; // Directory of the files to search, NULL to read the directory at path
+    char *path;
+    size_t names_cnt;
+    size_t names_size; // Bytes of the null terminated names
+    char names[];
+};
+
+struct worker {
+    _Alignas(64) pthread_t id; // Keep the counters of workers on distinct cache lines
+    pthread_mutex_t lock; // Protects the deque
+    struct task **tasks; // Deque of tasks, [head, tail)
+    size_t head;
+    size_t tail;
+    size_t cap;
+    unsigned long files; // Regular files found
+    unsigned long lines; // Lines matching the search string
+    char *buf; // Read buffer of small files
+    struct cache_record *records; // Files found, to write the cache
+    size_t records_cnt;
+    size_t records_cap;
+    char *paths;
+    size_t paths_size;
+    size_t paths_cap;
+};
+
+static int help_flag;
+static struct worker workers[MAX_WORKERS];
+static int workers_cnt;
+static atomic_long pending; // Tasks pushed but not done yet
+static atomic_int sleepers; // Workers waiting for a task on idle_cond
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static const char *searchstr;
+static size_t searchstr_len;
+static const char *cache_path;
+static const struct cache_header *cache; // Mapped cache of the previous run, or NULL
+static size_t cache_size;
+static int64_t cache_mtime_ns; // Write time of the mapped cache, on the clock of its filesystem
+static struct cache_query cache_queries[CACHE_QUERIES]; // Search strings of the cache this run writes
+static int cache_slot; // Slot of searchstr in cache_queries
+static bool cache_slot_new; // searchstr took the slot, the counts of the previous run are of another string
+static uint64_t cache_runs; // Number of this run
+
+static void print_usage (const char*);
+static void parse_cmdline_args (int, char *[]);
+static void* walk (void *);
+static void cache_load (void);
+static void cache_store (void);
+
+int main(int argc, char* argv[]) {
+    parse_cmdline_args(argc, argv);
+    const char *filesdir = argv[optind];
+    searchstr = argv[optind + 1];
+    searchstr_len = strlen(searchstr);
+
+    struct stat st;
+    if (stat(filesdir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        print_usage(argv[0]);
+    }
+
+    if (cache_path != NULL) {
+        cache_load();
+    }
+    for (int i = 0; i < workers_cnt; ++i) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].buf = malloc(MMAP_THRESHOLD);
+    }
+    struct task *root = calloc(1, sizeof (struct task));
+    workers[0].tasks = malloc(sizeof (struct task *));
+    if (root == NULL || workers[0].tasks == NULL || (root->path = strdup(filesdir)) == NULL) {
+        printf("Failed to allocate the walk.\n");
+        exit(1);
+    }
+    workers[0].tasks[0] = root;
+    workers[0].tail = 1;
+    workers[0].cap = 1;
+    pending = 1;
+
+    for (int i = 0; i < workers_cnt; ++i) {
+        if (pthread_create(&workers[i].id, NULL, walk, &workers[i]) != 0) {
+            printf("Failed to start worker thread.\n");
+            exit(1);
+        }
+    }
+
+    unsigned long files = 0, lines = 0;
+    for (int i = 0; i < workers_cnt; ++i) {
+        pthread_join(workers[i].id, NULL);
+        files += workers[i].files;
+        lines += workers[i].lines;
+        free(workers[i].tasks);
+        free(workers[i].buf);
+    }
+    if (cache_path != NULL) {
+        cache_store();
+    }
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n", files, lines);
+    return 0;
+}
+
+static void print_usage (const char* command_name) {
+    printf ("Usage: %s [-j <threads>] [-c <cache>] <filesdir> <searchstr>\n", command_name);
+    printf ( "Parameters:\n");
+    printf ( "<filesdir> : The directory where files are located.\n");
+    printf ( "<searchstr> : The string to search in all dir-files and subdir-files.\n");
+    printf ( "-j, --threads <threads> : Number of walking threads (default: online cpus).\n");
+    printf ( "-c, --cache <cache> : File caching the counts of every file of filesdir, only the files changed since the last run are read.\n");
+    exit(1);
+}
+
+static void parse_cmdline_args (int argc, char *argv[]) {
+    static struct option long_options[] =
+    {
+        /* These options set a flag. */
+        {"help",        no_argument,            &help_flag,       1},
+        /* These options don’t set a flag.*/
+        {"threads",     required_argument,      0,              'j'},
+        {"cache",       required_argument,      0,              'c'},
+        {0, 0, 0, 0}
+    };
+
+    int option;
+    int option_index = 0;
+    workers_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((option = getopt_long (argc, argv, "hj:c:", long_options, &option_index)) != -1){
+        switch (option)
+        {
+        case 'h':
+            print_usage (argv[0]);
+            break;
+        case 'j':
+            workers_cnt = atoi(optarg);
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        }
+    }
+
+    if (help_flag || argc - optind != 2) print_usage (argv[0]);
+    if (workers_cnt < 1) workers_cnt = 1;
+    if (workers_cnt > MAX_WORKERS) workers_cnt = MAX_WORKERS;
+}
+
+static void push_task (struct worker *self, struct task *task) {
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_lock(&self->lock);
+    if (self->tail == self->cap) {
+        // Compact the stolen head before growing
+        memmove(self->tasks, self->tasks + self->head, (self->tail - self->head) * sizeof (struct task *));
+        self->tail -= self->head;
+        self->head = 0;
+        if (self->tail == self->cap) {
+            size_t cap = self->cap ? 2 * self->cap : 64;
+            struct task **tasks = realloc(self->tasks, cap * sizeof (struct task *));
+            if (tasks == NULL) {
+                printf("Failed to allocate the tasks of a worker.\n");
+                exit(1);
+            }
+            self->tasks = tasks;
+            self->cap = cap;
+        }
+    }
+    self->tasks[self->tail++] = task;
+    pthread_mutex_unlock(&self->lock);
+
+    // Sleepers registered before scanning the deques, either they see the task or they are woken
+    if (atomic_load(&sleepers) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static struct task *pop_task (struct worker *self) {
+
+    /**
+     * Take the newest task of this worker, or steal the oldest one of another worker
+     * @return Return the task, or NULL if every deque is empty
+     */
+
+    struct task *task = NULL;
+    pthread_mutex_lock(&self->lock);
+    if (self->head < self->tail) {
+        task = self->tasks[--self->tail];
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    int start = self - workers;
+    for (int i = 1; task == NULL && i < workers_cnt; ++i) {
+        struct worker *victim = &workers[(start + i) % workers_cnt];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            task = victim->tasks[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return task;
+}
+
+static void task_done (void) {
+    if (atomic_fetch_sub(&pending, 1) == 1) {
+        // The walk is over, release every sleeping worker
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static unsigned long count_lines (const char *data, size_t len) {
+
+    /**
+     * Count the lines holding searchstr, like grep | wc -l. A file holding a NUL byte
+     * is binary for grep, which only reports it on stderr.
+     * @return Return the number of matching lines
+     */
+
+    const char *p = data, *end = data + len, *match, *eol;
+    unsigned long lines = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    while (p < end && (match = memmem(p, end - p, searchstr, searchstr_len)) != NULL) {
+        lines++;
+        eol = memchr(match + searchstr_len, '\n', end - match - searchstr_len);
+        if (eol == NULL) {
+            break;
+        }
+        p = eol + 1;
+    }
+    if (lines && memchr(data, '\0', len) != NULL) {
+        return 0;
+    }
+    return lines;
+}
+
+static unsigned long search_file (struct worker *self, int dirfd, const char *name) {
+
+    /**
+     * Count the lines of a file holding searchstr
+     * @return Return the number of matching lines, 0 if the file can't be read
+     */
+
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    unsigned long lines = 0;
+    struct stat st;
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        if (st.st_size <= MMAP_THRESHOLD) {
+            ssize_t sz = read(fd, self->buf, MMAP_THRESHOLD);
+            if (sz > 0) {
+                lines = count_lines(self->buf, sz);
+            }
+        } else {
+            char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                lines = count_lines(data, st.st_size);
+                munmap(data, st.st_size);
+            }
+        }
+    }
+    close(fd);
+    return lines;
+}
+
+static const struct cache_record *cache_lookup (dev_t dev, ino_t ino) {
+
+    /**
+     * Binary search of a file in the records of the mapped cache
+     * @return Return the record of the file, or NULL if the previous run didn't find it
+     */
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    const struct cache_record *records = (const struct cache_record *)(cache + 1);
+    size_t lo = 0, hi = cache->records_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct cache_record *record = &records[mid];
+        if (record->dev == dev && record->ino == ino) {
+            return record;
+        }
+        if (record->dev < dev || (record->dev == dev && record->ino < ino)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static void cache_file (struct worker *self, int dirfd, const char *dir_path, size_t dir_path_len, const char *name) {
+
+    /**
+     * Count the lines of a file from the cache if it is unchanged since the previous run,
+     * by reading it otherwise, and keep its record for the next run
+     */
+
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    if (self->records_cnt == self->records_cap) {
+        self->records_cap = self->records_cap ? 2 * self->records_cap : 256;
+        self->records = realloc(self->records, self->records_cap * sizeof (struct cache_record));
+    }
+    struct cache_record *record = &self->records[self->records_cnt++];
+    const struct cache_record *cached = cache_lookup(st.st_dev, st.st_ino);
+    record->dev = st.st_dev;
+    record->ino = st.st_ino;
+    record->size = st.st_size;
+    record->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    record->ctime_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+    if (cached != NULL && cached->size == record->size && cached->mtime_ns == record->mtime_ns
+            && cached->ctime_ns == record->ctime_ns && record->mtime_ns < cache_mtime_ns
+            && record->ctime_ns < cache_mtime_ns) {
+        memcpy(record->counts, cached->counts, sizeof (record->counts));
+        if (cache_slot_new) {
+            record->counts[cache_slot] = CACHE_UNKNOWN;
+        }
+    } else {
+        memset(record->counts, 0xff, sizeof (record->counts)); // CACHE_UNKNOWN
+    }
+    if (record->counts[cache_slot] == CACHE_UNKNOWN) {
+        unsigned long lines = search_file(self, dirfd, name);
+        record->counts[cache_slot] = lines < CACHE_UNKNOWN ? lines : CACHE_UNKNOWN - 1;
+    }
+    self->lines += record->counts[cache_slot];
+
+    size_t name_len = strlen(name);
+    if (self->paths_size + dir_path_len + name_len + 1 > self->paths_cap) {
+        self->paths_cap = 2 * (self->paths_cap + dir_path_len + name_len + 1);
+        self->paths = realloc(self->paths, self->paths_cap);
+    }
+    record->path_off = self->paths_size;
+    record->path_len = dir_path_len + name_len + 1;
+    memcpy(self->paths + self->paths_size, dir_path, dir_path_len);
+    self->paths[self->paths_size + dir_path_len] = '/';
+    memcpy(self->paths + self->paths_size + dir_path_len + 1, name, name_len);
+    self->paths_size += record->path_len;
+}
+
+static void dir_put (struct dir *dir) {
+    if (atomic_fetch_sub(&dir->refs, 1) == 1) {
+        closedir(dir->handle);
+        free(dir->path);
+        free(dir);
+    }
+}
+
+static void search_files (struct worker *self, struct task *task) {
+
+    /**
+     * Search the files of a chunk, then drop its reference on their directory
+     */
+
+    struct dir *dir = task->dir;
+    const char *name = task->names;
+    for (size_t i = 0; i < task->names_cnt; ++i) {
+        if (cache_path != NULL) {
+            cache_file(self, dir->fd, dir->path, dir->path_len, name);
+        } else {
+            self->lines += search_file(self, dir->fd, name);
+        }
+        name += strlen(name) + 1;
+    }
+    dir_put(dir);
+}
+
+static struct task *add_file (struct worker *self, struct dir *dir, struct task *chunk, const char *name) {
+
+    /**
+     * Add a file to the chunk being filled, pushing the chunk once it holds FILES_CHUNK files
+     * @return Return the chunk to add the next files to, or NULL if it was pushed
+     */
+
+    size_t name_size = strlen(name) + 1;
+    if (chunk == NULL) {
+        chunk = malloc(sizeof (struct task) + FILES_CHUNK * (NAME_MAX + 1));
+        if (chunk == NULL) {
+            printf("Failed to allocate the files of %s.\n", dir->path);
+            exit(1);
+        }
+        chunk->dir = dir;
+        chunk->path = NULL;
+        chunk->names_cnt = 0;
+        chunk->names_size = 0;
+        atomic_fetch_add(&dir->refs, 1);
+    }
+    memcpy(chunk->names + chunk->names_size, name, name_size);
+    chunk->names_size += name_size;
+    if (++chunk->names_cnt == FILES_CHUNK) {
+        push_task(self, chunk);
+        return NULL;
+    }
+    return chunk;
+}
+
+static void walk_dir (struct worker *self, char *path) {
+
+    /**
+     * Read a directory, pushing its subdirectories and the chunks of its files as tasks.
+     * The last chunk, not full, is searched by this worker.
+     */
+
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct dir *dir = malloc(sizeof (struct dir));
+    if (dirfd == -1 || dir == NULL || (dir->handle = fdopendir(dirfd)) == NULL) {
+        if (dirfd != -1) {
+            close(dirfd);
+        }
+        free(dir);
+        free(path);
+        return;
+    }
+    dir->fd = dirfd;
+    dir->path = path;
+    dir->path_len = strlen(path);
+    atomic_init(&dir->refs, 1);
+
+    struct dirent *entry;
+    struct task *chunk = NULL;
+    size_t path_len = dir->path_len;
+    while ((entry = readdir(dir->handle)) != NULL) {
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            self->files++;
+            chunk = add_file(self, dir, chunk, entry->d_name);
+        } else if (type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            // Symbolic links are not followed, as find and grep -r
+            size_t name_len = strlen(entry->d_name);
+            struct task *subdir = malloc(sizeof (struct task));
+            char *subdir_path = malloc(path_len + name_len + 2);
+            if (subdir == NULL || subdir_path == NULL) {
+                printf("Failed to allocate the subdirectories of %s.\n", path);
+                exit(1);
+            }
+            memcpy(subdir_path, path, path_len);
+            subdir_path[path_len] = '/';
+            memcpy(subdir_path + path_len + 1, entry->d_name, name_len + 1);
+            subdir->dir = NULL;
+            subdir->path = subdir_path;
+            push_task(self, subdir);
+        }
+    }
+    if (chunk != NULL) {
+        search_files(self, chunk);
+        free(chunk);
+    }
+    dir_put(dir);
+}
+
+static void* walk (void *_args) {
+    /**
+     * Worker thread running tasks until none is left
+     * @param _args The worker
+     * @return NULL
+     */
+
+    struct worker *self = (struct worker *)_args;
+    while (atomic_load(&pending) > 0) {
+        struct task *task = pop_task(self);
+        if (task == NULL) {
+            // Register as a sleeper before looking again, so that a push in between wakes this worker
+            pthread_mutex_lock(&idle_lock);
+            atomic_fetch_add(&sleepers, 1);
+            task = pop_task(self);
+            if (task == NULL && atomic_load(&pending) > 0) {
+                pthread_cond_wait(&idle_cond, &idle_lock);
+            }
+            atomic_fetch_sub(&sleepers, 1);
+            pthread_mutex_unlock(&idle_lock);
+            if (task == NULL) {
+                continue;
+            }
+        }
+        if (task->dir == NULL) {
+            walk_dir(self, task->path);
+        } else {
+            search_files(self, task);
+        }
+        free(task);
+        task_done();
+    }
+    return NULL;
+}
+
+static void cache_load (void) {
+
+    /**
+     * Map the cache written by the previous run and pick the slot of searchstr.
+     * A missing or invalid cache is ignored, every file is read and the cache rewritten.
+     */
+
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof (struct cache_header)) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            const struct cache_header *header = data;
+            size_t records_max = (st.st_size - sizeof (struct cache_header)) / sizeof (struct cache_record);
+            if (memcmp(header->magic, CACHE_MAGIC, sizeof (header->magic)) == 0
+                    && header->queries_cnt == CACHE_QUERIES && header->records_cnt <= records_max
+                    && sizeof (struct cache_header) + header->records_cnt * sizeof (struct cache_record)
+                        + header->paths_size == (uint64_t)st.st_size) {
+                madvise(data, st.st_size, MADV_WILLNEED);
+                cache = header;
+                cache_size = st.st_size;
+                cache_mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+                memcpy(cache_queries, header->queries, sizeof (cache_queries));
+            } else {
+                munmap(data, st.st_size);
+            }
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    cache_runs = cache != NULL ? cache->runs + 1 : 1;
+    cache_slot = -1;
+    for (int i = 0; i < CACHE_QUERIES; ++i) {
+        if (cache_queries[i].last_used != 0 && cache_queries[i].len == searchstr_len
+                && memcmp(cache_queries[i].str, searchstr, searchstr_len) == 0) {
+            cache_slot = i;
+        }
+    }
+    if (cache_slot == -1) {
+        cache_slot = 0;
+        for (int i = 1; i < CACHE_QUERIES; ++i) {
+            if (cache_queries[i].last_used < cache_queries[cache_slot].last_used) {
+                cache_slot = i;
+            }
+        }
+        cache_slot_new = true;
+        memset(&cache_queries[cache_slot], 0, sizeof (struct cache_query));
+        if (searchstr_len > CACHE_QUERY_MAX) {
+            return; // Too long to cache, the slot stays free and the string is counted every run
+        }
+        cache_queries[cache_slot].len = searchstr_len;
+        memcpy(cache_queries[cache_slot].str, searchstr, searchstr_len);
+    }
+    cache_queries[cache_slot].last_used = cache_runs;
+}
+
+static int compare_records (const void *a, const void *b) {
+    const struct cache_record *ra = a, *rb = b;
+    if (ra->dev != rb->dev) {
+        return ra->dev < rb->dev ? -1 : 1;
+    }
+    return ra->ino < rb->ino ? -1 : ra->ino > rb->ino;
+}
+
+static bool write_all (int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written == -1) {
+            return false;
+        }
+        p += written;
+        len -= written;
+    }
+    return true;
+}
+
+static void cache_store (void) {
+
+    /**
+     * Write the records of the files found by this walk to a new cache, then rename it over
+     * the previous one, so another run never maps a partial cache
+     */
+
+    struct cache_header header = {0};
+    size_t records_cnt = 0, paths_size = 0;
+    for (int i = 0; i < workers_cnt; ++i) {
+        records_cnt += workers[i].records_cnt;
+        paths_size += workers[i].paths_size;
+    }
+    struct cache_record *records = malloc((records_cnt ? records_cnt : 1) * sizeof (struct cache_record));
+    char *paths = malloc(paths_size ? paths_size : 1);
+    size_t record = 0, path_off = 0;
+    for (int i = 0; i < workers_cnt; ++i) {
+        for (size_t j = 0; j < workers[i].records_cnt; ++j) {
+            records[record] = workers[i].records[j];
+            records[record++].path_off += path_off;
+        }
+        memcpy(paths + path_off, workers[i].paths, workers[i].paths_size);
+        path_off += workers[i].paths_size;
+        free(workers[i].records);
+        free(workers[i].paths);
+    }
+    qsort(records, records_cnt, sizeof (struct cache_record), compare_records);
+
+    memcpy(header.magic, CACHE_MAGIC, sizeof (header.magic));
+    header.queries_cnt = CACHE_QUERIES;
+    header.runs = cache_runs;
+    header.records_cnt = records_cnt;
+    header.paths_size = paths_size;
+    memcpy(header.queries, cache_queries, sizeof (header.queries));
+    if (cache != NULL) {
+        munmap((void *)cache, cache_size);
+        cache = NULL;
+    }
+
+    size_t tmp_len = strlen(cache_path) + 32;
+    char *tmp_path = malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.%d", cache_path, getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = fd != -1 && write_all(fd, &header, sizeof (header))
+        && write_all(fd, records, records_cnt * sizeof (struct cache_record))
+        && write_all(fd, paths, paths_size);
+    if (fd != -1 && close(fd) != 0) {
+        written = false;
+    }
+    if (!written || rename(tmp_path, cache_path) != 0) {
+        printf("Failed to write the cache %s.\n", cache_path);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(records);
+    free(paths);
+}
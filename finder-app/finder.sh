@@ -11,6 +11,23 @@ if [ $# -lt 2 ] || [ ! -d $filesdir ]; then
     exit 1
 fi
 
+# The native finder (finder.c) walks the tree once with all cores, but matches a fixed string.
+# It is only used when searchstr holds no basic regular expression metacharacter, so that
+# grep keeps matching patterns. FINDER_CACHE names a cache file so repeated searches only
+# read the files changed since.
+case "$searchstr" in
+    *[].[*^\$\\]*)
+        ;;
+    *)
+        if command -v finder >/dev/null 2>&1; then
+            if [ -n "$FINDER_CACHE" ]; then
+                exec finder -c "$FINDER_CACHE" "$filesdir" "$searchstr"
+            fi
+            exec finder "$filesdir" "$searchstr"
+        fi
+        ;;
+esac
+
 filescnt=$(find $filesdir -type f | wc -l)
 linescnt=$(grep -r $searchstr $filesdir | wc -l)
 echo "The number of files are $filescnt and the number of matching lines are $linescnt"
@@ -117,6 +117,7 @@ echo "Copying the finder related scripts and executables to the /home directory
 cp -rf ${FINDER_APP_DIR}/finder-test.sh ${OUTDIR}/rootfs/home
 cp -rf ${FINDER_APP_DIR}/finder.sh ${OUTDIR}/rootfs/home
 cp -rf ${FINDER_APP_DIR}/writer ${OUTDIR}/rootfs/home
+cp -rf ${FINDER_APP_DIR}/finder ${OUTDIR}/rootfs/home
 cp -rf ${FINDER_APP_DIR}/autorun-qemu.sh ${OUTDIR}/rootfs/home
 cp -rf ${FINDER_APP_DIR}/conf/ ${OUTDIR}/rootfs/home
 
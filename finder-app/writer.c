@@ -1,15 +1,42 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <getopt.h>
 #include <syslog.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define MAX_WORKERS 256
+
+/*
+ * Bulk mode creates many files from one process: the files of a manifest, or count files
+ * named after a pattern, are written by a pool of threads relative to a directory fd.
+ * Only the failures are logged unless --verbose.
+ */
+
+struct bulk_file {
+    const char *name; // Relative to the bulk directory
+    const char *str;
+};
 
 static int help_flag;
+static int verbose_flag;
+static int bulk_dirfd = -1;
+static struct bulk_file *bulk_files; // Files of the manifest, or NULL to name them after bulk_pattern
+static unsigned long bulk_count;
+static const char *bulk_pattern;
+static const char *bulk_str;
+static atomic_ulong bulk_next; // Index of the next file to write
+static atomic_ulong bulk_failed;
 
 static void print_usage (const char*);
 static int write_to_file (const char*, const char*);
+static int write_bulk (const char*, const char*, const char*, unsigned long, const char*, int);
 
 int main(int argc, char* argv[]) {
     if (argc < 2) print_usage (argv[0]);
@@ -21,10 +48,16 @@ int main(int argc, char* argv[]) {
     {
         /* These options set a flag. */
         {"help",        no_argument,            &help_flag,       1},
+        {"verbose",     no_argument,            &verbose_flag,    1},
         /* These options don’t set a flag.*/
         {"test",        no_argument,            0,              't'},
         {"writefile",   required_argument,      0,              'f'},
         {"writestr",    required_argument,      0,              's'},
+        {"dir",         required_argument,      0,              'd'},
+        {"manifest",    required_argument,      0,              'm'},
+        {"count",       required_argument,      0,              'n'},
+        {"pattern",     required_argument,      0,              'p'},
+        {"threads",     required_argument,      0,              'j'},
         {0, 0, 0, 0}
     };
 
@@ -32,7 +65,13 @@ int main(int argc, char* argv[]) {
     int option_index = 0;
     char *file_path = NULL;
     char *str = NULL;
-    while ((option = getopt_long (argc, argv, "htf:s:", long_options, &option_index)) != -1){
+    char *dir = NULL;
+    char *manifest = NULL;
+    char *pattern = NULL;
+    unsigned long count = 0;
+    bool count_flag = false;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((option = getopt_long (argc, argv, "htf:s:d:m:n:p:j:v", long_options, &option_index)) != -1){
         if (help_flag) print_usage (argv[0]);
         
         switch (option)
@@ -46,6 +85,25 @@ int main(int argc, char* argv[]) {
         case 's':
             str = optarg;
             break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            count_flag = true;
+            break;
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'v':
+            verbose_flag = 1;
+            break;
         }
     }
 
@@ -57,27 +115,46 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    if (count_flag && !pattern) {
+        printf ("The count -n names its files after a pattern, -p is required.\n");
+        syslog (LOG_ERR, "The count -n names its files after a pattern, -p is required.");
+        exit(1);
+    }
+
     if (file_path && str) { 
         int rc = 1;
         if ((rc = write_to_file (file_path, str) != 0)) exit(rc); 
     }
 
+    if (manifest || pattern) {
+        if (write_bulk (dir ? dir : ".", manifest, pattern, count, str, threads) != 0) exit(1);
+    }
+
     syslog (LOG_NOTICE, "Program end by User %d", getuid ());
     closelog();
     return 0;
 }
 
 static void print_usage (const char* command_name) {
-    printf ("Usage: %s <writefile> <writestr>\n", command_name);
+    printf ("Usage: %s -f <writefile> -s <writestr>\n", command_name);
+    printf ("       %s [-d <dir>] -n <count> -p <pattern> -s <writestr> [-j <threads>] [-v]\n", command_name);
+    printf ("       %s [-d <dir>] -m <manifest> [-s <writestr>] [-j <threads>] [-v]\n", command_name);
     printf ( "Parameters:\n");
     printf ( "<writefile> : The Full path of the file to be created or overriden<\n.");
     printf ( "<writestr> : The string to be written in <writefile>.\n");
+    printf ( "-d, --dir <dir> : Directory of the bulk files (default: current directory).\n");
+    printf ( "-n, --count <count> : Number of bulk files, named after <pattern>.\n");
+    printf ( "-p, --pattern <pattern> : Name of the bulk files, where %%d is replaced by the file number (1 to count).\n");
+    printf ( "-m, --manifest <manifest> : File listing a bulk file per line as <name>[<tab><string>], - for stdin.\n");
+    printf ( "                            The files without a string are written <writestr>.\n");
+    printf ( "-j, --threads <threads> : Number of writing threads (default: online cpus).\n");
+    printf ( "-v, --verbose : Report every bulk file written, not only the failures.\n");
     exit(0);
 }
 
 static int write_to_file (const char* file_path, const char* str) {
     /*Assuming the directory is created by the caller*/
-    int fptr = open (file_path, O_WRONLY | O_CREAT, 0600);
+    int fptr = open (file_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
     if (fptr == -1) {
         printf ("%s does not exist. Please create the file before running this program.", file_path);
         syslog (LOG_ERR, "%s does not exist. Please create the file before running this program.", file_path);
@@ -89,4 +166,193 @@ static int write_to_file (const char* file_path, const char* str) {
     if (close (fptr) < 0) return 1;
 
     return 0;
-}
\ No newline at end of file
+}
+
+static char *read_manifest (const char *manifest, size_t *size) {
+
+    /**
+     * Read the whole manifest in a null terminated buffer
+     * @return Return the buffer, or NULL if an error occure
+     */
+
+    int fd = strcmp(manifest, "-") == 0 ? STDIN_FILENO : open (manifest, O_RDONLY | O_CLOEXEC);
+    size_t cap = 64 * 1024, len = 0;
+    char *buf = malloc(cap);
+    ssize_t sz;
+    if (fd == -1 || buf == NULL) {
+        if (fd != -1 && fd != STDIN_FILENO) close (fd);
+        free(buf);
+        return NULL;
+    }
+    while ((sz = read (fd, buf + len, cap - len - 1)) > 0) {
+        len += sz;
+        if (len == cap - 1) {
+            char *grown = realloc(buf, 2 * cap);
+            if (grown == NULL) {
+                sz = -1;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if (fd != STDIN_FILENO) close (fd);
+    if (sz == -1) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    *size = len;
+    return buf;
+}
+
+static long parse_manifest (char *buf, size_t size, const char *str) {
+
+    /**
+     * Split the manifest in place in bulk_files
+     * @return Return the number of files, the lines without a name are skipped, or -1 if an error occure
+     */
+
+    unsigned long cnt = 0, cap = 1024;
+    char *line = buf, *end = buf + size;
+    bulk_files = malloc(cap * sizeof (struct bulk_file));
+    if (bulk_files == NULL) return -1;
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) eol = end;
+        *eol = '\0';
+        char *tab = strchr(line, '\t');
+        if (tab) *tab = '\0';
+        if (*line != '\0') {
+            if (cnt == cap) {
+                struct bulk_file *grown = realloc(bulk_files, 2 * cap * sizeof (struct bulk_file));
+                if (grown == NULL) {
+                    free(bulk_files);
+                    bulk_files = NULL;
+                    return -1;
+                }
+                bulk_files = grown;
+                cap *= 2;
+            }
+            bulk_files[cnt].name = line;
+            bulk_files[cnt++].str = tab ? tab + 1 : str;
+        }
+        line = eol + 1;
+    }
+    return cnt;
+}
+
+static void bulk_name (char *name, size_t size, unsigned long number) {
+    /*The pattern holds a single %d, checked by write_bulk*/
+    const char *conv = strstr(bulk_pattern, "%d");
+    snprintf(name, size, "%.*s%lu%s", (int)(conv - bulk_pattern), bulk_pattern, number, conv + 2);
+}
+
+static void* bulk_worker (void *_args) {
+    /**
+     * Worker thread writing bulk files until none is left
+     * @return NULL
+     */
+
+    char name[4096];
+    unsigned long i;
+    (void)_args;
+    while ((i = atomic_fetch_add(&bulk_next, 1)) < bulk_count) {
+        const char *file_name = name, *str = bulk_str;
+        if (bulk_files) {
+            file_name = bulk_files[i].name;
+            str = bulk_files[i].str;
+        } else {
+            bulk_name (name, sizeof (name), i + 1);
+        }
+        if (str == NULL) {
+            syslog (LOG_ERR, "No string to write to '%s'", file_name);
+            atomic_fetch_add(&bulk_failed, 1);
+            continue;
+        }
+
+        size_t len = strlen(str);
+        int fd = openat (bulk_dirfd, file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        ssize_t sz = fd == -1 ? -1 : write (fd, str, len);
+        if (fd != -1 && close (fd) < 0) sz = -1;
+        if (sz != (ssize_t)len) {
+            syslog (LOG_ERR, "Failed to write '%s': %m", file_name);
+            atomic_fetch_add(&bulk_failed, 1);
+        } else if (verbose_flag) {
+            printf("Written '%s' to file '%s' (%zd bytes)\n", str, file_name, sz);
+            syslog (LOG_DEBUG, "Written '%s' to file '%s' (%zd bytes)\n", str, file_name, sz);
+        }
+    }
+    return NULL;
+}
+
+static int write_bulk (const char *dir, const char *manifest, const char *pattern, unsigned long count,
+        const char *str, int threads) {
+
+    /**
+     * Write the bulk files with a pool of threads and report the files per second
+     * @return Return 0 if every file was written, or 1 if an error occure
+     */
+
+    pthread_t workers[MAX_WORKERS];
+    struct timespec start, end;
+    char *buf = NULL;
+    size_t size;
+
+    if (manifest) {
+        if ((buf = read_manifest (manifest, &size)) == NULL) {
+            printf ("Failed to read the manifest %s.\n", manifest);
+            syslog (LOG_ERR, "Failed to read the manifest %s: %m", manifest);
+            return 1;
+        }
+        long cnt = parse_manifest (buf, size, str);
+        if (cnt == -1) {
+            printf ("Failed to allocate the files of the manifest %s.\n", manifest);
+            syslog (LOG_ERR, "Failed to allocate the files of the manifest %s.", manifest);
+            free(buf);
+            return 1;
+        }
+        bulk_count = cnt;
+    } else {
+        const char *conv = strstr(pattern, "%d");
+        if (conv == NULL || strchr(conv + 2, '%') || memchr(pattern, '%', conv - pattern) || str == NULL) {
+            printf ("The pattern must hold a single %%d and a string is required.\n");
+            return 1;
+        }
+        bulk_pattern = pattern;
+        bulk_count = count;
+    }
+    bulk_str = str;
+
+    if ((bulk_dirfd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        printf ("%s does not exist. Please create the directory before running this program.\n", dir);
+        syslog (LOG_ERR, "%s does not exist. Please create the directory before running this program.", dir);
+        free(buf);
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+    if ((unsigned long)threads > bulk_count) threads = bulk_count ? bulk_count : 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (; started < threads; ++started) {
+        if (pthread_create(&workers[started], NULL, bulk_worker, NULL) != 0) break;
+    }
+    if (started == 0) bulk_worker (NULL);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    unsigned long failed = atomic_load(&bulk_failed);
+    printf("Written %lu files to '%s' in %.3f s (%.0f files/sec), %lu failed\n", bulk_count - failed, dir,
+        elapsed, elapsed > 0 ? (bulk_count - failed) / elapsed : 0, failed);
+    syslog (LOG_NOTICE, "Written %lu files to '%s' in %.3f s, %lu failed", bulk_count - failed, dir, elapsed, failed);
+
+    close (bulk_dirfd);
+    free(bulk_files);
+    free(buf);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef AESD_FRAME
+#define AESD_FRAME
+
+#include <stdint.h>
+
+/*
+ * Length-prefixed binary framing, selected by a client sending AESD_FRAME_MAGIC as the
+ * first byte of the connection instead of newline delimited text. Every frame starts with
+ * struct aesd_frame_header, integers in the header and payloads are in network byte order.
+ */
+
+#define AESD_FRAME_MAGIC 0xAE // Never the first byte of a text package
+#define AESD_FRAME_MAX_PAYLOAD (64*1024) // Maximal payload length of a frame
+
+struct aesd_frame_header {
+    uint8_t magic; // AESD_FRAME_MAGIC
+    uint8_t type; // enum aesd_frame_type
+    uint16_t reserved;
+    uint32_t length; // Payload length following the header
+};
+
+enum aesd_frame_type {
+    // Requests
+    AESD_FRAME_APPEND = 0x01, // Payload appended as one record, answered by AESD_FRAME_ACK
+    AESD_FRAME_REPLAY = 0x02, // uint64_t offset, answered by AESD_FRAME_DATA frames and AESD_FRAME_END
+    AESD_FRAME_TAIL = 0x03, // uint32_t count, answered by one AESD_FRAME_RECORD per record and AESD_FRAME_END
+    AESD_FRAME_FOLLOW = 0x04, // uint64_t offset, answered as the log grows by an AESD_FRAME_SYNC followed by the
+                              // records: an AESD_FRAME_RECORD per record starting in the range, and AESD_FRAME_DATA
+                              // frames for the rest of a record, until the client sends another request
+    // Responses
+    AESD_FRAME_ACK = 0x81, // uint64_t end offset of the log after the append
+    AESD_FRAME_DATA = 0x82, // Log bytes
+    AESD_FRAME_RECORD = 0x83, // A single record
+    AESD_FRAME_END = 0x84, // uint64_t offset following the last byte sent
+    AESD_FRAME_SYNC = 0x85, // uint64_t offset, uint64_t end offset of the log bytes sent by the frames that follow,
+                            // uint64_t number of the record holding the byte at offset
+    AESD_FRAME_ERROR = 0xff, // Request failed or not supported
+};
+
+#endif // AESD_FRAME
@@ -0,0 +1,275 @@
+#include <aesdhistory.h>
+#include <aesd-circular-buffer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define HISTORY_CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define HISTORY_BATCH (HISTORY_CAPACITY < 64 ? HISTORY_CAPACITY : 64) // Entries added per aesd_circular_buffer_add_entries
+
+static pthread_rwlock_t history_lock = PTHREAD_RWLOCK_INITIALIZER; // Readers copy under the read lock
+static struct aesd_circular_buffer *ring = NULL; // Entries own a malloc'd copy of their record
+static uint64_t *entry_offsets = NULL; // Logical offset of the record held by each entry slot
+static size_t max_entries = HISTORY_CAPACITY;
+static uint64_t max_bytes = 0;
+static size_t entries_cnt = 0;
+static bool at_record_start = true; // Next appended byte starts a new record
+static atomic_uint_fast64_t start_offset = 0;
+static atomic_uint_fast64_t end_offset = 0;
+static atomic_uint_fast64_t start_record = 0;
+static atomic_uint_fast64_t end_record = 0;
+
+static size_t slot_of(uint64_t record) {
+    return (ring->out_offs + (record - atomic_load(&start_record))) % HISTORY_CAPACITY;
+}
+
+static void history_evict(const struct aesd_buffer_entry *evicted, void *ctx) {
+    (void)ctx;
+    atomic_fetch_add(&start_offset, evicted->size);
+    atomic_fetch_add(&start_record, 1);
+    entries_cnt--;
+    free((char *)evicted->buffptr);
+}
+
+static struct aesd_buffer_entry *history_newest(void) {
+    return &ring->entry[(ring->in_offs + HISTORY_CAPACITY - 1) % HISTORY_CAPACITY];
+}
+
+static int history_reserve(size_t len) {
+
+    /**
+     * Grow the buffer of the newest record, which missed its newline, by len bytes.
+     * The record itself is left unchanged until the bytes are copied in.
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    struct aesd_buffer_entry *newest = history_newest();
+    char *grown = realloc((char *)newest->buffptr, newest->size + len);
+    if (grown == NULL) {
+        return -1;
+    }
+    newest->buffptr = grown;
+    return 0;
+}
+
+int aesdhistory_open(size_t entries, uint64_t bytes) {
+    ring = malloc(sizeof (*ring));
+    entry_offsets = malloc(HISTORY_CAPACITY * sizeof (*entry_offsets));
+    if (ring == NULL || entry_offsets == NULL) {
+        printf("Failed to allocate the history of %d records.\n", HISTORY_CAPACITY);
+        free(ring);
+        free(entry_offsets);
+        ring = NULL;
+        entry_offsets = NULL;
+        return -1;
+    }
+    aesd_circular_buffer_init(ring);
+    max_entries = (entries == 0 || entries > HISTORY_CAPACITY) ? HISTORY_CAPACITY : entries;
+    max_bytes = bytes;
+    entries_cnt = 0;
+    at_record_start = true;
+    printf("Keeping history in memory, up to %zu records", max_entries);
+    if (max_bytes) {
+        printf(" and %llu bytes", (unsigned long long)max_bytes);
+    }
+    printf(".\n");
+    return 0;
+}
+
+void aesdhistory_close(void) {
+    struct aesd_buffer_entry removed;
+    pthread_rwlock_wrlock(&history_lock);
+    if (ring != NULL) {
+        while (aesd_circular_buffer_remove_entry(ring, &removed)) {
+            history_evict(&removed, NULL);
+        }
+    }
+    free(ring);
+    free(entry_offsets);
+    ring = NULL;
+    entry_offsets = NULL;
+    pthread_rwlock_unlock(&history_lock);
+}
+
+ssize_t aesdhistory_append(const char *buf, size_t len, bool lines) {
+    struct aesd_buffer_entry batch[HISTORY_BATCH];
+    struct aesd_buffer_entry removed;
+    size_t batch_cnt = 0;
+    const char *p = buf, *end = buf + len;
+    uint64_t offset = atomic_load(&end_offset);
+    uint64_t records = 0;
+    bool extend = !at_record_start && entries_cnt > 0; // The first piece continues the newest record
+    size_t copies_cnt = 0;
+    bool failed = false;
+
+    // Allocate every record copy up front, so that a failed allocation leaves the history untouched
+    size_t pieces = 0;
+    for (const char *q = p; q < end; ++pieces) {
+        const char *nl = lines ? memchr(q, '\n', end - q) : NULL;
+        q = nl ? nl + 1 : end;
+    }
+    char **copies = malloc((pieces ? pieces : 1) * sizeof (char *));
+    if (copies == NULL) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&history_lock);
+    for (const char *q = p; q < end; ) {
+        const char *nl = lines ? memchr(q, '\n', end - q) : NULL;
+        size_t size = nl ? (size_t)(nl + 1 - q) : (size_t)(end - q);
+        if (q == p && extend) {
+            failed = history_reserve(size) == -1;
+        } else {
+            failed = (copies[copies_cnt] = malloc(size)) == NULL;
+            copies_cnt += !failed;
+        }
+        if (failed) {
+            break;
+        }
+        q += size;
+    }
+    if (failed) {
+        pthread_rwlock_unlock(&history_lock);
+        while (copies_cnt > 0) {
+            free(copies[--copies_cnt]);
+        }
+        free(copies);
+        return -1;
+    }
+
+    copies_cnt = 0;
+    while (p < end) {
+        const char *nl = lines ? memchr(p, '\n', end - p) : NULL;
+        size_t size = nl ? (size_t)(nl + 1 - p) : (size_t)(end - p);
+
+        if (p == buf && extend) {
+            // Continue the record left without newline by the previous append
+            struct aesd_buffer_entry *newest = history_newest();
+            memcpy((char *)newest->buffptr + newest->size, p, size);
+            newest->size += size;
+        } else {
+            char *copy = copies[copies_cnt++];
+            memcpy(copy, p, size);
+            entry_offsets[(ring->in_offs + batch_cnt) % HISTORY_CAPACITY] = offset;
+            batch[batch_cnt] = (struct aesd_buffer_entry){ .buffptr = copy, .size = size };
+            if (++batch_cnt == HISTORY_BATCH) {
+                entries_cnt += batch_cnt;
+                aesd_circular_buffer_add_entries(ring, batch, batch_cnt, history_evict, NULL);
+                records += batch_cnt;
+                batch_cnt = 0;
+            }
+        }
+        at_record_start = !lines || nl != NULL;
+        offset += size;
+        p += size;
+    }
+    entries_cnt += batch_cnt;
+    aesd_circular_buffer_add_entries(ring, batch, batch_cnt, history_evict, NULL);
+    records += batch_cnt;
+    free(copies);
+
+    // Publish the bytes, then drop the oldest records beyond the caps
+    atomic_store(&end_record, atomic_load(&end_record) + records);
+    atomic_store(&end_offset, offset);
+    while ((entries_cnt > max_entries || (max_bytes && offset - atomic_load(&start_offset) > max_bytes))
+            && aesd_circular_buffer_remove_entry(ring, &removed)) {
+        history_evict(&removed, NULL);
+    }
+    pthread_rwlock_unlock(&history_lock);
+    return len;
+}
+
+ssize_t aesdhistory_append_continue(const char *buf, size_t len) {
+    bool was_at_record_start = at_record_start;
+    at_record_start = false; // Extend the newest record as if it missed its newline
+    ssize_t rc = aesdhistory_append(buf, len, false);
+    if (rc == -1) {
+        at_record_start = was_at_record_start;
+    }
+    return rc;
+}
+
+void aesdhistory_reset(uint64_t base, uint64_t first_record) {
+    struct aesd_buffer_entry removed;
+    pthread_rwlock_wrlock(&history_lock);
+    while (aesd_circular_buffer_remove_entry(ring, &removed)) {
+        history_evict(&removed, NULL);
+    }
+    atomic_store(&start_offset, base);
+    atomic_store(&end_offset, base);
+    atomic_store(&start_record, first_record);
+    atomic_store(&end_record, first_record);
+    at_record_start = true;
+    pthread_rwlock_unlock(&history_lock);
+}
+
+ssize_t aesdhistory_read(uint64_t offset, char *buf, size_t len) {
+    size_t copied = 0;
+
+    pthread_rwlock_rdlock(&history_lock);
+    uint64_t first = atomic_load(&start_record), last = atomic_load(&end_record);
+    if (offset < atomic_load(&start_offset)) {
+        pthread_rwlock_unlock(&history_lock);
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Binary search the newest record starting at or before offset
+    uint64_t lo = first, hi = last;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (entry_offsets[slot_of(mid)] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    for (uint64_t record = lo; record < last && copied < len && offset < atomic_load(&end_offset); ++record) {
+        const struct aesd_buffer_entry *entry = &ring->entry[slot_of(record)];
+        size_t skip = offset - entry_offsets[slot_of(record)];
+        size_t n = entry->size - skip < len - copied ? entry->size - skip : len - copied;
+        memcpy(buf + copied, entry->buffptr + skip, n);
+        copied += n;
+        offset += n;
+    }
+    pthread_rwlock_unlock(&history_lock);
+    return copied;
+}
+
+uint64_t aesdhistory_start_offset(void) {
+    return atomic_load(&start_offset);
+}
+
+uint64_t aesdhistory_end_offset(void) {
+    return atomic_load(&end_offset);
+}
+
+uint64_t aesdhistory_start_record(void) {
+    return atomic_load(&start_record);
+}
+
+uint64_t aesdhistory_end_record(void) {
+    return atomic_load(&end_record);
+}
+
+int aesdhistory_record_range(uint64_t first, uint64_t count, uint64_t *start, uint64_t *end) {
+    pthread_rwlock_rdlock(&history_lock);
+    uint64_t records_start = atomic_load(&start_record), records_end = atomic_load(&end_record);
+    if (first < records_start) {
+        first = records_start;
+    }
+    *end = atomic_load(&end_offset);
+    if (first >= records_end || count == 0) {
+        *start = *end;
+    } else {
+        *start = entry_offsets[slot_of(first)];
+        if (count < records_end - first) {
+            *end = entry_offsets[slot_of(first + count)];
+        }
+    }
+    pthread_rwlock_unlock(&history_lock);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef AESD_HISTORY
+#define AESD_HISTORY
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Bounded in-memory history kept in a struct aesd_circular_buffer, one entry per record.
+ * Offsets and record numbers follow the aesdlog conventions, the oldest entries are dropped
+ * once the entries or bytes caps are reached, as segments are by the log retention.
+ */
+
+/**
+ * Start with an empty history, allocating the buffer of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+ * @param max_entries Maximal number of records kept, 0 or beyond the buffer capacity for the capacity
+ * @param max_bytes Maximal number of bytes kept (0: unlimited)
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdhistory_open(size_t max_entries, uint64_t max_bytes);
+
+/**
+ * Free the history
+ */
+void aesdhistory_close(void);
+
+/**
+ * Append bytes, either as newline terminated records or as a single record.
+ * Appends must be serialized by the caller. An append is all or nothing, the history is
+ * left unchanged when it fails.
+ * @return Return the number of bytes appended, or -1 if an error occure
+ */
+ssize_t aesdhistory_append(const char *buf, size_t len, bool lines);
+
+/**
+ * Append bytes to the newest record, or as a new record if the history is empty
+ * @return Return the number of bytes appended, or -1 if an error occure
+ */
+ssize_t aesdhistory_append_continue(const char *buf, size_t len);
+
+/**
+ * Drop every record and continue empty from logical offset base and record first_record
+ */
+void aesdhistory_reset(uint64_t base, uint64_t first_record);
+
+/**
+ * Copy bytes starting at a logical offset, safe to call concurrently with appends
+ * @return Return the number of bytes read, 0 at the end of the history, or -1 if an error occure
+ *      (errno is ENOENT when the offset was dropped)
+ */
+ssize_t aesdhistory_read(uint64_t offset, char *buf, size_t len);
+
+uint64_t aesdhistory_start_offset(void);
+uint64_t aesdhistory_end_offset(void);
+uint64_t aesdhistory_start_record(void);
+uint64_t aesdhistory_end_record(void);
+
+/**
+ * Resolve records [first, first+count) to the byte range [start, end), dropped records are skipped
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdhistory_record_range(uint64_t first, uint64_t count, uint64_t *start, uint64_t *end);
+
+#endif // AESD_HISTORY
@@ -0,0 +1,1152 @@
+#include <aesdlog.h>
+#include <aesdlz.h>
+#include <aesdhistory.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define AESDLOG_INDEX_MAGIC 0x58444941 // "AIDX"
+#define AESDLOG_INDEX_BATCH 64 // Record offsets buffered before a write() to the index file
+#define AESDLOG_INDEX_OPEN_RECORD 0x1 // The last record misses its newline, the next append continues it
+#define AESDLOG_INDEX_BINARY 0x2 // Some record was appended whole, newlines don't delimit the records
+#define AESDLOG_BLOCK_MAGIC 0x4b4c4241 // "ABLK"
+#define AESDLOG_BLOCK_SIZE (64*1024) // Uncompressed size of the blocks of a compressed segment
+
+enum log_append_mode {
+    APPEND_LINES, // One record per newline terminated line
+    APPEND_RECORD, // A single record whatever its content
+    APPEND_CONTINUE, // More bytes of the last record, whatever their content
+};
+
+// Sidecar index file <segment>.idx: this header followed by one uint32_t start position per record
+struct aesdlog_index_header {
+    uint32_t magic;
+    uint32_t flags; // AESDLOG_INDEX_* state of the segment, updated in place by the writer
+    uint64_t first_record; // Record number of the first record in the segment
+};
+
+// Compressed segment file <segment>.lz: a sequence of this header followed by comp_len bytes
+struct aesdlog_block_header {
+    uint32_t magic;
+    uint32_t raw_len; // Uncompressed length, AESDLOG_BLOCK_SIZE except for the last block
+    uint32_t comp_len; // Stored length, equal to raw_len when the block didn't compress
+    uint32_t crc; // CRC-32 of the uncompressed bytes
+};
+
+struct aesdlog_segment {
+    uint64_t base; // Logical offset of the first byte in this segment
+    int fd; // Opened O_APPEND for the writer, read with pread()
+    atomic_size_t len; // Committed bytes in this segment
+    time_t mtime; // Time of the last append, used by the age retention
+    atomic_int refs; // One reference held by the segment table plus one per reader
+    char path[PATH_MAX];
+
+    int idx_fd; // Sidecar index, written by the writer with pwrite() and memory-mapped for lookups
+    size_t idx_len; // Bytes written to the index, the writer appends the next entries there
+    uint32_t idx_flags; // Flags stored in the index header
+    uint64_t first_record; // Record number of the first record in the segment
+    atomic_size_t nrecords; // Committed records in this segment
+    bool at_record_start; // Next appended byte starts a new record
+    pthread_mutex_t idx_lock; // Protect the index mapping below
+    const uint32_t *idx_map; // Mapped record start positions, relative to base
+    size_t idx_mapped; // Number of entries covered by idx_map
+    char idx_path[PATH_MAX];
+
+    bool compressed; // Sealed segment stored as compressed blocks, path is the .lz file
+    bool compress_failed; // Compression failed, the segment is kept raw and not retried
+    off_t *blocks; // File offset of each block header
+    size_t nblocks;
+};
+
+// Last block decompressed by a thread, replays read it in several chunks. Allocated by the
+// first read of a compressed segment and freed when the thread exits.
+struct aesdlog_block_cache {
+    bool valid;
+    uint64_t base; // Base offset of the segment the block belongs to
+    size_t block;
+    size_t len;
+    char data[AESDLOG_BLOCK_SIZE];
+    char packed[AESDLOG_BLOCK_SIZE];
+};
+static pthread_key_t block_cache_key;
+static pthread_once_t block_cache_once = PTHREAD_ONCE_INIT;
+
+static struct aesdlog_config config;
+static struct aesdlog_segment *segs[AESDLOG_MAX_SEGMENTS]; // Retained segments ordered by base offset
+static size_t segs_cnt = 0;
+static pthread_rwlock_t segs_lock = PTHREAD_RWLOCK_INITIALIZER; // Protect the segment table, not the file content
+static atomic_uint_fast64_t start_offset = 0;
+static atomic_uint_fast64_t end_offset = 0;
+static atomic_uint_fast64_t start_record = 0;
+static atomic_uint_fast64_t end_record = 0;
+static bool failed = false; // An append couldn't be rolled back, the log no longer matches its index
+
+// Sealed segments are compressed by a background thread, the writer only wakes it up
+static pthread_t compress_thread;
+static bool compress_running = false;
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static bool compress_pending = false; // A segment was sealed since the last pass
+static atomic_bool compress_stop = false;
+
+static void block_cache_key_create(void) {
+    pthread_key_create(&block_cache_key, free);
+}
+
+static bool in_memory(void) {
+    return config.history_entries || config.history_bytes; // Served by aesdhistory, no segment file
+}
+
+static int index_write(struct aesdlog_segment *seg, const uint32_t *pos, size_t n) {
+
+    /**
+     * Append record start positions to the segment index
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    size_t total = 0, len = n * sizeof (uint32_t);
+    while (total < len) {
+        ssize_t sz = pwrite(seg->idx_fd, (const char *)pos + total, len - total, seg->idx_len + total);
+        if (sz == -1) {
+            if (errno == EINTR) continue;
+            printf("Failed to write index %s.\n", seg->idx_path);
+            return -1;
+        }
+        total += sz;
+    }
+    seg->idx_len += len;
+    return 0;
+}
+
+static int index_set_flags(struct aesdlog_segment *seg, uint32_t flags) {
+
+    /**
+     * Store the segment state in the index header, so that recovery needn't guess it from the data
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    if (flags == seg->idx_flags) {
+        return 0;
+    }
+    if (pwrite(seg->idx_fd, &flags, sizeof (flags), offsetof(struct aesdlog_index_header, flags)) != sizeof (flags)) {
+        printf("Failed to write index %s.\n", seg->idx_path);
+        return -1;
+    }
+    seg->idx_flags = flags;
+    return 0;
+}
+
+static int index_create(struct aesdlog_segment *seg) {
+    struct aesdlog_index_header hdr = { .magic = AESDLOG_INDEX_MAGIC, .first_record = seg->first_record };
+    if (ftruncate(seg->idx_fd, 0) == -1 || pwrite(seg->idx_fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+        printf("Failed to create index %s.\n", seg->idx_path);
+        return -1;
+    }
+    atomic_init(&seg->nrecords, 0);
+    seg->idx_len = sizeof (hdr);
+    seg->idx_flags = 0;
+    return 0;
+}
+
+static ssize_t segment_pread(struct aesdlog_segment *seg, char *buf, size_t len, size_t pos) {
+
+    /**
+     * Read segment bytes at position pos, decompressing the block holding them if needed
+     * @return Return the number of bytes read, or -1 if an error occure
+     */
+
+    if (!seg->compressed) {
+        return pread(seg->fd, buf, len, pos);
+    }
+
+    size_t block = pos / AESDLOG_BLOCK_SIZE;
+    if (block >= seg->nblocks) {
+        return 0;
+    }
+    pthread_once(&block_cache_once, block_cache_key_create);
+    struct aesdlog_block_cache *cache = pthread_getspecific(block_cache_key);
+    if (cache == NULL) {
+        cache = malloc(sizeof (*cache));
+        if (cache == NULL || pthread_setspecific(block_cache_key, cache) != 0) {
+            free(cache);
+            errno = ENOMEM;
+            return -1;
+        }
+        cache->valid = false;
+    }
+    if (!cache->valid || cache->base != seg->base || cache->block != block) {
+        struct aesdlog_block_header hdr = {};
+        cache->valid = false;
+        if (pread(seg->fd, &hdr, sizeof (hdr), seg->blocks[block]) != sizeof (hdr)
+                || hdr.raw_len > AESDLOG_BLOCK_SIZE || hdr.comp_len > hdr.raw_len
+                || pread(seg->fd, cache->packed, hdr.comp_len, seg->blocks[block] + sizeof (hdr)) != hdr.comp_len) {
+            printf("Failed to read block %zu of %s.\n", block, seg->path);
+            errno = EIO;
+            return -1;
+        }
+        if (hdr.comp_len == hdr.raw_len) {
+            memcpy(cache->data, cache->packed, hdr.raw_len);
+        } else if (aesdlz_decompress(cache->packed, hdr.comp_len, cache->data, hdr.raw_len) != hdr.raw_len) {
+            printf("Failed to decompress block %zu of %s.\n", block, seg->path);
+            errno = EIO;
+            return -1;
+        }
+        if (aesdlz_crc32(cache->data, hdr.raw_len) != hdr.crc) {
+            printf("Checksum mismatch in block %zu of %s.\n", block, seg->path);
+            errno = EIO;
+            return -1;
+        }
+        cache->base = seg->base;
+        cache->block = block;
+        cache->len = hdr.raw_len;
+        cache->valid = true;
+    }
+
+    size_t in_block = pos - block * AESDLOG_BLOCK_SIZE;
+    if (in_block >= cache->len) {
+        return 0;
+    }
+    if (len > cache->len - in_block) {
+        len = cache->len - in_block;
+    }
+    memcpy(buf, cache->data + in_block, len);
+    return len;
+}
+
+static ssize_t segment_load_blocks(struct aesdlog_segment *seg) {
+
+    /**
+     * Build the block table of a compressed segment from the block headers
+     * @return Return the uncompressed size of the segment, or -1 if an error occure
+     */
+
+    struct aesdlog_block_header hdr = {};
+    struct stat st = {};
+    off_t off = 0;
+    size_t len = 0, cap = 0;
+
+    if (fstat(seg->fd, &st) == -1) {
+        return -1;
+    }
+    while (off + (off_t)sizeof (hdr) <= st.st_size) {
+        if (pread(seg->fd, &hdr, sizeof (hdr), off) != sizeof (hdr) || hdr.magic != AESDLOG_BLOCK_MAGIC
+                || off + (off_t)sizeof (hdr) + hdr.comp_len > st.st_size) {
+            printf("Truncated compressed segment %s at block %zu.\n", seg->path, seg->nblocks);
+            break;
+        }
+        if (seg->nblocks == cap) {
+            cap = cap ? cap * 2 : 16;
+            off_t *blocks = realloc(seg->blocks, cap * sizeof (off_t));
+            if (blocks == NULL) {
+                return -1;
+            }
+            seg->blocks = blocks;
+        }
+        seg->blocks[seg->nblocks++] = off;
+        len += hdr.raw_len;
+        off += sizeof (hdr) + hdr.comp_len;
+    }
+    return len;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t sz = write(fd, (const char *)buf + total, len - total);
+        if (sz == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += sz;
+    }
+    return 0;
+}
+
+static int index_recover(struct aesdlog_segment *seg, uint64_t expected_first_record, bool sealed) {
+
+    /**
+     * Validate the index of a segment left by a previous run. The index is authoritative:
+     * entries past the end of the data are dropped, and the unindexed tail of the data is only
+     * scanned for new records in the active segment when it holds newline delimited records.
+     * A missing or corrupted index is rebuilt starting at expected_first_record, assuming so.
+     * @param sealed The segment was sealed, its index was complete once it was
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    struct aesdlog_index_header hdr = {};
+    size_t len = atomic_load(&seg->len);
+    size_t n = 0;
+    uint32_t last = 0;
+    struct stat st = {};
+    bool scan = true; // Rebuilt indexes are scanned whatever the segment
+    bool open_record = false;
+
+    seg->first_record = expected_first_record;
+    if (pread(seg->idx_fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) || hdr.magic != AESDLOG_INDEX_MAGIC
+            || fstat(seg->idx_fd, &st) == -1) {
+        printf("Rebuilding index %s.\n", seg->idx_path);
+        if (index_create(seg) == -1) return -1;
+    } else {
+        seg->first_record = hdr.first_record;
+        seg->idx_flags = hdr.flags;
+        n = (st.st_size - sizeof (hdr)) / sizeof (uint32_t);
+        // Drop entries pointing past the data, binary search since positions are increasing
+        size_t lo = 0, hi = n;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            uint32_t pos = 0;
+            if (pread(seg->idx_fd, &pos, sizeof (pos), sizeof (hdr) + mid * sizeof (uint32_t)) != sizeof (pos)) {
+                return -1;
+            }
+            if (pos < len) {
+                lo = mid + 1;
+                last = pos;
+            } else {
+                hi = mid;
+            }
+        }
+        n = lo;
+        seg->idx_len = sizeof (hdr) + n * sizeof (uint32_t);
+        if (ftruncate(seg->idx_fd, seg->idx_len) == -1) {
+            return -1;
+        }
+        scan = !sealed && !seg->compressed && !(hdr.flags & AESDLOG_INDEX_BINARY);
+    }
+
+    // Scan the unindexed tail for record starts
+    uint32_t pos[AESDLOG_INDEX_BATCH];
+    size_t pos_cnt = 0;
+    char buf[4096];
+    size_t offset = n ? last : 0;
+    if (n == 0 && len > 0) {
+        pos[pos_cnt++] = 0; // Segments start with a record
+        n++;
+    }
+    while (scan && offset < len) {
+        ssize_t sz = segment_pread(seg, buf, sizeof (buf) < len - offset ? sizeof (buf) : len - offset, offset);
+        if (sz <= 0) {
+            return -1;
+        }
+        for (char *nl = memchr(buf, '\n', sz); nl != NULL; nl = memchr(nl + 1, '\n', buf + sz - nl - 1)) {
+            size_t start = offset + (nl - buf) + 1;
+            if (start < len) {
+                pos[pos_cnt++] = start;
+                n++;
+            }
+            if (pos_cnt == AESDLOG_INDEX_BATCH) {
+                if (index_write(seg, pos, pos_cnt) == -1) return -1;
+                pos_cnt = 0;
+            }
+        }
+        open_record = (buf[sz - 1] != '\n');
+        offset += sz;
+    }
+    if (pos_cnt && index_write(seg, pos, pos_cnt) == -1) {
+        return -1;
+    }
+    if (scan && index_set_flags(seg, open_record ? AESDLOG_INDEX_OPEN_RECORD : 0) == -1) {
+        return -1;
+    }
+
+    atomic_init(&seg->nrecords, n);
+    seg->at_record_start = !(seg->idx_flags & AESDLOG_INDEX_OPEN_RECORD);
+    return 0;
+}
+
+static int index_lookup(struct aesdlog_segment *seg, size_t i, uint32_t *pos) {
+
+    /**
+     * Get the start position of the i-th record of a segment from the mapped index,
+     * the mapping is extended when the active segment has grown since the last lookup
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    int rc = 0;
+    pthread_mutex_lock(&seg->idx_lock);
+    if (i >= seg->idx_mapped) {
+        size_t n = atomic_load_explicit(&seg->nrecords, memory_order_acquire);
+        size_t map_len = sizeof (struct aesdlog_index_header) + n * sizeof (uint32_t);
+        if (seg->idx_map != NULL) {
+            munmap((void *)((const char *)seg->idx_map - sizeof (struct aesdlog_index_header)),
+                sizeof (struct aesdlog_index_header) + seg->idx_mapped * sizeof (uint32_t));
+            seg->idx_map = NULL;
+            seg->idx_mapped = 0;
+        }
+        void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, seg->idx_fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Failed to map index %s.\n", seg->idx_path);
+        } else {
+            seg->idx_map = (const uint32_t *)((const char *)map + sizeof (struct aesdlog_index_header));
+            seg->idx_mapped = n;
+        }
+    }
+    if (i < seg->idx_mapped) {
+        *pos = seg->idx_map[i];
+    } else {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&seg->idx_lock);
+    return rc;
+}
+
+static struct aesdlog_segment *segment_open(uint64_t base, uint64_t first_record, bool create, bool sealed) {
+
+    /**
+     * Open the segment file starting at logical offset base together with its index,
+     * sealed tells that an existing segment isn't the active one
+     * @return Return the segment holding one reference, or NULL if an error occure
+     */
+
+    struct aesdlog_segment *seg = calloc(1, sizeof (struct aesdlog_segment));
+    if (seg == NULL) {
+        return NULL;
+    }
+    char raw_path[PATH_MAX];
+    snprintf(raw_path, sizeof (raw_path), "%s.%020llu", config.path, (unsigned long long)base);
+    snprintf(seg->path, sizeof (seg->path), "%s.%020llu.lz", config.path, (unsigned long long)base);
+
+    // A sealed segment may have been compressed, the .lz file is complete once it exists
+    seg->fd = create ? -1 : open(seg->path, O_RDONLY);
+    if (seg->fd != -1) {
+        seg->compressed = true;
+        unlink(raw_path);
+    } else {
+        snprintf(seg->path, sizeof (seg->path), "%s", raw_path);
+        seg->fd = open(seg->path, O_RDWR | O_APPEND | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    }
+    if (seg->fd == -1) {
+        printf("Failed to open segment %s.\n", seg->path);
+        free(seg);
+        return NULL;
+    }
+
+    struct stat st = {};
+    if (fstat(seg->fd, &st) == -1) {
+        printf("Failed to stat segment %s.\n", seg->path);
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    seg->base = base;
+    if (seg->compressed) {
+        ssize_t len = segment_load_blocks(seg);
+        if (len == -1) {
+            printf("Failed to load blocks of %s.\n", seg->path);
+            close(seg->fd);
+            free(seg->blocks);
+            free(seg);
+            return NULL;
+        }
+        st.st_size = len;
+    }
+    atomic_init(&seg->len, st.st_size);
+    seg->mtime = create ? time(NULL) : st.st_mtime;
+    atomic_init(&seg->refs, 1);
+
+    snprintf(seg->idx_path, sizeof (seg->idx_path), "%s.%020llu.idx", config.path, (unsigned long long)base);
+    pthread_mutex_init(&seg->idx_lock, NULL);
+    seg->idx_fd = open(seg->idx_path, O_RDWR | O_CREAT, 0600);
+    if (seg->idx_fd == -1) {
+        printf("Failed to open index %s.\n", seg->idx_path);
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    seg->first_record = first_record;
+    seg->at_record_start = true;
+    if ((create ? index_create(seg) : index_recover(seg, first_record, sealed)) == -1) {
+        close(seg->idx_fd);
+        close(seg->fd);
+        free(seg->blocks);
+        free(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+static void segment_put(struct aesdlog_segment *seg) {
+    if (atomic_fetch_sub(&seg->refs, 1) == 1) {
+        if (seg->idx_map != NULL) {
+            munmap((void *)((const char *)seg->idx_map - sizeof (struct aesdlog_index_header)),
+                sizeof (struct aesdlog_index_header) + seg->idx_mapped * sizeof (uint32_t));
+        }
+        pthread_mutex_destroy(&seg->idx_lock);
+        close(seg->idx_fd);
+        close(seg->fd);
+        free(seg->blocks);
+        free(seg);
+    }
+}
+
+static struct aesdlog_segment *segment_get(uint64_t offset) {
+
+    /**
+     * Find the segment holding the byte at logical offset
+     * @return Return the segment with a reference taken, or NULL if offset isn't retained
+     */
+
+    struct aesdlog_segment *seg = NULL;
+    size_t lo = 0, hi = 0;
+
+    pthread_rwlock_rdlock(&segs_lock);
+    hi = segs_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segs[mid]->base <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        seg = segs[lo - 1];
+        if (offset < seg->base + atomic_load_explicit(&seg->len, memory_order_acquire)) {
+            atomic_fetch_add(&seg->refs, 1);
+        } else {
+            seg = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&segs_lock);
+
+    return seg;
+}
+
+static int compare_base(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int scan_segments(void) {
+
+    /**
+     * Collect the segment files of a previous run. They are reopened when the log is kept
+     * across restarts and unlinked otherwise, so a crashed run doesn't leak into this one.
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    char dir_buf[PATH_MAX], name_buf[PATH_MAX];
+    snprintf(dir_buf, sizeof (dir_buf), "%s", config.path);
+    snprintf(name_buf, sizeof (name_buf), "%s", config.path);
+    const char *dir = dirname(dir_buf);
+    const char *name = basename(name_buf);
+    size_t name_len = strlen(name);
+
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        printf("Failed to open directory %s.\n", dir);
+        return -1;
+    }
+
+    static uint64_t bases[AESDLOG_MAX_SEGMENTS];
+    size_t bases_cnt = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dp)) != NULL) {
+        const char *suffix = ent->d_name + name_len + 1;
+        char *end = NULL;
+        if (strncmp(ent->d_name, name, name_len) != 0 || ent->d_name[name_len] != '.' || strlen(suffix) < 20) {
+            continue;
+        }
+        unsigned long long base = strtoull(suffix, &end, 10);
+        bool data = (*end == '\0' || strcmp(end, ".lz") == 0);
+        bool tmp = (strcmp(end, ".lz.tmp") == 0); // Interrupted compression, the raw segment is still there
+        if (end != suffix + 20 || (!data && !tmp && strcmp(end, ".idx") != 0)) {
+            continue;
+        }
+        if (!config.keep || tmp) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof (path), "%s/%s", dir, ent->d_name);
+            unlink(path);
+        } else if (data && bases_cnt < AESDLOG_MAX_SEGMENTS) {
+            bases[bases_cnt++] = base;
+        }
+    }
+    closedir(dp);
+
+    qsort(bases, bases_cnt, sizeof (uint64_t), compare_base);
+    for (size_t i = 0; i < bases_cnt; ++i) {
+        if (i > 0 && bases[i] == bases[i - 1]) {
+            continue; // Both raw and compressed files exist, segment_open() picks the compressed one
+        }
+        uint64_t first_record = segs_cnt ? segs[segs_cnt - 1]->first_record + atomic_load(&segs[segs_cnt - 1]->nrecords) : 0;
+        struct aesdlog_segment *seg = segment_open(bases[i], first_record, false, bases[i] != bases[bases_cnt - 1]);
+        if (seg == NULL) {
+            return -1;
+        }
+        segs[segs_cnt++] = seg;
+    }
+    return 0;
+}
+
+static bool segment_index(const struct aesdlog_segment *seg, size_t *i) {
+
+    /**
+     * Find a segment in the segment table, the caller holds segs_lock
+     * @return Return true if the segment is retained, its position stored in i
+     */
+
+    for (*i = 0; *i < segs_cnt; ++*i) {
+        if (segs[*i] == seg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int segment_compress(struct aesdlog_segment *raw) {
+
+    /**
+     * Replace the sealed segment raw, referenced by the caller, by a block compressed copy.
+     * The .lz file is written aside and renamed once complete, readers of the raw segment
+     * finish before it's closed. Runs on the compression thread, concurrently with appends.
+     * @return Return 0 on success, or -1 if an error occure or a stop was requested (the raw segment is kept)
+     */
+
+    static char raw_buf[AESDLOG_BLOCK_SIZE];
+    static char packed[AESDLZ_BOUND(AESDLOG_BLOCK_SIZE)];
+    char tmp_path[PATH_MAX], lz_path[PATH_MAX];
+    size_t len = atomic_load(&raw->len), raw_total = 0, comp_total = 0, i = 0;
+
+    snprintf(lz_path, sizeof (lz_path), "%s.%020llu.lz", config.path, (unsigned long long)raw->base);
+    snprintf(tmp_path, sizeof (tmp_path), "%s.%020llu.lz.tmp", config.path, (unsigned long long)raw->base);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        printf("Failed to open %s.\n", tmp_path);
+        return -1;
+    }
+
+    for (size_t pos = 0; pos < len; pos += AESDLOG_BLOCK_SIZE) {
+        size_t n = (len - pos) < AESDLOG_BLOCK_SIZE ? (len - pos) : AESDLOG_BLOCK_SIZE;
+        if (atomic_load(&compress_stop)) {
+            goto fail; // The log is closing, the raw segment is compressed by the next run
+        }
+        if (pread(raw->fd, raw_buf, n, pos) != (ssize_t)n) {
+            printf("Failed to read %s.\n", raw->path);
+            goto fail;
+        }
+        struct aesdlog_block_header hdr = { .magic = AESDLOG_BLOCK_MAGIC, .raw_len = n };
+        hdr.crc = aesdlz_crc32(raw_buf, n);
+        hdr.comp_len = aesdlz_compress(raw_buf, n, packed, n - 1); // Only keep blocks that shrink
+        const char *payload = packed;
+        if (hdr.comp_len == 0) {
+            hdr.comp_len = n;
+            payload = raw_buf;
+        }
+        if (write_all(fd, &hdr, sizeof (hdr)) == -1 || write_all(fd, payload, hdr.comp_len) == -1) {
+            printf("Failed to write %s.\n", tmp_path);
+            goto fail;
+        }
+        raw_total += n;
+        comp_total += sizeof (hdr) + hdr.comp_len;
+    }
+    if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp_path, lz_path) == -1) {
+        printf("Failed to commit %s.\n", lz_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&segs_lock);
+    bool retained = segment_index(raw, &i);
+    pthread_rwlock_unlock(&segs_lock);
+    if (!retained) {
+        unlink(lz_path); // Dropped by the retention while compressing
+        return 0;
+    }
+
+    // Reopening picks the .lz file, unlinks the raw one and validates the index
+    struct aesdlog_segment *lz = segment_open(raw->base, raw->first_record, false, true);
+    if (lz == NULL) {
+        return -1;
+    }
+    lz->mtime = raw->mtime;
+
+    pthread_rwlock_wrlock(&segs_lock);
+    retained = segment_index(raw, &i);
+    if (retained) {
+        segs[i] = lz;
+    }
+    pthread_rwlock_unlock(&segs_lock);
+    if (!retained) {
+        // Dropped by the retention while reopening
+        unlink(lz->path);
+        unlink(lz->idx_path);
+        segment_put(lz);
+        return 0;
+    }
+    segment_put(raw); // Reference of the segment table
+
+    printf("Compressed segment %s (%zu -> %zu bytes).\n", lz_path, raw_total, comp_total);
+    return 0;
+
+fail:
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+}
+
+static void *compress_sealed(void *arg) {
+
+    /**
+     * Compression thread: compress the sealed segments left raw each time the writer seals one
+     * @return Return NULL
+     */
+
+    (void)arg;
+    pthread_mutex_lock(&compress_lock);
+    while (!atomic_load(&compress_stop)) {
+        if (!compress_pending) {
+            pthread_cond_wait(&compress_cond, &compress_lock);
+            continue;
+        }
+        compress_pending = false;
+        pthread_mutex_unlock(&compress_lock);
+
+        while (!atomic_load(&compress_stop)) {
+            struct aesdlog_segment *seg = NULL;
+            pthread_rwlock_rdlock(&segs_lock);
+            for (size_t i = 0; i + 1 < segs_cnt && seg == NULL; ++i) {
+                if (!segs[i]->compressed && !segs[i]->compress_failed) {
+                    seg = segs[i];
+                    atomic_fetch_add(&seg->refs, 1);
+                }
+            }
+            pthread_rwlock_unlock(&segs_lock);
+            if (seg == NULL) {
+                break;
+            }
+            if (segment_compress(seg) == -1) {
+                seg->compress_failed = true;
+            }
+            segment_put(seg);
+        }
+
+        pthread_mutex_lock(&compress_lock);
+    }
+    pthread_mutex_unlock(&compress_lock);
+    return NULL;
+}
+
+static void compress_wakeup(void) {
+    pthread_mutex_lock(&compress_lock);
+    compress_pending = true;
+    pthread_cond_signal(&compress_cond);
+    pthread_mutex_unlock(&compress_lock);
+}
+
+static void apply_retention(void) {
+
+    /**
+     * Drop the oldest sealed segments exceeding the retention policy. Dropping is
+     * an unlink of the whole segment file, readers still holding it finish first.
+     */
+
+    time_t now = time(NULL);
+    uint64_t end = atomic_load(&end_offset);
+
+    while (segs_cnt > 1) {
+        // The compression thread may swap the oldest segment for its compressed copy, same base and mtime
+        pthread_rwlock_rdlock(&segs_lock);
+        bool over_size = config.retention_bytes && (end - segs[0]->base) > config.retention_bytes;
+        bool over_age = config.retention_secs && (now - segs[0]->mtime) > config.retention_secs;
+        pthread_rwlock_unlock(&segs_lock);
+        if (!over_size && !over_age) {
+            break;
+        }
+
+        pthread_rwlock_wrlock(&segs_lock);
+        struct aesdlog_segment *oldest = segs[0];
+        memmove(&segs[0], &segs[1], (segs_cnt - 1) * sizeof (segs[0]));
+        segs_cnt--;
+        atomic_store(&start_offset, segs[0]->base);
+        atomic_store(&start_record, segs[0]->first_record);
+        pthread_rwlock_unlock(&segs_lock);
+
+        printf("Dropped segment %s.\n", oldest->path);
+        unlink(oldest->path);
+        unlink(oldest->idx_path);
+        segment_put(oldest);
+    }
+}
+
+int aesdlog_open(const struct aesdlog_config *cfg) {
+    config = *cfg;
+    failed = false;
+    if (in_memory()) {
+        return aesdhistory_open(config.history_entries, config.history_bytes);
+    }
+    if (config.segment_size == 0) {
+        config.segment_size = AESDLOG_DEFAULT_SEGMENT_SIZE;
+    } else if (config.segment_size > UINT32_MAX / 2) {
+        config.segment_size = UINT32_MAX / 2; // Record positions in the index are 32 bits
+    }
+
+    if (scan_segments() == -1) {
+        return -1;
+    }
+    if (segs_cnt == 0) {
+        struct aesdlog_segment *seg = segment_open(0, 0, true, false);
+        if (seg == NULL) {
+            return -1;
+        }
+        segs[segs_cnt++] = seg;
+    }
+
+    struct aesdlog_segment *last = segs[segs_cnt - 1];
+    atomic_store(&start_offset, segs[0]->base);
+    atomic_store(&end_offset, last->base + atomic_load(&last->len));
+    atomic_store(&start_record, segs[0]->first_record);
+    atomic_store(&end_record, last->first_record + atomic_load(&last->nrecords));
+    printf("Opened log %s with %zu segment(s), offsets %llu..%llu.\n", config.path, segs_cnt,
+        (unsigned long long)atomic_load(&start_offset), (unsigned long long)atomic_load(&end_offset));
+
+    if (config.compress) {
+        atomic_store(&compress_stop, false);
+        compress_pending = true; // Sealed segments a previous run left raw
+        if (pthread_create(&compress_thread, NULL, compress_sealed, NULL) != 0) {
+            printf("Failed to start the compression thread, segments are kept raw.\n");
+        } else {
+            compress_running = true;
+        }
+    }
+    return 0;
+}
+
+void aesdlog_close(bool remove_segments) {
+    if (in_memory()) {
+        aesdhistory_close();
+        return;
+    }
+    if (compress_running) {
+        pthread_mutex_lock(&compress_lock);
+        atomic_store(&compress_stop, true);
+        pthread_cond_signal(&compress_cond);
+        pthread_mutex_unlock(&compress_lock);
+        pthread_join(compress_thread, NULL);
+        compress_running = false;
+    }
+    pthread_rwlock_wrlock(&segs_lock);
+    for (size_t i = 0; i < segs_cnt; ++i) {
+        if (remove_segments) {
+            unlink(segs[i]->path);
+            unlink(segs[i]->idx_path);
+        } else {
+            fsync(segs[i]->fd);
+            fsync(segs[i]->idx_fd);
+        }
+        segment_put(segs[i]);
+        segs[i] = NULL;
+    }
+    segs_cnt = 0;
+    pthread_rwlock_unlock(&segs_lock);
+}
+
+static int segment_rollback(struct aesdlog_segment *seg, size_t len) {
+
+    /**
+     * Drop the bytes and index entries of an append which couldn't be indexed, the segment
+     * is truncated back to its committed length and records
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    seg->idx_len = sizeof (struct aesdlog_index_header) + atomic_load(&seg->nrecords) * sizeof (uint32_t);
+    if (ftruncate(seg->fd, len) == -1 || ftruncate(seg->idx_fd, seg->idx_len) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t log_append(const char *buf, size_t len, enum log_append_mode mode) {
+
+    /**
+     * Append bytes to the active segment and index them, either as newline terminated
+     * records, as a single record whatever its content, or as the continuation of the
+     * last record. A segment always starts with a record, even with APPEND_CONTINUE.
+     * @return Return the number of bytes written, or -1 if an error occure
+     */
+
+    if (segs_cnt == 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+
+    struct aesdlog_segment *seg = segs[segs_cnt - 1];
+    if (atomic_load(&seg->len) >= config.segment_size) {
+        // Seal the active segment, packages never straddle two segments
+        if (segs_cnt == AESDLOG_MAX_SEGMENTS) {
+            printf("Failed to roll over log: too many segments.\n");
+            errno = ENOSPC;
+            return -1;
+        }
+        struct aesdlog_segment *next = segment_open(atomic_load(&end_offset),
+            seg->first_record + atomic_load(&seg->nrecords), true, false);
+        if (next == NULL) {
+            return -1;
+        }
+        pthread_rwlock_wrlock(&segs_lock);
+        segs[segs_cnt++] = next;
+        pthread_rwlock_unlock(&segs_lock);
+        if (config.compress) {
+            compress_wakeup();
+        }
+        seg = next;
+    }
+
+    size_t total = 0;
+    while (total < len) {
+        ssize_t sz = write(seg->fd, buf + total, len - total);
+        if (sz == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        total += sz;
+    }
+    if (total == 0 && len > 0) {
+        return -1;
+    }
+
+    // Index every record starting in the appended bytes
+    size_t seg_len = atomic_load(&seg->len);
+    bool at_record_start = seg->at_record_start;
+    uint32_t pos[AESDLOG_INDEX_BATCH];
+    size_t pos_cnt = 0, new_records = 0;
+    int rc = 0;
+    const char *p = buf, *end = buf + total;
+    if (mode != APPEND_LINES) {
+        if (mode == APPEND_RECORD || seg_len == 0) {
+            pos[pos_cnt++] = seg_len;
+            new_records++;
+        }
+        p = end;
+        seg->at_record_start = true;
+    }
+    while (p < end && rc == 0) {
+        if (seg->at_record_start) {
+            pos[pos_cnt++] = seg_len + (p - buf);
+            new_records++;
+            if (pos_cnt == AESDLOG_INDEX_BATCH) {
+                rc = index_write(seg, pos, pos_cnt);
+                pos_cnt = 0;
+            }
+        }
+        const char *nl = memchr(p, '\n', end - p);
+        seg->at_record_start = (nl != NULL);
+        p = nl ? nl + 1 : end;
+    }
+    if (pos_cnt && rc == 0) {
+        rc = index_write(seg, pos, pos_cnt);
+    }
+    if (rc == 0) {
+        uint32_t flags = (seg->idx_flags & AESDLOG_INDEX_BINARY) | (mode == APPEND_LINES ? 0 : AESDLOG_INDEX_BINARY);
+        rc = index_set_flags(seg, flags | (seg->at_record_start ? 0 : AESDLOG_INDEX_OPEN_RECORD));
+    }
+    if (rc == -1) {
+        // Unindexed records would be invisible to record queries and recovery, drop the bytes
+        seg->at_record_start = at_record_start;
+        if (segment_rollback(seg, seg_len) == -1) {
+            printf("Failed to roll back %s, appends are disabled.\n", seg->path);
+            failed = true;
+        }
+        errno = EIO;
+        return -1;
+    }
+
+    // Publish the new records then the new bytes to readers
+    seg->mtime = time(NULL);
+    atomic_fetch_add_explicit(&seg->nrecords, new_records, memory_order_release);
+    atomic_fetch_add_explicit(&end_record, new_records, memory_order_release);
+    atomic_fetch_add_explicit(&seg->len, total, memory_order_release);
+    atomic_fetch_add_explicit(&end_offset, total, memory_order_release);
+
+    apply_retention();
+
+    return total;
+}
+
+ssize_t aesdlog_append(const char *buf, size_t len) {
+    return in_memory() ? aesdhistory_append(buf, len, true) : log_append(buf, len, APPEND_LINES);
+}
+
+ssize_t aesdlog_append_record(const char *buf, size_t len) {
+    return in_memory() ? aesdhistory_append(buf, len, false) : log_append(buf, len, APPEND_RECORD);
+}
+
+ssize_t aesdlog_append_continue(const char *buf, size_t len) {
+    return in_memory() ? aesdhistory_append_continue(buf, len) : log_append(buf, len, APPEND_CONTINUE);
+}
+
+int aesdlog_reset(uint64_t base, uint64_t first_record) {
+    if (in_memory()) {
+        aesdhistory_reset(base, first_record);
+        return 0;
+    }
+
+    // Unlink every segment before creating the new one, which may reuse the base of an old one
+    struct aesdlog_segment *dropped[AESDLOG_MAX_SEGMENTS];
+    pthread_rwlock_wrlock(&segs_lock);
+    size_t dropped_cnt = segs_cnt;
+    memcpy(dropped, segs, segs_cnt * sizeof (segs[0]));
+    segs_cnt = 0;
+    atomic_store(&start_offset, base);
+    atomic_store(&end_offset, base);
+    atomic_store(&start_record, first_record);
+    atomic_store(&end_record, first_record);
+    pthread_rwlock_unlock(&segs_lock);
+    for (size_t i = 0; i < dropped_cnt; ++i) {
+        unlink(dropped[i]->path);
+        unlink(dropped[i]->idx_path);
+        segment_put(dropped[i]);
+    }
+
+    struct aesdlog_segment *seg = segment_open(base, first_record, true, false);
+    if (seg == NULL) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&segs_lock);
+    segs[segs_cnt++] = seg;
+    pthread_rwlock_unlock(&segs_lock);
+    failed = false;
+    printf("Reset log %s at offset %llu, record %llu.\n", config.path, (unsigned long long)base, (unsigned long long)first_record);
+    return 0;
+}
+
+ssize_t aesdlog_read(uint64_t offset, char *buf, size_t len) {
+    if (in_memory()) {
+        return aesdhistory_read(offset, buf, len);
+    }
+    struct aesdlog_segment *seg = segment_get(offset);
+    if (seg == NULL) {
+        if (offset < atomic_load(&start_offset)) {
+            errno = ENOENT;
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t avail = seg->base + atomic_load_explicit(&seg->len, memory_order_acquire) - offset;
+    if (len > avail) {
+        len = avail;
+    }
+    ssize_t sz = segment_pread(seg, buf, len, offset - seg->base);
+    segment_put(seg);
+    return sz;
+}
+
+uint64_t aesdlog_start_offset(void) {
+    return in_memory() ? aesdhistory_start_offset() : atomic_load(&start_offset);
+}
+
+uint64_t aesdlog_end_offset(void) {
+    return in_memory() ? aesdhistory_end_offset() : atomic_load_explicit(&end_offset, memory_order_acquire);
+}
+
+uint64_t aesdlog_start_record(void) {
+    return in_memory() ? aesdhistory_start_record() : atomic_load(&start_record);
+}
+
+uint64_t aesdlog_end_record(void) {
+    return in_memory() ? aesdhistory_end_record() : atomic_load_explicit(&end_record, memory_order_acquire);
+}
+
+static int record_offset(uint64_t record, uint64_t *offset) {
+
+    /**
+     * Resolve the logical offset of a committed record through the segment indexes
+     * @return Return 0 on success, or -1 if the record isn't retained
+     */
+
+    struct aesdlog_segment *seg = NULL;
+    size_t lo = 0, hi = 0;
+    uint32_t pos = 0;
+
+    pthread_rwlock_rdlock(&segs_lock);
+    hi = segs_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segs[mid]->first_record <= record) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        seg = segs[lo - 1];
+        if (record < seg->first_record + atomic_load_explicit(&seg->nrecords, memory_order_acquire)) {
+            atomic_fetch_add(&seg->refs, 1);
+        } else {
+            seg = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&segs_lock);
+
+    if (seg == NULL) {
+        return -1;
+    }
+    int rc = index_lookup(seg, record - seg->first_record, &pos);
+    *offset = seg->base + pos;
+    segment_put(seg);
+    return rc;
+}
+
+uint64_t aesdlog_disk_bytes(void) {
+    struct stat st;
+    uint64_t bytes = 0;
+
+    pthread_rwlock_rdlock(&segs_lock);
+    for (size_t i = 0; i < segs_cnt; ++i) {
+        if (fstat(segs[i]->fd, &st) == 0) {
+            bytes += st.st_size;
+        }
+        if (fstat(segs[i]->idx_fd, &st) == 0) {
+            bytes += st.st_size;
+        }
+    }
+    pthread_rwlock_unlock(&segs_lock);
+    return bytes;
+}
+
+int aesdlog_record_range(uint64_t first, uint64_t count, uint64_t *start, uint64_t *end) {
+    if (in_memory()) {
+        return aesdhistory_record_range(first, count, start, end);
+    }
+
+    // Bytes are published after records, so every byte below the end offset is indexed
+    uint64_t bytes_end = aesdlog_end_offset();
+    uint64_t records_end = aesdlog_end_record();
+    uint64_t records_start = aesdlog_start_record();
+
+    if (first < records_start) {
+        first = records_start;
+    }
+    if (first >= records_end || count == 0) {
+        *start = *end = bytes_end;
+        return 0;
+    }
+    if (record_offset(first, start) == -1) {
+        return -1;
+    }
+    *end = bytes_end;
+    if (count < records_end - first && record_offset(first + count, end) == -1) {
+        return -1;
+    }
+    if (*end > bytes_end) {
+        *end = bytes_end;
+    }
+    if (*start > *end) {
+        *start = *end;
+    }
+    return 0;
+}
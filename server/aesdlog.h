@@ -0,0 +1,108 @@
+#ifndef AESD_LOG
+#define AESD_LOG
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define AESDLOG_DEFAULT_SEGMENT_SIZE (1024*1024) // Roll over to a new segment file after 1 Mbytes
+#define AESDLOG_MAX_SEGMENTS 4096 // Maximal number of retained segment files
+
+// Persistent log configuration
+struct aesdlog_config {
+    const char *path; // Segment files are named <path>.<base offset>
+    size_t segment_size; // Size after which the active segment is sealed and a new one started
+    uint64_t retention_bytes; // Drop oldest segments once the log exceeds this size (0: unlimited)
+    time_t retention_secs; // Drop segments not written for this many seconds (0: unlimited)
+    bool keep; // Reopen existing segments at startup and keep them on exit
+    bool compress; // Store sealed segments as LZ4 compressed blocks
+    size_t history_entries; // Keep only this many records in memory instead of segment files (0: unlimited)
+    uint64_t history_bytes; // Keep only this many bytes in memory instead of segment files (0: unlimited)
+};
+
+/**
+ * Open the log, either empty or continuing the segments left by a previous run.
+ * With history_entries or history_bytes set the log is an in-memory history, see aesdhistory.h.
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdlog_open(const struct aesdlog_config *cfg);
+
+/**
+ * Close the log and optionally unlink all segment files
+ */
+void aesdlog_close(bool remove_segments);
+
+/**
+ * Append bytes at the end of the log, rolling over and applying retention as needed.
+ * Appends must be serialized by the caller, the new end offset is published once written.
+ * @return Return the number of bytes written, or -1 if an error occure
+ */
+ssize_t aesdlog_append(const char *buf, size_t len);
+
+/**
+ * Append bytes at the end of the log as a single record, without scanning them for newlines
+ * @return Return the number of bytes written, or -1 if an error occure
+ */
+ssize_t aesdlog_append_record(const char *buf, size_t len);
+
+/**
+ * Append bytes at the end of the log to the last record, without scanning them for newlines.
+ * A replica uses it to mirror a record its primary extended. The bytes start a record when
+ * the log or its active segment is empty.
+ * @return Return the number of bytes written, or -1 if an error occure
+ */
+ssize_t aesdlog_append_continue(const char *buf, size_t len);
+
+/**
+ * Drop every byte of the log and continue it empty from logical offset base and record
+ * first_record, as a replica does when its primary log was recreated or dropped bytes.
+ * Appends must be serialized by the caller, readers see an empty log.
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdlog_reset(uint64_t base, uint64_t first_record);
+
+/**
+ * Read bytes starting at a logical offset, never across a segment boundary.
+ * Safe to call concurrently with appends and with other readers.
+ * @return Return the number of bytes read, 0 at the end of the log, or -1 if an error occure
+ *      (errno is ENOENT when the offset was dropped by retention)
+ */
+ssize_t aesdlog_read(uint64_t offset, char *buf, size_t len);
+
+/**
+ * Logical offset of the oldest retained byte
+ */
+uint64_t aesdlog_start_offset(void);
+
+/**
+ * Logical offset after the last committed byte (the replay watermark)
+ */
+uint64_t aesdlog_end_offset(void);
+
+/**
+ * Record number of the oldest retained record. Records are the newline terminated
+ * lines of the log, numbered from 0 since the log was created.
+ */
+uint64_t aesdlog_start_record(void);
+
+/**
+ * Record number after the last committed record
+ */
+uint64_t aesdlog_end_record(void);
+
+/**
+ * Bytes of the segment and index files on disk, compressed segments counted at their
+ * compressed size. 0 when the log is kept in memory.
+ */
+uint64_t aesdlog_disk_bytes(void);
+
+/**
+ * Resolve records [first, first+count) to the byte range [start, end) using the
+ * sidecar indexes, without scanning the data. Records dropped by retention are skipped.
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdlog_record_range(uint64_t first, uint64_t count, uint64_t *start, uint64_t *end);
+
+#endif // AESD_LOG
@@ -0,0 +1,185 @@
+#include <aesdlz.h>
+
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Minimal compressor for the LZ4 block format: a sequence is a token (literal length
+ * in the high nibble, match length - 4 in the low nibble), optional length bytes, the
+ * literals, a 16 bits little endian match offset and optional match length bytes.
+ * A single 4 bytes hash table lookup per position keeps it fast rather than tight.
+ */
+
+#define MINMATCH 4
+#define LASTLITERALS 5 // The last 5 bytes are always literals
+#define MFLIMIT 12 // The last match must start at least 12 bytes before the end
+#define MAX_DISTANCE 65535
+#define HASH_LOG 12
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *anchor, size_t lit,
+        size_t offset, size_t mlen, int last) {
+
+    /**
+     * Emit literals followed by a match, or only literals for the last sequence
+     * @return Return the new output position, or NULL if dst is too small
+     */
+
+    size_t need = 1 + lit + lit / 255 + 1 + (last ? 0 : 2 + mlen / 255 + 1);
+    if (need > (size_t)(oend - op)) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) {
+        op = write_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (last) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= (mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15) {
+        op = write_length(op, mlen - 15);
+    }
+    return op;
+}
+
+size_t aesdlz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap) {
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base, *anchor = base, *iend = base + src_len;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *oend = op + dst_cap;
+    uint32_t table[1 << HASH_LOG];
+
+    memset(table, 0, sizeof (table));
+    if (src_len >= MFLIMIT) {
+        const uint8_t *mflimit = iend - MFLIMIT, *matchlimit = iend - LASTLITERALS;
+        while (ip < mflimit) {
+            uint32_t h = hash4(read32(ip));
+            const uint8_t *ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *mp = ip + MINMATCH, *rp = ref + MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip - MINMATCH, 0);
+            if (op == NULL) {
+                return 0;
+            }
+            ip = anchor = mp;
+        }
+    }
+
+    op = write_sequence(op, oend, anchor, iend - anchor, 0, 0, 1);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (uint8_t *)dst;
+}
+
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b = 0;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+ssize_t aesdlz_decompress(const char *src, size_t src_len, char *dst, size_t dst_cap) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + src_len;
+    uint8_t *op = (uint8_t *)dst, *oend = op + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && read_length(&ip, iend, &lit) == -1) {
+            return -1;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break; // Last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && read_length(&ip, iend, &mlen) == -1) {
+            return -1;
+        }
+        mlen += MINMATCH;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        // Byte copy, the match may overlap the output
+        const uint8_t *match = op - offset;
+        while (mlen--) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+uint32_t aesdlz_crc32(const char *buf, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) {
+        c = crc_table[(c ^ (uint8_t)buf[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
@@ -0,0 +1,30 @@
+#ifndef AESD_LZ
+#define AESD_LZ
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Worst case compressed size of len bytes
+ */
+#define AESDLZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/**
+ * Compress src into dst using the LZ4 block format
+ * @return Return the compressed size, or 0 if it doesn't fit in dst_cap
+ */
+size_t aesdlz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap);
+
+/**
+ * Decompress an LZ4 block from src into dst
+ * @return Return the decompressed size, or -1 if the block is corrupted or doesn't fit in dst_cap
+ */
+ssize_t aesdlz_decompress(const char *src, size_t src_len, char *dst, size_t dst_cap);
+
+/**
+ * CRC-32 (IEEE 802.3) of buf
+ */
+uint32_t aesdlz_crc32(const char *buf, size_t len);
+
+#endif // AESD_LZ
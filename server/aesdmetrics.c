@@ -0,0 +1,313 @@
+#include <aesdmetrics.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define METRICS_BUCKETS 12
+#define METRICS_REPLY_LEN (16*1024)
+#define METRICS_CACHE_LINE 64
+
+// Upper bounds of the histogram buckets, the last (implicit) bucket is +Inf
+static const uint64_t bucket_bounds_ns[METRICS_BUCKETS] = {
+    10000, 50000, 100000, 500000,
+    1000000, 5000000, 10000000, 50000000,
+    100000000, 500000000, 1000000000, 5000000000,
+};
+static const char *bucket_labels[METRICS_BUCKETS] = {
+    "0.00001", "0.00005", "0.0001", "0.0005",
+    "0.001", "0.005", "0.01", "0.05",
+    "0.1", "0.5", "1", "5",
+};
+
+struct metrics_histogram {
+    _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+    _Atomic uint64_t sum_ns;
+};
+
+// Counters of one thread, on their own cache lines so threads never share one
+struct metrics_shard {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t counters[AESDMETRICS_COUNTERS];
+    struct metrics_histogram histograms[AESDMETRICS_HISTOGRAMS];
+    bool in_use; // Owned by a live thread, protected by shards_lock
+    struct metrics_shard *next;
+};
+
+static struct metrics_shard *shards = NULL; // Every shard ever created, never freed
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread struct metrics_shard *local_shard = NULL;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_desc[AESDMETRICS_COUNTERS] = {
+    [AESDMETRICS_CONN_OPENED] = {"aesdsocket_connections_total", "Client connections served"},
+    [AESDMETRICS_CONN_CLOSED] = {"aesdsocket_connections_closed_total", "Client connections ended"},
+    [AESDMETRICS_BYTES_IN] = {"aesdsocket_received_bytes_total", "Bytes received from clients"},
+    [AESDMETRICS_BYTES_OUT] = {"aesdsocket_sent_bytes_total", "Bytes sent to clients"},
+    [AESDMETRICS_PACKETS_IN] = {"aesdsocket_received_packets_total", "Packages or frames received from clients"},
+    [AESDMETRICS_PACKETS_OUT] = {"aesdsocket_sent_packets_total", "Replies or frames sent to clients"},
+    [AESDMETRICS_SEND_EAGAIN] = {"aesdsocket_send_eagain_total", "Send retries on a full socket buffer"},
+    [AESDMETRICS_MUTEX_WAIT_NS] = {NULL, NULL}, // Reported in seconds, see metrics_format
+    [AESDMETRICS_RATE_LIMIT_NS] = {NULL, NULL},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_desc[AESDMETRICS_HISTOGRAMS] = {
+    [AESDMETRICS_APPEND] = {"aesdsocket_append_latency_seconds", "Append to the persistent file, mutex wait included"},
+    [AESDMETRICS_REPLAY] = {"aesdsocket_replay_latency_seconds", "Replay of the history or of a record query"},
+};
+
+static void shard_release(void *arg) {
+    struct metrics_shard *shard = arg;
+
+    // Keep the counts, the next thread continues from them
+    pthread_mutex_lock(&shards_lock);
+    shard->in_use = false;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+static struct metrics_shard *shard_acquire(void) {
+
+    /**
+     * Attach a shard to the calling thread, reusing one of an exited thread if any
+     * @return Return the shard, or NULL if an error occure
+     */
+
+    pthread_once(&shard_key_once, shard_key_create);
+
+    pthread_mutex_lock(&shards_lock);
+    struct metrics_shard *shard = shards;
+    while (shard != NULL && shard->in_use) {
+        shard = shard->next;
+    }
+    if (shard == NULL) {
+        shard = aligned_alloc(METRICS_CACHE_LINE, sizeof (*shard));
+        if (shard == NULL) {
+            pthread_mutex_unlock(&shards_lock);
+            return NULL;
+        }
+        memset(shard, 0, sizeof (*shard));
+        shard->next = shards;
+        shards = shard;
+    }
+    shard->in_use = true;
+    pthread_mutex_unlock(&shards_lock);
+
+    pthread_setspecific(shard_key, shard); // Released when the thread exits
+    local_shard = shard;
+    return shard;
+}
+
+static void shard_add(_Atomic uint64_t *v, uint64_t delta) {
+    // Single writer, a relaxed load and store avoids a locked instruction
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+void aesdmetrics_add(enum aesdmetrics_counter counter, uint64_t v) {
+    struct metrics_shard *shard = local_shard ? local_shard : shard_acquire();
+    if (shard != NULL) {
+        shard_add(&shard->counters[counter], v);
+    }
+}
+
+void aesdmetrics_observe(enum aesdmetrics_histogram histogram, uint64_t ns) {
+    struct metrics_shard *shard = local_shard ? local_shard : shard_acquire();
+    if (shard == NULL) {
+        return;
+    }
+
+    size_t bucket = 0;
+    while (bucket < METRICS_BUCKETS && ns > bucket_bounds_ns[bucket]) {
+        bucket++;
+    }
+    shard_add(&shard->histograms[histogram].buckets[bucket], 1);
+    shard_add(&shard->histograms[histogram].sum_ns, ns);
+}
+
+uint64_t aesdmetrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t metrics_format(char *buf, size_t len, uint64_t (*log_bytes)(void), uint64_t (*lag_bytes)(void)) {
+
+    /**
+     * Sum the shards of all threads and format them in the Prometheus text format
+     * @return Return the number of bytes written to buf
+     */
+
+    uint64_t counters[AESDMETRICS_COUNTERS] = {};
+    uint64_t buckets[AESDMETRICS_HISTOGRAMS][METRICS_BUCKETS + 1] = {};
+    uint64_t sums[AESDMETRICS_HISTOGRAMS] = {};
+
+    pthread_mutex_lock(&shards_lock);
+    for (struct metrics_shard *shard = shards; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < AESDMETRICS_COUNTERS; ++i) {
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int h = 0; h < AESDMETRICS_HISTOGRAMS; ++h) {
+            for (int b = 0; b <= METRICS_BUCKETS; ++b) {
+                buckets[h][b] += atomic_load_explicit(&shard->histograms[h].buckets[b], memory_order_relaxed);
+            }
+            sums[h] += atomic_load_explicit(&shard->histograms[h].sum_ns, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    size_t pos = 0;
+    #define METRICS_PRINT(...) \
+        if (pos < len) pos += snprintf(buf + pos, len - pos, __VA_ARGS__)
+
+    // Counters are updated by different threads, closes may be seen before their opens
+    uint64_t active = counters[AESDMETRICS_CONN_OPENED] > counters[AESDMETRICS_CONN_CLOSED] ?
+        counters[AESDMETRICS_CONN_OPENED] - counters[AESDMETRICS_CONN_CLOSED] : 0;
+    METRICS_PRINT("# HELP aesdsocket_connections_active Client connections currently open\n");
+    METRICS_PRINT("# TYPE aesdsocket_connections_active gauge\n");
+    METRICS_PRINT("aesdsocket_connections_active %llu\n", (unsigned long long)active);
+
+    for (int i = 0; i < AESDMETRICS_COUNTERS; ++i) {
+        if (counter_desc[i].name == NULL) {
+            continue;
+        }
+        METRICS_PRINT("# HELP %s %s\n", counter_desc[i].name, counter_desc[i].help);
+        METRICS_PRINT("# TYPE %s counter\n", counter_desc[i].name);
+        METRICS_PRINT("%s %llu\n", counter_desc[i].name, (unsigned long long)counters[i]);
+    }
+
+    METRICS_PRINT("# HELP aesdsocket_mutex_wait_seconds_total Time spent waiting for the append mutex\n");
+    METRICS_PRINT("# TYPE aesdsocket_mutex_wait_seconds_total counter\n");
+    METRICS_PRINT("aesdsocket_mutex_wait_seconds_total %.9f\n", counters[AESDMETRICS_MUTEX_WAIT_NS] / 1e9);
+    METRICS_PRINT("# HELP aesdsocket_rate_limit_seconds_total Time connections were held back by their rate limit\n");
+    METRICS_PRINT("# TYPE aesdsocket_rate_limit_seconds_total counter\n");
+    METRICS_PRINT("aesdsocket_rate_limit_seconds_total %.9f\n", counters[AESDMETRICS_RATE_LIMIT_NS] / 1e9);
+
+    for (int h = 0; h < AESDMETRICS_HISTOGRAMS; ++h) {
+        const char *name = histogram_desc[h].name;
+        uint64_t cumulative = 0;
+        METRICS_PRINT("# HELP %s %s\n", name, histogram_desc[h].help);
+        METRICS_PRINT("# TYPE %s histogram\n", name);
+        for (int b = 0; b < METRICS_BUCKETS; ++b) {
+            cumulative += buckets[h][b];
+            METRICS_PRINT("%s_bucket{le=\"%s\"} %llu\n", name, bucket_labels[b], (unsigned long long)cumulative);
+        }
+        cumulative += buckets[h][METRICS_BUCKETS];
+        METRICS_PRINT("%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        METRICS_PRINT("%s_sum %.9f\n", name, sums[h] / 1e9);
+        METRICS_PRINT("%s_count %llu\n", name, (unsigned long long)cumulative);
+    }
+
+    if (log_bytes != NULL) {
+        METRICS_PRINT("# HELP aesdsocket_log_bytes Bytes of the persistent log files on disk\n");
+        METRICS_PRINT("# TYPE aesdsocket_log_bytes gauge\n");
+        METRICS_PRINT("aesdsocket_log_bytes %llu\n", (unsigned long long)log_bytes());
+    }
+    if (lag_bytes != NULL) {
+        METRICS_PRINT("# HELP aesdsocket_follower_lag_bytes Bytes appended to the primary log not yet replicated\n");
+        METRICS_PRINT("# TYPE aesdsocket_follower_lag_bytes gauge\n");
+        METRICS_PRINT("aesdsocket_follower_lag_bytes %llu\n", (unsigned long long)lag_bytes());
+    }
+    #undef METRICS_PRINT
+
+    return pos < len ? pos : len;
+}
+
+static int metrics_listen(const char *port) {
+
+    /**
+     * Bind and listen on the metrics port of the loopback interface
+     * @return Return the listening fd, or -1 if an error occure
+     */
+
+    struct addrinfo hints = {}, *addr = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo("127.0.0.1", port, &hints, &addr) != 0) {
+        return -1;
+    }
+
+    int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+    int opt_enable = 1;
+    if (fd != -1 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof (opt_enable)) != 0
+            || bind(fd, addr->ai_addr, addr->ai_addrlen) != 0 || listen(fd, 5) != 0)) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr);
+    return fd;
+}
+
+static uint64_t (*metrics_log_bytes)(void) = NULL;
+static uint64_t (*metrics_lag_bytes)(void) = NULL;
+
+static void* metrics_serve(void *_args) {
+
+    /**
+     * Answer every connection on the metrics port with the current metrics as an HTTP response
+     * @param _args The metrics port
+     * @return Void
+     */
+
+    const char *port = _args;
+    int fd = -1;
+    while ((fd = metrics_listen(port)) == -1) {
+        sleep(1); // Port still held, e.g. by the instance this one is taking over from
+    }
+    printf("Metrics served on 127.0.0.1:%s.\n", port);
+
+    char *reply = malloc(METRICS_REPLY_LEN);
+    char request[1024];
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    for (;;) {
+        int connfd = accept(fd, NULL, NULL);
+        if (connfd == -1) {
+            continue;
+        }
+
+        // The request itself is ignored, any path returns the metrics
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+        if (recv(connfd, request, sizeof (request), 0) >= 0 && reply != NULL) {
+            char *body = reply + 128;
+            size_t body_len = metrics_format(body, METRICS_REPLY_LEN - 128, metrics_log_bytes, metrics_lag_bytes);
+            int hdr_len = snprintf(reply, 128, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n\r\n", body_len);
+            memmove(reply + hdr_len, body, body_len);
+            send(connfd, reply, hdr_len + body_len, MSG_NOSIGNAL);
+        }
+        close(connfd);
+    }
+
+    return NULL;
+}
+
+int aesdmetrics_start(const char *port, uint64_t (*log_bytes)(void), uint64_t (*lag_bytes)(void)) {
+    pthread_t thread;
+
+    metrics_log_bytes = log_bytes;
+    metrics_lag_bytes = lag_bytes;
+    if (pthread_create(&thread, NULL, metrics_serve, (void *)port) != 0) {
+        printf("Failed to start metrics thread.\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef AESD_METRICS
+#define AESD_METRICS
+
+#include <stdint.h>
+
+// Monotonic counters, each thread updates its own copy and scrapes sum them up
+enum aesdmetrics_counter {
+    AESDMETRICS_CONN_OPENED, // Client connections served
+    AESDMETRICS_CONN_CLOSED, // Client connections ended (closed or handed over)
+    AESDMETRICS_BYTES_IN, // Bytes received from clients
+    AESDMETRICS_BYTES_OUT, // Bytes sent to clients
+    AESDMETRICS_PACKETS_IN, // Packages or frames received
+    AESDMETRICS_PACKETS_OUT, // Replies or frames sent
+    AESDMETRICS_SEND_EAGAIN, // Send retries on a full socket buffer
+    AESDMETRICS_MUTEX_WAIT_NS, // Time spent waiting for the append mutex
+    AESDMETRICS_RATE_LIMIT_NS, // Time connections were held back by their rate limit
+    AESDMETRICS_COUNTERS
+};
+
+// Latency histograms
+enum aesdmetrics_histogram {
+    AESDMETRICS_APPEND, // Append to the persistent file, mutex wait included
+    AESDMETRICS_REPLAY, // Replay of the history or of a record query
+    AESDMETRICS_HISTOGRAMS
+};
+
+/**
+ * Add v to a counter of the calling thread. Lock free, the counters of a thread
+ * are only written by that thread.
+ */
+void aesdmetrics_add(enum aesdmetrics_counter counter, uint64_t v);
+
+/**
+ * Record a duration in nanoseconds into a histogram of the calling thread
+ */
+void aesdmetrics_observe(enum aesdmetrics_histogram histogram, uint64_t ns);
+
+/**
+ * Monotonic clock in nanoseconds, to measure the durations passed to aesdmetrics_observe
+ */
+uint64_t aesdmetrics_now(void);
+
+/**
+ * Serve the metrics in the Prometheus text format on 127.0.0.1:port from a background thread.
+ * The port is bound as soon as it is free, so an upgraded instance takes it over once the
+ * previous instance exited.
+ * @param port The localhost port to serve the metrics on
+ * @param log_bytes Report the size of the persistent log files, or NULL if there is none
+ * @param lag_bytes Report the bytes a follower is behind its primary, or NULL if not a follower
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdmetrics_start(const char *port, uint64_t (*log_bytes)(void), uint64_t (*lag_bytes)(void));
+
+#endif // AESD_METRICS
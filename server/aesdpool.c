@@ -0,0 +1,47 @@
+#include <aesdpool.h>
+
+#include <stdlib.h>
+
+int aesdpool_init(struct aesdpool *pool, size_t slab_size, size_t cached_max) {
+    pool->slab_size = slab_size;
+    pool->cached_max = cached_max;
+    pool->free_cnt = 0;
+    pool->free_slabs = malloc((cached_max ? cached_max : 1) * sizeof (void *));
+    if (pool->free_slabs == NULL) {
+        return -1;
+    }
+    return pthread_mutex_init(&pool->lock, NULL) == 0 ? 0 : -1;
+}
+
+void *aesdpool_get(struct aesdpool *pool) {
+    void *slab = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_cnt > 0) {
+        slab = pool->free_slabs[--pool->free_cnt];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slab != NULL ? slab : malloc(pool->slab_size);
+}
+
+void aesdpool_put(struct aesdpool *pool, void *slab) {
+    if (slab == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_cnt < pool->cached_max) {
+        pool->free_slabs[pool->free_cnt++] = slab;
+        slab = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(slab); // More free slabs than connections usually served at once
+}
+
+void aesdpool_destroy(struct aesdpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->free_cnt > 0) {
+        free(pool->free_slabs[--pool->free_cnt]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(pool->free_slabs);
+    pool->free_slabs = NULL;
+}
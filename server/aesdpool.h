@@ -0,0 +1,40 @@
+#ifndef AESD_POOL
+#define AESD_POOL
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Fixed-size buffers recycled across client connections instead of malloc'd per connection
+struct aesdpool {
+    pthread_mutex_t lock; // Protects free_slabs, taken once per connection
+    size_t slab_size; // Bytes of every slab
+    size_t cached_max; // Free slabs kept for the next connections, more are freed
+    size_t free_cnt;
+    void **free_slabs; // Stack of free slabs, the most recently used on top
+};
+
+/**
+ * Initialize an empty pool, slabs are allocated when no free one is left
+ * @param slab_size Bytes of every slab
+ * @param cached_max Maximal number of free slabs kept
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int aesdpool_init(struct aesdpool *pool, size_t slab_size, size_t cached_max);
+
+/**
+ * Take a slab of pool->slab_size bytes. Its content is undefined.
+ * @return Return the slab, or NULL if an error occure
+ */
+void *aesdpool_get(struct aesdpool *pool);
+
+/**
+ * Give a slab back to the pool
+ */
+void aesdpool_put(struct aesdpool *pool, void *slab);
+
+/**
+ * Free the free slabs of the pool, the slabs still taken are not tracked
+ */
+void aesdpool_destroy(struct aesdpool *pool);
+
+#endif // AESD_POOL
@@ -0,0 +1,123 @@
+#include <aesdsched.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+// Rate limits by client address
+static struct {
+    char ip[INET6_ADDRSTRLEN];
+    double rate;
+    double burst;
+} limits[AESDSCHED_MAX_LIMITS];
+static int limits_cnt = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int aesdsched_add_limit(const char *rule) {
+    const char *eq = strchr(rule, '=');
+    double rate = 0, burst = 0;
+    if (eq == NULL || eq == rule || (size_t)(eq - rule) >= sizeof (limits[0].ip) || limits_cnt == AESDSCHED_MAX_LIMITS) {
+        return -1;
+    }
+    int n = sscanf(eq + 1, "%lf/%lf", &rate, &burst);
+    if (n < 1 || rate <= 0 || (n == 2 && burst < 1)) {
+        return -1;
+    }
+    memcpy(limits[limits_cnt].ip, rule, eq - rule);
+    limits[limits_cnt].ip[eq - rule] = '\0';
+    limits[limits_cnt].rate = rate;
+    limits[limits_cnt].burst = n == 2 ? burst : (rate < 1 ? 1 : rate); // One second of packages by default
+    limits_cnt++;
+    return 0;
+}
+
+void aesdsched_bucket_init(struct aesdsched_bucket *bucket, const char *ip) {
+    int rule = -1;
+    for (int i = 0; i < limits_cnt; ++i) {
+        if (strcmp(limits[i].ip, ip) == 0) {
+            rule = i; // The rule of the address wins over the default one
+            break;
+        }
+        if (rule == -1 && strcmp(limits[i].ip, "*") == 0) {
+            rule = i;
+        }
+    }
+    memset(bucket, 0, sizeof (*bucket));
+    if (rule != -1) {
+        bucket->rate = limits[rule].rate;
+        bucket->burst = limits[rule].burst;
+    }
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = now_ns();
+}
+
+uint64_t aesdsched_bucket_take(struct aesdsched_bucket *bucket, bool (*stop)(void)) {
+    if (bucket->rate == 0) {
+        return 0;
+    }
+
+    uint64_t now = now_ns(), start = now;
+    bucket->tokens += (now - bucket->last_ns) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last_ns = now;
+    if (bucket->tokens < 1) {
+        // Sleep until the missing fraction of a token is refilled, the client waits in the socket buffers.
+        // The sleep is sliced so that a stop request is noticed without waiting for the refill.
+        uint64_t deadline = now + (uint64_t)((1 - bucket->tokens) * 1e9 / bucket->rate);
+        while (now < deadline) {
+            if (stop != NULL && stop()) {
+                bucket->tokens += (now - bucket->last_ns) * bucket->rate / 1e9;
+                bucket->last_ns = now;
+                return now - start;
+            }
+            uint64_t slice = deadline - now < AESDSCHED_SLEEP_SLICE_NS ? deadline - now : AESDSCHED_SLEEP_SLICE_NS;
+            struct timespec ts = { .tv_sec = slice / 1000000000ULL, .tv_nsec = slice % 1000000000ULL };
+            clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL); // Interrupted sleeps are resumed by the loop
+            now = now_ns();
+        }
+        bucket->tokens = 1;
+        bucket->last_ns = now;
+    }
+    bucket->tokens -= 1;
+    return now - start;
+}
+
+void aesdsched_gate_init(struct aesdsched_gate *gate, unsigned int slots) {
+    pthread_mutex_init(&gate->lock, NULL);
+    pthread_cond_init(&gate->cond, NULL);
+    gate->next_ticket = 0;
+    gate->admitted = 0;
+    gate->inside = 0;
+    gate->slots = slots ? slots : 1;
+}
+
+void aesdsched_gate_enter(struct aesdsched_gate *gate) {
+    pthread_mutex_lock(&gate->lock);
+    uint64_t ticket = gate->next_ticket++;
+    while (ticket != gate->admitted || gate->inside == gate->slots) {
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    }
+    gate->admitted++;
+    gate->inside++;
+    if (gate->inside < gate->slots && gate->admitted < gate->next_ticket) {
+        pthread_cond_broadcast(&gate->cond); // The next ticket may enter too
+    }
+    pthread_mutex_unlock(&gate->lock);
+}
+
+void aesdsched_gate_leave(struct aesdsched_gate *gate) {
+    pthread_mutex_lock(&gate->lock);
+    gate->inside--;
+    if (gate->admitted < gate->next_ticket) {
+        pthread_cond_broadcast(&gate->cond);
+    }
+    pthread_mutex_unlock(&gate->lock);
+}
@@ -0,0 +1,65 @@
+#ifndef AESD_SCHED
+#define AESD_SCHED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define AESDSCHED_MAX_LIMITS 32 // Maximal number of --rate-limit rules
+#define AESDSCHED_SLEEP_SLICE_NS 100000000ULL // Longest rate limit sleep between two stop checks
+
+// Token bucket of a connection, refilled at rate tokens per second up to burst tokens
+struct aesdsched_bucket {
+    double rate; // 0: unlimited
+    double burst;
+    double tokens;
+    uint64_t last_ns; // Time of the last refill
+};
+
+// FIFO admission to a shared resource: at most slots threads inside, admitted in arrival order.
+// A connection holds one ticket at a time, so waiting connections are served round-robin.
+struct aesdsched_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next_ticket; // Ticket of the next thread to arrive
+    uint64_t admitted; // Tickets below admitted are inside or left
+    unsigned int inside;
+    unsigned int slots;
+};
+
+/**
+ * Add a rate limit rule <ip>=<packages per second>[/<burst>], where <ip> is a client address
+ * or * for every client without a rule of its own
+ * @return Return 0 on success, or -1 if the rule is malformed or too many rules were added
+ */
+int aesdsched_add_limit(const char *rule);
+
+/**
+ * Initialize the token bucket of a connection from the rule of its client address, full
+ */
+void aesdsched_bucket_init(struct aesdsched_bucket *bucket, const char *ip);
+
+/**
+ * Take a token, sleeping until the bucket holds one. The sleep is given up without taking
+ * a token as soon as stop returns true, stop is polled every AESDSCHED_SLEEP_SLICE_NS.
+ * @param stop Return true when the caller is asked to stop, or NULL to always wait for the token
+ * @return Return the nanoseconds slept
+ */
+uint64_t aesdsched_bucket_take(struct aesdsched_bucket *bucket, bool (*stop)(void));
+
+/**
+ * Initialize a gate letting slots threads in at once
+ */
+void aesdsched_gate_init(struct aesdsched_gate *gate, unsigned int slots);
+
+/**
+ * Wait for the turn of the calling thread to enter the gate
+ */
+void aesdsched_gate_enter(struct aesdsched_gate *gate);
+
+/**
+ * Leave the gate, letting in the next waiting thread
+ */
+void aesdsched_gate_leave(struct aesdsched_gate *gate);
+
+#endif // AESD_SCHED
@@ -7,12 +7,12 @@ void signal_handle(int signal_number) {
     if (signal_number == SIGINT || signal_number == SIGTERM) {
         syslog(LOG_NOTICE, "Caught signal, exiting.");
 
-        #ifndef USE_AESD_CHAR_DEVICE
-        remove(persistent_file);
-        #endif
-
         shutdown(sockfd, SHUT_RDWR);
         close(sockfd);
+        unlink(upgrade_socket);
+        if (unix_dgram_path != NULL) {
+            unlink(unix_dgram_path);
+        }
 
         pthread_mutex_lock(&mutex);
         thd_exit_requested = 1;
@@ -31,13 +31,21 @@ void signal_handle(int signal_number) {
                 free(thd);
             }
         }
+        aesdpool_destroy(&msg_pool);
+
+        #ifndef USE_AESD_CHAR_DEVICE
+        aesdpool_destroy(&frame_pool);
+        aesdlog_close(!log_config.keep);
+        #endif
     }
 
     exit(0);
 }
 
 void cleanup() {
-    freeaddrinfo(result);
+    if (result != NULL) {
+        freeaddrinfo(result);
+    }
 }
 
 
@@ -53,6 +61,158 @@ int main(int argc, char *argv[]) {
     openlog("CourseraAssignment5::Server", LOG_PID | LOG_LOCAL0, LOG_USER);
     syslog(LOG_NOTICE, "Server started by User %d", getuid ());
 
+    int handoff_fds[MAX_THREADS]; // Client connections taken over from the running instance
+    size_t handoff_cnt = 0;
+    if (upgrade_flag) {
+        // Take over the listening socket and live connections of the running instance
+        sockfd = upgrade_takeover(handoff_fds, &handoff_cnt);
+        if (sockfd == -1) {
+            printf("Failed to take over running instance.\n"); 
+            exit(-1);
+        }
+        printf("Took over listening socket and %zu connection(s).\n", handoff_cnt); 
+    } else {
+        sockfd = create_listener();
+    }
+
+    // Fork a new process and exit this parent process
+    if (daemon_flag) {
+        printf("Running in background.\n"); 
+        if ((daemon(0, 0)) == -1) {
+            printf("Failed to enter daemon mode.\n"); 
+            exit(-1);
+        }
+    }
+
+    // Init threads list
+    SLIST_INIT(&head);
+
+    // Fair admission of appends and replays
+    aesdsched_gate_init(&append_gate, 1);
+    aesdsched_gate_init(&replay_gate, sysconf(_SC_NPROCESSORS_ONLN));
+
+    // Buffers recycled across connections
+    if (aesdpool_init(&msg_pool, MAX_PACKAGE_LEN_KB + 1, MAX_THREADS) == -1) {
+        printf("Failed to create buffer pool.\n"); 
+        exit(-1);
+    }
+    #ifndef USE_AESD_CHAR_DEVICE
+    if (aesdpool_init(&frame_pool, sizeof (struct aesd_frame_header) + AESD_FRAME_MAX_PAYLOAD, MAX_THREADS) == -1) {
+        printf("Failed to create buffer pool.\n"); 
+        exit(-1);
+    }
+    #endif
+
+    #ifndef USE_AESD_CHAR_DEVICE
+    // Open the segmented persistent log, replays read it up to the committed end offset
+    struct aesdlog_config open_config = log_config;
+    open_config.keep |= upgrade_flag; // Continue the log handed over by the previous instance
+    if (aesdlog_open(&open_config) == -1) {
+        printf("Failed to open persistent log %s.\n", persistent_file);
+        exit(-1);
+    }
+
+    // Start timestamp thread, or the replication thread of a follower which gets the timestamps of its primary
+    thd = malloc(sizeof(slist_data_t));
+    thd->data.connfd = -1; // No socket
+    thd->data.ingestfd = -1;
+    thd->data.ip[0] = '\0';
+    thd->data.completed = false;
+    thd->data.handoff = false;
+    if (follow_port != NULL) {
+        pthread_create(&(thd->data.id), NULL, follow_primary, (void *)&thd->data);
+        printf("Created thread %lu for replication from %s:%s.\n", thd->data.id, follow_host, follow_port); 
+    } else {
+        pthread_create(&(thd->data.id), NULL, log_current_time, (void *)&thd->data);
+        printf("Created thread %lu for time logging.\n", thd->data.id); 
+    }
+    SLIST_INSERT_HEAD(&head, thd, entries);
+    #endif 
+
+    // Datagram producers only append, they get no replay
+    if (udp_port != NULL) {
+        start_ingest_thread(create_dgram_listener(AF_INET, udp_port));
+    }
+    if (unix_dgram_path != NULL) {
+        start_ingest_thread(create_dgram_listener(AF_UNIX, unix_dgram_path));
+    }
+
+    // Metrics endpoint
+    if (metrics_port != NULL) {
+        #ifndef USE_AESD_CHAR_DEVICE
+        bool in_memory = log_config.history_entries || log_config.history_bytes;
+        aesdmetrics_start(metrics_port, in_memory ? NULL : aesdlog_disk_bytes, follow_port != NULL ? follow_lag_bytes : NULL);
+        #else
+        aesdmetrics_start(metrics_port, NULL, NULL); // The driver keeps the bytes in kernel memory, no persistent file
+        #endif
+    }
+
+    // Hand over to a new instance started with --upgrade
+    if (pipe(wake_pipe) == -1) {
+        printf("Failed to create wake pipe.\n"); 
+        exit(-1);
+    }
+    int upgrade_fd = upgrade_listen(upgrade_socket);
+    if (upgrade_fd == -1) {
+        printf("Hot upgrade disabled.\n"); 
+    } else {
+        pthread_t upgrade_thread;
+        pthread_create(&upgrade_thread, NULL, upgrade_wait, (void *)(intptr_t)upgrade_fd);
+        pthread_detach(upgrade_thread);
+    }
+
+    // Resume the connections handed over by the previous instance
+    struct sockaddr_in client = {}; 
+    socklen_t len = -1; 
+    for (size_t i = 0; i < handoff_cnt; ++i) {
+        len = sizeof(client); 
+        getpeername(handoff_fds[i], (struct sockaddr *)&client, &len);
+        start_client_thread(handoff_fds[i], &client.sin_addr);
+    }
+
+    // Accept socket connections forever
+    int connfd = -1;
+    struct pollfd pfds[2] = {
+        { .fd = sockfd, .events = POLLIN },
+        { .fd = wake_pipe[0], .events = POLLIN },
+    };
+    for (;;) {
+        printf("Wait for connection.\n");
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+            printf("Failed to poll listening socket.\n"); 
+            continue;
+        }
+        if (upgrade_requested) {
+            upgrade_handoff(); // Doesn't return
+        }
+        if (!(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        len = sizeof(client); 
+        connfd = accept(sockfd, (struct sockaddr *)&client, &len); 
+        if (connfd < 0) { 
+            printf("Failed to accept a connection.\n"); 
+        } else {
+            AESD_TRACE1(accept, connfd);
+            start_client_thread(connfd, &client.sin_addr);
+            printf("Accepted connection from %s (fd=%d).\n", thd->data.ip, connfd); 
+            syslog(LOG_NOTICE, "Accepted connection from %s (fd=%d).\n", thd->data.ip, connfd); 
+
+            reap_completed_threads();
+        }
+    }
+
+    return 0;
+}
+
+static int create_listener(void) {
+
+    /**
+     * Create, bind and listen on the server socket
+     * @return Return the listening socket, exit on failure
+     */
+
     // Get suiltable sockaddr for bind() and accept using getaddrinfo()
     struct addrinfo hints = {};
     memset(&hints, 0, sizeof (hints));
@@ -60,7 +220,7 @@ int main(int argc, char *argv[]) {
     hints.ai_protocol = IPPROTO_TCP;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
-    if (getaddrinfo(NULL, PORT, &hints, &result) != 0) {
+    if (getaddrinfo(NULL, listen_port, &hints, &result) != 0) {
         printf("Failed to get addrinfo.\n"); 
         exit(-1); 
     }
@@ -91,7 +251,7 @@ int main(int argc, char *argv[]) {
     #ifndef USE_AESD_CHAR_DEVICE
     char desirable_buff_size_str[50] = {};
     int desirable_buff_size = MAX_PACKAGE_LEN_KB*50; // cat /proc/sys/net/core/rmem_max retunrs 212992 and 4096*50 is 204800
-    if ((read_from_file("/proc/sys/net/core/rmem_max", desirable_buff_size_str, 0)) > 0) {
+    if ((read_from_file("/proc/sys/net/core/rmem_max", desirable_buff_size_str, sizeof (desirable_buff_size_str) - 1)) > 0) {
         desirable_buff_size = atoi(desirable_buff_size_str);
     }
     printf("Socket desirable data size is %d.\n", desirable_buff_size); 
@@ -109,15 +269,6 @@ int main(int argc, char *argv[]) {
         printf("Socket successfully binded.\n"); 
     }
 
-    // Fork a new process and exit this parent process
-    if (daemon_flag) {
-        printf("Running in background.\n"); 
-        if ((daemon(0, 0)) == -1) {
-            printf("Failed to enter daemon mode.\n"); 
-            exit(-1);
-        }
-    }
-  
     // Now server is ready to listen and verification 
     if ((listen(sockfd, 5)) != 0) { 
         printf("Failed to listen for entring connection.\n"); 
@@ -125,68 +276,262 @@ int main(int argc, char *argv[]) {
     } else {
         printf("Server listening.\n"); 
     }
-    
-    // Init threads list
-    SLIST_INIT(&head);
 
-    #ifndef USE_AESD_CHAR_DEVICE
-    // Start timestamp thread
+    return sockfd;
+}
+
+static int create_dgram_listener(int family, const char *addr) {
+
+    /**
+     * Create and bind a datagram socket for ingestion
+     * @param family AF_INET to bind the UDP port addr, or AF_UNIX to bind the socket path addr
+     * @return Return the bound socket, exit on failure
+     */
+
+    int fd = -1;
+    int opt_enable = 1;
+    if (family == AF_INET) {
+        struct addrinfo hints = {}, *udp_result = NULL;
+        hints.ai_family = AF_INET;
+        hints.ai_protocol = IPPROTO_UDP;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(NULL, addr, &hints, &udp_result) != 0) {
+            printf("Failed to get addrinfo.\n"); 
+            exit(-1); 
+        }
+        fd = socket(udp_result->ai_family, udp_result->ai_socktype, udp_result->ai_protocol);
+        // An upgrading instance binds the port while this one still serves it
+        if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof (opt_enable)) != 0
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_enable, sizeof (opt_enable)) != 0
+                || bind(fd, udp_result->ai_addr, udp_result->ai_addrlen) != 0) {
+            printf("Failed to bind UDP port %s.\n", addr); 
+            exit(-1); 
+        }
+        freeaddrinfo(udp_result);
+    } else {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr) >= sizeof (sun.sun_path)) {
+            printf("Unix socket path %s is too long.\n", addr); 
+            exit(-1); 
+        }
+        strcpy(sun.sun_path, addr);
+        unlink(addr); // Left by a previous instance, or taken over from the one upgrading
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&sun, sizeof (sun)) != 0) {
+            printf("Failed to bind unix socket %s.\n", addr); 
+            exit(-1); 
+        }
+    }
+
+    // Keep bursts queued while a batch is appended
+    int desirable_buff_size = MAX_PACKAGE_LEN_KB*50;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &desirable_buff_size, sizeof (desirable_buff_size));
+    printf("Datagram socket bound to %s.\n", addr); 
+    return fd;
+}
+
+static void start_ingest_thread(int fd) {
     thd = malloc(sizeof(slist_data_t));
-    thd->data.connfd = -1; // No socket
-    thd->data.ip = NULL;
+    thd->data.connfd = -1; // No client connection to hand over, stopped with thd_exit_requested
+    thd->data.ingestfd = fd;
+    thd->data.ip[0] = '\0';
     thd->data.completed = false;
-    pthread_create(&(thd->data.id), NULL, log_current_time, (void *)&thd->data);
+    thd->data.handoff = false;
+    pthread_create(&(thd->data.id), NULL, dgram_ingest, (void *)&thd->data);
     SLIST_INSERT_HEAD(&head, thd, entries);
-    printf("Created thread %lu for time logging.\n", thd->data.id); 
-    #endif 
+    printf("Created thread %lu for datagram socket %d.\n", thd->data.id, fd); 
+}
 
+static void start_client_thread(int connfd, const struct in_addr *addr) {
+    thd = malloc(sizeof(slist_data_t));
+    thd->data.connfd = connfd;
+    thd->data.ingestfd = -1;
+    inet_ntop(AF_INET, addr, thd->data.ip, sizeof (thd->data.ip)); // Per thread copy, inet_ntoa shares its buffer
+    aesdsched_bucket_init(&thd->data.bucket, thd->data.ip);
+    thd->data.completed = false;
+    thd->data.handoff = false;
+    pthread_create(&(thd->data.id), NULL, msg_exchange, (void *)&thd->data);
+    SLIST_INSERT_HEAD(&head, thd, entries);
+    printf("Created thread %lu for socket connfd %d.\n", thd->data.id, connfd); 
+}
 
-    // Accept socket connections forever
-    struct sockaddr_in client = {}; 
-    socklen_t len = -1; 
+static bool stop_requested(void) {
+    return thd_exit_requested || upgrade_requested;
+}
+
+static void reap_completed_threads(void) {
+    slist_data_t *next = NULL;
+    for (thd = SLIST_FIRST(&head); thd != NULL; thd = next) {
+        next = SLIST_NEXT(thd, entries);
+        //printf("Thread %lu completed flag is %d\n", thd->data.id, thd->data.completed);
+        if (thd->data.completed) {
+            pthread_join(thd->data.id, (void **)&thd->data.retval);
+            if (thd->data.retval != NULL) {
+                printf("Thread %lu complete with retval %d\n", thd->data.id, *(thd->data.retval));
+                free(thd->data.retval);
+            }
+            SLIST_REMOVE(&head, thd, slist_data_s, entries);
+            free(thd);
+        }
+    }
+}
+
+static void* upgrade_wait(void *_args) {
+
+    /**
+     * Wait for a new instance to connect on the upgrade socket and wake the accept loop
+     * @param _args The listening upgrade socket
+     * @return Void
+     */
+
+    int upgrade_fd = (int)(intptr_t)_args;
     int connfd = -1;
-    len = sizeof(client); 
+    while ((connfd = accept(upgrade_fd, NULL, NULL)) == -1 && errno == EINTR);
+    close(upgrade_fd);
+    if (connfd == -1) {
+        printf("Failed to accept upgrade connection.\n"); 
+        return NULL;
+    }
+
+    upgrade_connfd = connfd;
+    upgrade_requested = 1;
+    if (write(wake_pipe[1], "u", 1) != 1) {
+        printf("Failed to wake accept loop.\n"); 
+    }
+    return NULL;
+}
+
+static int upgrade_takeover(int *client_fds, size_t *client_cnt) {
+
+    /**
+     * Receive the listening socket and live connections of the running instance. Returns once
+     * the running instance closed its persistent log, so it can be reopened right away.
+     * @param client_fds Array of MAX_THREADS entries to store the client connections
+     * @param client_cnt Number of client connections stored
+     * @return Return the listening socket, or -1 if an error occure
+     */
+
+    int fds[UPGRADE_MAX_FDS];
+    int listener = -1;
+    enum upgrade_kind kind;
+    int fd = upgrade_connect(upgrade_socket);
+    if (fd == -1) {
+        return -1;
+    }
+
+    *client_cnt = 0;
     for (;;) {
-        printf("Wait for connection.\n");
-        connfd = accept(sockfd, (struct sockaddr *)&client, &len); 
-        if (connfd < 0) { 
-            printf("Failed to accept a connection.\n"); 
-        } else {
-            printf("Accepted connection from %s (fd=%d).\n", inet_ntoa(client.sin_addr), connfd); 
-            syslog(LOG_NOTICE, "Accepted connection from %s (fd=%d).\n", inet_ntoa(client.sin_addr), connfd); 
-
-            thd = malloc(sizeof(slist_data_t));
-            thd->data.connfd = connfd;
-            thd->data.ip = inet_ntoa(client.sin_addr);
-            thd->data.completed = false;
-            pthread_create(&(thd->data.id), NULL, msg_exchange, (void *)&thd->data);
-            SLIST_INSERT_HEAD(&head, thd, entries);
-            printf("Created thread %lu for socket connfd %d.\n", thd->data.id, connfd); 
-            
-            SLIST_FOREACH(thd, &head, entries) {
-                if (thd != NULL) {
-                    //printf("Thread %lu completed flag is %d\n", thd->data.id, thd->data.completed);
-                    if (thd->data.completed) {
-                        pthread_join(thd->data.id, (void **)&thd->data.retval);
-                        if (thd->data.retval != NULL) {
-                            printf("Thread %lu complete with retval %d\n", thd->data.id, *(thd->data.retval));
-                            free(thd->data.retval);
-                        }
-                        SLIST_REMOVE(&head, thd, slist_data_s, entries);
-                        free(thd);
-                    }
-                }
+        int nfds = upgrade_recv(fd, &kind, fds);
+        if (nfds == -1) {
+            break;
+        }
+        for (int i = 0; i < nfds; ++i) {
+            if (kind == UPGRADE_LISTENER && listener == -1) {
+                listener = fds[i];
+            } else if (kind == UPGRADE_CLIENTS && *client_cnt < MAX_THREADS) {
+                client_fds[(*client_cnt)++] = fds[i];
+            } else {
+                close(fds[i]);
             }
         }
+        if (kind == UPGRADE_DONE) {
+            close(fd);
+            return listener;
+        }
     }
 
-    return 0;
+    close(fd);
+    if (listener != -1) {
+        close(listener);
+    }
+    while (*client_cnt > 0) {
+        close(client_fds[--(*client_cnt)]);
+    }
+    return -1;
+}
+
+static void upgrade_handoff(void) {
+
+    /**
+     * Hand the listening socket and live connections over to the new instance, then exit.
+     * Connection threads stop at the next package boundary, so in-flight appends and replays
+     * complete here. Every other appending thread is joined too, and the persistent log is
+     * closed before the new instance reopens it.
+     */
+
+    int fds[MAX_THREADS];
+    size_t nfds = 0;
+    slist_data_t *next = NULL;
+
+    printf("Handing over to new instance.\n"); 
+    syslog(LOG_NOTICE, "Handing over to new instance.");
+
+    for (thd = SLIST_FIRST(&head); thd != NULL; thd = next) {
+        next = SLIST_NEXT(thd, entries);
+        if (thd->data.connfd == -1) {
+            continue; // Timestamp, ingest and follower threads, stopped with thd_exit_requested below
+        }
+        pthread_join(thd->data.id, (void **)&thd->data.retval);
+        if (thd->data.handoff && nfds < MAX_THREADS) {
+            fds[nfds++] = thd->data.connfd;
+        }
+        free(thd->data.retval);
+        SLIST_REMOVE(&head, thd, slist_data_s, entries);
+        free(thd);
+    }
+
+    // The remaining threads append without a client connection, they must be done
+    // with the persistent log before it is closed
+    pthread_mutex_lock(&mutex);
+    thd_exit_requested = 1;
+    pthread_mutex_unlock(&mutex);
+    while (!SLIST_EMPTY(&head)) {
+        thd = SLIST_FIRST(&head);
+        pthread_join(thd->data.id, (void **)&thd->data.retval);
+        free(thd->data.retval);
+        SLIST_REMOVE_HEAD(&head, entries);
+        free(thd);
+    }
+    #ifndef USE_AESD_CHAR_DEVICE
+    aesdlog_close(false);
+    #endif
+
+    upgrade_send(upgrade_connfd, UPGRADE_LISTENER, &sockfd, 1);
+    for (size_t i = 0; i < nfds; i += UPGRADE_MAX_FDS) {
+        upgrade_send(upgrade_connfd, UPGRADE_CLIENTS, fds + i, (nfds - i) < UPGRADE_MAX_FDS ? (nfds - i) : UPGRADE_MAX_FDS);
+    }
+    upgrade_send(upgrade_connfd, UPGRADE_DONE, NULL, 0);
+    close(upgrade_connfd);
+
+    printf("Handed over %zu connection(s), exiting.\n", nfds); 
+    syslog(LOG_NOTICE, "Handed over %zu connection(s), exiting.", nfds);
+    exit(0);
 }
 
 static void print_usage(const char* command_name) {
     printf ("Usage: %s <option>\n", command_name);
     printf ( "Options:\n");
     printf ( "-d : Run in background.\n");
+    printf ( "-u, --upgrade : Take over the sockets of the running instance (zero-downtime restart).\n");
+    printf ( "-m, --metrics-port <port> : Serve Prometheus metrics on 127.0.0.1:<port> (default disabled).\n");
+    printf ( "-U, --udp-port <port> : Append the datagrams received on UDP <port>, without reply (default disabled).\n");
+    printf ( "-X, --unix-dgram <path> : Append the datagrams received on unix socket <path>, without reply (default disabled).\n");
+    printf ( "                          Every datagram is logged as one record, newline terminated if it was not.\n");
+    printf ( "-p, --port <port> : Listen on <port> (default %s).\n", PORT);
+    printf ( "-l, --rate-limit <ip>=<rate>[/<burst>] : Limit the connections from <ip>, or * for any other client,\n");
+    printf ( "                                        to <rate> packages per second with bursts of <burst> (repeatable).\n");
+    #ifndef USE_AESD_CHAR_DEVICE
+    printf ( "-s, --segment-size <bytes> : Roll over to a new log segment after <bytes> (default %d).\n", AESDLOG_DEFAULT_SEGMENT_SIZE);
+    printf ( "-r, --retention-bytes <bytes> : Drop oldest log segments beyond <bytes> (default unlimited).\n");
+    printf ( "-a, --retention-age <secs> : Drop log segments not written for <secs> (default unlimited).\n");
+    printf ( "-k, --keep : Keep the log across restarts instead of deleting it on exit.\n");
+    printf ( "-z, --compress : Store sealed log segments as compressed blocks.\n");
+    printf ( "-f, --file <path> : Persistent log path (default /var/tmp/aesdsocketdata).\n");
+    printf ( "-H, --history-entries <n> : Keep the last <n> records in memory instead of the log files (at most %d).\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    printf ( "-B, --history-bytes <bytes> : Keep the last <bytes> in memory instead of the log files.\n");
+    printf ( "-F, --follow <host>:<port> : Read replica replicating the log of the primary at <host>:<port>.\n");
+    #endif
     printf ( "--help : Print this help.\n");
     exit(0);
 }
@@ -198,12 +543,28 @@ static void parse_cmdline_args(int argc, char *argv[]) {
         // These options set a flag
         {"help",    no_argument,    &help_flag,  1},
         {"daemon",  no_argument,    &daemon_flag, 1},
+        {"upgrade", no_argument,    &upgrade_flag, 1},
+        // These options don't set a flag
+        {"metrics-port",    required_argument,  0,  'm'},
+        {"udp-port",        required_argument,  0,  'U'},
+        {"unix-dgram",      required_argument,  0,  'X'},
+        {"rate-limit",      required_argument,  0,  'l'},
+        {"port",            required_argument,  0,  'p'},
+        {"segment-size",    required_argument,  0,  's'},
+        {"retention-bytes", required_argument,  0,  'r'},
+        {"retention-age",   required_argument,  0,  'a'},
+        {"keep",            no_argument,        0,  'k'},
+        {"compress",        no_argument,        0,  'z'},
+        {"file",            required_argument,  0,  'f'},
+        {"follow",          required_argument,  0,  'F'},
+        {"history-entries", required_argument,  0,  'H'},
+        {"history-bytes",   required_argument,  0,  'B'},
         {0, 0, 0, 0}
     };
 
     int option = -1;
     int option_index = 0;
-    while ((option = getopt_long (argc, argv, "hd", long_options, &option_index)) != -1){
+    while ((option = getopt_long (argc, argv, "hdum:U:X:l:p:s:r:a:kzf:F:H:B:", long_options, &option_index)) != -1){
         switch (option)
         {
         case 'h':
@@ -212,6 +573,69 @@ static void parse_cmdline_args(int argc, char *argv[]) {
         case 'd':
             daemon_flag = 1;
             break;
+        case 'u':
+            upgrade_flag = 1;
+            break;
+        case 'm':
+            metrics_port = optarg;
+            break;
+        case 'U':
+            udp_port = optarg;
+            break;
+        case 'X':
+            unix_dgram_path = optarg;
+            break;
+        case 'l':
+            if (aesdsched_add_limit(optarg) == -1) {
+                printf("Invalid rate limit %s.\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'p':
+            listen_port = optarg;
+            snprintf(upgrade_socket, sizeof (upgrade_socket), "%s.%s", UPGRADE_SOCKET, listen_port);
+            break;
+        #ifndef USE_AESD_CHAR_DEVICE
+        case 's':
+            log_config.segment_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            log_config.retention_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            log_config.retention_secs = strtol(optarg, NULL, 10);
+            break;
+        case 'k':
+            log_config.keep = true;
+            break;
+        case 'z':
+            log_config.compress = true;
+            break;
+        case 'f':
+            snprintf(persistent_file, sizeof (persistent_file), "%s", optarg);
+            break;
+        case 'H':
+            log_config.history_entries = strtoull(optarg, NULL, 10);
+            if (log_config.history_entries > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+                printf("History limited to %d records.\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+                exit(-1);
+            }
+            break;
+        case 'B':
+            log_config.history_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'F': {
+            char *colon = strrchr(optarg, ':');
+            if (colon == NULL || colon == optarg || (size_t)(colon - optarg) >= sizeof (follow_host) || colon[1] == '\0') {
+                printf("Invalid primary address %s.\n", optarg);
+                exit(-1);
+            }
+            memcpy(follow_host, optarg, colon - optarg);
+            follow_host[colon - optarg] = '\0';
+            follow_port = colon + 1;
+            break;
+        }
+        #endif
         default:
             break;
         }
@@ -221,6 +645,13 @@ static void parse_cmdline_args(int argc, char *argv[]) {
         print_usage(argv[0]);
     }
 
+    #ifndef USE_AESD_CHAR_DEVICE
+    if (follow_port != NULL && (udp_port != NULL || unix_dgram_path != NULL)) {
+        printf("A follower doesn't ingest datagrams, append them to its primary.\n");
+        exit(-1);
+    }
+    #endif
+
     // Print any remaining command line arguments (not options)
     if (optind < argc) {
         printf ("Unrecognized option: ");
@@ -230,34 +661,28 @@ static void parse_cmdline_args(int argc, char *argv[]) {
     }
 }
 
-static int write_to_file(const char* user_file, const char* str) {
+#ifdef USE_AESD_CHAR_DEVICE
+static int write_to_file(const char* user_file, const char* buf, size_t len) {
 
     /**
      * Log messge to file
      * @param user_file File to write to 
-     * @param str The message to log
+     * @param buf The message to log
+     * @param len Number of bytes of the message
      * @return Return the number of bytes written, or -1 if an error occure
      */
 
     int fptr = -1;
     int sz = -1;
     
-    // Append to already created file
-    #ifndef USE_AESD_CHAR_DEVICE
-    fptr = open(user_file, O_WRONLY | O_APPEND | O_CREAT, 0600);
-    #else 
     fptr = open(user_file, O_RDWR);
-    #endif
-
     if (fptr == -1) {
         printf("Failed to open %s.\n", user_file);
         return -1;
     }
 
     // Write the buffer to the file
-    // printf("Write to %s.\n", user_file);
-    sz = write(fptr, str, strlen(str));
-    //printf("Wrote '%d' bytes to file '%s'.\n", sz, user_file);
+    sz = write(fptr, buf, len);
     if (sz == -1) {
         printf("Failed to write to file.\n");
         close(fptr);
@@ -273,19 +698,18 @@ static int write_to_file(const char* user_file, const char* str) {
 
     return sz;
 }
-
+#else
 static ssize_t read_from_file(const char* user_file, char* read_buff, size_t buff_len) {
 
     /**
      * Read file content
      * @param user_file Write to read from
-     * @param str The memory to store the file content
+     * @param read_buff The memory to store the file content
+     * @param buff_len Size of read_buff
      * @return  Return the number of bytes read, or -1 if an error occure
      */
 
     size_t sz = 0;
-    
-    #ifndef USE_AESD_CHAR_DEVICE
     FILE *fptr = NULL;
     fptr = fopen(user_file, "r");
     if (fptr == NULL) {
@@ -293,53 +717,630 @@ static ssize_t read_from_file(const char* user_file, char* read_buff, size_t buf
         return -1;
     }
 
-    long int file_sz = -1;
-    fseek(fptr, 0, SEEK_END); // Move file position to the end of the file
-    file_sz = ftell(fptr); // Get the current file position
-    fseek(fptr, 0, SEEK_SET); // Reset file position to start of file
-    sz = fread(read_buff, 1, file_sz, fptr);
+    sz = fread(read_buff, 1, buff_len, fptr);
     if (sz <= 0) {
         printf("Failed read from file %s.\n", user_file);
-        close(fptr);
+        fclose(fptr);
         return -1;
     }
 
-    if ((long int)sz != file_sz) {
-        printf("Warning: read %ld bytes != %ld file size.\n", sz, file_sz);
-    }
-
-    //printf("Read '%ld' bytes from file '%s'.\n", sz, user_file);
-
     if (fclose(fptr) < 0) {
         printf("Failed to close %s.\n", user_file);
         return -1;
     }
-    #else 
-    int fptr = -1;
-    //printf("Read from %s.\n", user_file);
-    fptr = open(user_file, O_RDONLY);
-    if (fptr == -1) {
-        printf("Failed to open %s.\n", user_file);
+
+    return sz;
+}
+#endif
+
+static ssize_t append_to_log(const char* buf, size_t len, enum package_mode mode) {
+
+    /**
+     * Append a package to the persistent file, see append_batch_to_log
+     * @param buf The package to append
+     * @param len Number of bytes of the package
+     * @param mode Index the package as lines, as one record, or as more bytes of the last record
+     * @return Return the number of bytes written, or -1 if an error occure
+     */
+
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return append_batch_to_log(&iov, 1, mode);
+}
+
+static ssize_t append_batch_to_log(const struct iovec *iov, int iovcnt, enum package_mode mode) {
+
+    /**
+     * Append packages to the persistent file. Appends are serialized by the mutex, in the
+     * order they arrived at the append gate, and the log publishes the new end offset once the bytes are written, so replays
+     * never observe a partially written package. The packages of a batch are appended under a single mutex hold.
+     * @param iov The packages to append
+     * @param iovcnt Number of packages
+     * @param mode Index every package as lines, as one record, or as more bytes of the last record
+     * @return Return the number of bytes written, or -1 if an error occure
+     */
+
+    ssize_t sz = 0;
+    size_t len = 0;
+    uint64_t start = aesdmetrics_now();
+
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    AESD_TRACE1(append__start, len);
+    aesdsched_gate_enter(&append_gate); // Appends are admitted in arrival order, one at a time
+    pthread_mutex_lock(&mutex);
+    aesdmetrics_add(AESDMETRICS_MUTEX_WAIT_NS, aesdmetrics_now() - start);
+    for (int i = 0; i < iovcnt && sz != -1; ++i) {
+        ssize_t written = -1;
+        #ifndef USE_AESD_CHAR_DEVICE
+        if (mode == PACKAGE_RECORD) {
+            written = aesdlog_append_record(iov[i].iov_base, iov[i].iov_len);
+        } else if (mode == PACKAGE_CONTINUE) {
+            written = aesdlog_append_continue(iov[i].iov_base, iov[i].iov_len);
+        } else {
+            written = aesdlog_append(iov[i].iov_base, iov[i].iov_len);
+        }
+        if (written == -1) {
+            printf("Failed to write to %s.\n", persistent_file);
+        }
+        #else
+        (void)mode;
+        written = write_to_file(persistent_file, iov[i].iov_base, iov[i].iov_len);
+        #endif
+        sz = written == -1 ? -1 : sz + written;
+    }
+    pthread_cond_broadcast(&appended);
+    pthread_mutex_unlock(&mutex);
+    aesdsched_gate_leave(&append_gate);
+    aesdmetrics_observe(AESDMETRICS_APPEND, aesdmetrics_now() - start);
+    AESD_TRACE2(append__end, len, sz);
+
+    return sz;
+}
+
+static int send_all(int connfd, const char* buf, size_t len) {
+
+    /**
+     * Send the whole buffer on a non blocking socket
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    ssize_t sent = 0;
+    size_t total = 0;
+    while (total < len) {
+        sent = send(connfd, buf + total, len - total, MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                aesdmetrics_add(AESDMETRICS_SEND_EAGAIN, 1);
+                continue;
+            }
+            return -1;
+        }
+        total += sent;
+    }
+    aesdmetrics_add(AESDMETRICS_BYTES_OUT, len);
+    return 0;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+static ssize_t replay_range(int connfd, char* buff, size_t buff_len, uint64_t offset, uint64_t end, uint8_t frame_type) {
+
+    /**
+     * Send the log bytes [offset, end) to the client
+     * @param connfd The socket connection to client
+     * @param buff Scratch buffer used to stream the log content
+     * @param buff_len Size of buff
+     * @param frame_type Send the bytes in binary frames of this type, or raw if 0
+     * @return Return the number of bytes sent, or -1 if an error occure
+     */
+
+    ssize_t sz = 0;
+    ssize_t total = 0;
+    size_t hdr_len = frame_type ? sizeof (struct aesd_frame_header) : 0;
+    char *data = buff + hdr_len;
+    size_t data_len = buff_len - hdr_len;
+
+    while (offset < end) {
+        size_t chunk = (end - offset) < data_len ? (end - offset) : data_len;
+        // Reads are admitted round-robin across connections chunk by chunk, a slow client
+        // only holds its slot while reading from the log and never while sending
+        aesdsched_gate_enter(&replay_gate);
+        sz = aesdlog_read(offset, data, chunk);
+        aesdsched_gate_leave(&replay_gate);
+        if (sz == -1 && errno == ENOENT) {
+            // Segment dropped by retention while replaying, continue from the oldest retained byte
+            offset = aesdlog_start_offset();
+            continue;
+        } else if (sz <= 0) {
+            printf("Failed read from file %s.\n", persistent_file);
+            total = -1;
+            break;
+        }
+        if ((frame_type ? send_frame(connfd, buff, frame_type, sz) : send_all(connfd, data, sz)) == -1) {
+            printf("Failed to send packages to client fd %d.\n", connfd);
+            total = -1;
+            break;
+        }
+        offset += sz;
+        total += sz;
+    }
+
+    return total;
+}
+
+static int send_frame(int connfd, char* frame, uint8_t type, size_t len) {
+
+    /**
+     * Send a binary frame whose payload of len bytes is already stored after the header room of frame
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    struct aesd_frame_header hdr = { .magic = AESD_FRAME_MAGIC, .type = type, .length = htonl(len) };
+    memcpy(frame, &hdr, sizeof (hdr));
+    aesdmetrics_add(AESDMETRICS_PACKETS_OUT, 1);
+    return send_all(connfd, frame, sizeof (hdr) + len);
+}
+
+static int recv_all(int connfd, char* buf, size_t len) {
+
+    /**
+     * Receive exactly len bytes on a non blocking socket. Exit and upgrade requests are
+     * only honored before the first byte, so a frame is never cut in the middle.
+     * @return Return 0 on success, 1 if the connection was closed or an exit/upgrade was
+     *      requested, or -1 if an error occure
+     */
+
+    size_t total = 0;
+    while (total < len) {
+        if (thd_exit_requested || (total == 0 && upgrade_requested)) {
+            return 1;
+        }
+        ssize_t sz = recv(connfd, buf + total, len - total, MSG_DONTWAIT);
+        if (sz == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            return -1;
+        } else if (sz == 0) {
+            return 1;
+        }
+        aesdmetrics_add(AESDMETRICS_BYTES_IN, sz);
+        AESD_TRACE2(recv, connfd, sz);
+        total += sz;
+    }
+    return 0;
+}
+
+static int frame_exchange(struct thread_data *args) {
+
+    /**
+     * Serve a connection which negotiated the binary framing (see aesdframe.h)
+     * @param args The client thread data
+     * @return Return 0 if the connection ended normally, or 1 if an error occure
+     */
+
+    int connfd = args->connfd;
+    size_t frame_len = sizeof (struct aesd_frame_header) + AESD_FRAME_MAX_PAYLOAD;
+    char *frame = aesdpool_get(&frame_pool);
+    char *payload = frame + sizeof (struct aesd_frame_header);
+    struct aesd_frame_header hdr = {};
+    uint64_t u64 = 0;
+    uint32_t u32 = 0;
+    int rc = 0;
+
+    if (frame == NULL) {
+        printf("Failed to allocate frame buffer for client fd %d.\n", connfd); 
+        return 1;
+    }
+
+    printf("Binary framing negotiated with client fd %d.\n", connfd); 
+    while (rc == 0) {
+        rc = recv_all(connfd, (char *)&hdr, sizeof (hdr));
+        if (rc == 1 && upgrade_requested && !thd_exit_requested) {
+            args->handoff = true; // Leave the connection open for the new instance
+        }
+        if (rc != 0) {
+            break;
+        }
+        size_t len = ntohl(hdr.length);
+        if (hdr.magic != AESD_FRAME_MAGIC || len > AESD_FRAME_MAX_PAYLOAD) {
+            printf("Failed to parse frame from client fd %d.\n", connfd); 
+            rc = -1;
+            break;
+        }
+        if (len > 0 && (rc = recv_all(connfd, payload, len)) != 0) {
+            break;
+        }
+        aesdmetrics_add(AESDMETRICS_PACKETS_IN, 1);
+        aesdmetrics_add(AESDMETRICS_RATE_LIMIT_NS, aesdsched_bucket_take(&args->bucket, stop_requested));
+        uint64_t start_ns = aesdmetrics_now();
+        if (hdr.type == AESD_FRAME_REPLAY || hdr.type == AESD_FRAME_TAIL) {
+            AESD_TRACE1(replay__start, connfd);
+        }
+
+        if (hdr.type == AESD_FRAME_APPEND && follow_port != NULL) {
+            printf("Read replica: append from client fd %d rejected.\n", connfd); 
+            rc = send_frame(connfd, frame, AESD_FRAME_ERROR, 0);
+        } else if (hdr.type == AESD_FRAME_APPEND) {
+            if (append_to_log(payload, len, PACKAGE_RECORD) == -1) {
+                rc = -1;
+                break;
+            }
+            u64 = htobe64(aesdlog_end_offset());
+            memcpy(payload, &u64, sizeof (u64));
+            rc = send_frame(connfd, frame, AESD_FRAME_ACK, sizeof (u64));
+        } else if (hdr.type == AESD_FRAME_REPLAY && len == sizeof (u64)) {
+            memcpy(&u64, payload, sizeof (u64));
+            uint64_t offset = be64toh(u64), end = aesdlog_end_offset();
+            if (offset < aesdlog_start_offset()) {
+                offset = aesdlog_start_offset();
+            }
+            if (offset < end && replay_range(connfd, frame, frame_len, offset, end, AESD_FRAME_DATA) == -1) {
+                rc = -1;
+                break;
+            }
+            u64 = htobe64(offset > end ? offset : end);
+            memcpy(payload, &u64, sizeof (u64));
+            rc = send_frame(connfd, frame, AESD_FRAME_END, sizeof (u64));
+            aesdmetrics_observe(AESDMETRICS_REPLAY, aesdmetrics_now() - start_ns);
+            AESD_TRACE2(replay__end, connfd, rc);
+        } else if (hdr.type == AESD_FRAME_TAIL && len == sizeof (u32)) {
+            memcpy(&u32, payload, sizeof (u32));
+            uint64_t count = ntohl(u32), records_end = aesdlog_end_record(), start = 0, end = aesdlog_end_offset();
+            uint64_t record = count < records_end ? records_end - count : 0;
+            for (; rc == 0 && record < records_end; ++record) {
+                if (aesdlog_record_range(record, 1, &start, &end) == -1 || end - start > AESD_FRAME_MAX_PAYLOAD) {
+                    rc = -1;
+                } else if (start < end) {
+                    rc = replay_range(connfd, frame, frame_len, start, end, AESD_FRAME_RECORD) == -1 ? -1 : 0;
+                }
+            }
+            u64 = htobe64(end);
+            memcpy(payload, &u64, sizeof (u64));
+            rc = rc ? rc : send_frame(connfd, frame, AESD_FRAME_END, sizeof (u64));
+            aesdmetrics_observe(AESDMETRICS_REPLAY, aesdmetrics_now() - start_ns);
+            AESD_TRACE2(replay__end, connfd, rc);
+        } else if (hdr.type == AESD_FRAME_FOLLOW && len == sizeof (u64)) {
+            memcpy(&u64, payload, sizeof (u64));
+            rc = follow_stream(connfd, frame, frame_len, be64toh(u64));
+        } else {
+            printf("Unsupported frame type 0x%02x from client fd %d.\n", hdr.type, connfd); 
+            rc = send_frame(connfd, frame, AESD_FRAME_ERROR, 0);
+        }
+    }
+
+    if (rc == 1 && !args->handoff) {
+        printf("Closed connection from %s (fd=%d).\n", args->ip, connfd); 
+        syslog(LOG_NOTICE, "Closed connection from %s (fd=%d).\n", args->ip, connfd); 
+    }
+    aesdpool_put(&frame_pool, frame);
+    return rc == -1 ? 1 : 0;
+}
+
+static int replay_records(int connfd, char* buff, size_t len, size_t buff_len) {
+
+    /**
+     * Serve a record query received in buff instead of appending it to the log
+     *   AESDSOCKET_RECORDS:<first>,<count> sends records [first, first+count)
+     *   AESDSOCKET_TAIL:<count> sends the last count records
+     * @param len Bytes received in buff, buff_len must leave room to terminate them
+     * @return Return 1 if buff held a record query, 0 if not, or -1 if an error occure
+     */
+
+    unsigned long long first = 0, count = 0;
+    uint64_t start = 0, end = 0;
+    static const char query_prefix[] = "AESDSOCKET_";
+
+    if (len < sizeof (query_prefix) - 1 || memcmp(buff, query_prefix, sizeof (query_prefix) - 1) != 0) {
+        return 0;
+    }
+    buff[len] = '\0'; // sscanf needs a string, the rest of buff is stale
+    if (sscanf(buff, "AESDSOCKET_RECORDS:%llu,%llu", &first, &count) == 2) {
+        // Records query
+    } else if (sscanf(buff, "AESDSOCKET_TAIL:%llu", &count) == 1) {
+        uint64_t records_end = aesdlog_end_record();
+        first = count < records_end ? records_end - count : 0;
+    } else {
+        return 0;
+    }
+
+    AESD_TRACE1(replay__start, connfd);
+    if (aesdlog_record_range(first, count, &start, &end) == -1) {
+        printf("Failed to resolve records %llu+%llu.\n", first, count);
         return -1;
     }
-    size_t read_offset = 0;
-    while ((read_offset = read(fptr, read_buff + sz*(sizeof(char)), MAX_PACKAGE_LEN))) {
-        if (read_offset == -1) {
-            printf("Failed read from file %s.\n", user_file);
-            close(fptr);
+    ssize_t sz = replay_range(connfd, buff, buff_len, start, end, 0);
+    AESD_TRACE2(replay__end, connfd, sz);
+    return sz == -1 ? -1 : 1;
+}
+
+static int follow_stream(int connfd, char* frame, size_t frame_len, uint64_t offset) {
+
+    /**
+     * Stream the log to a follower from offset. Every pass sends an AESD_FRAME_SYNC with the range
+     * replayed and the record holding its first byte, then the records (see stream_records), and
+     * waits for the next append. The stream is not handed over on upgrade, the follower reconnects
+     * to the new instance.
+     * @param frame Frame buffer of frame_len bytes
+     * @return Return 0 when the client sent another request, 1 if the stream ended on exit or
+     *      upgrade requests, or -1 if an error occure
+     */
+
+    char *payload = frame + sizeof (struct aesd_frame_header);
+    uint64_t sync[3];
+    struct pollfd pfd = { .fd = connfd, .events = POLLIN };
+    struct timespec deadline;
+
+    printf("Streaming log to follower fd %d from offset %llu.\n", connfd, (unsigned long long)offset); 
+    for (;;) {
+        uint64_t end = aesdlog_end_offset();
+        if (offset < aesdlog_start_offset() || offset > end) {
+            // Dropped by retention, or the log was recreated since the follower last synced
+            offset = aesdlog_start_offset();
+        }
+        if (offset < end) {
+            // Newest record starting at or before offset, records only end where the next one starts
+            uint64_t lo = aesdlog_start_record(), hi = aesdlog_end_record(), start = 0, record_end = 0;
+            while (hi - lo > 1) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if (aesdlog_record_range(mid, 1, &start, &record_end) == -1) {
+                    return -1;
+                }
+                if (start <= offset) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            sync[0] = htobe64(offset);
+            sync[1] = htobe64(end);
+            sync[2] = htobe64(lo);
+            memcpy(payload, sync, sizeof (sync));
+            if (send_frame(connfd, frame, AESD_FRAME_SYNC, sizeof (sync)) == -1
+                    || stream_records(connfd, frame, frame_len, offset, end, lo) == -1) {
+                printf("Failed to stream log to follower fd %d.\n", connfd); 
+                return -1;
+            }
+            offset = end;
+        }
+
+        // Wait for the next append, waking up regularly to check the connection and exit requests
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000; // 100 ms
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&mutex);
+        while (aesdlog_end_offset() == offset && !thd_exit_requested && !upgrade_requested
+                && pthread_cond_timedwait(&appended, &mutex, &deadline) == 0);
+        pthread_mutex_unlock(&mutex);
+        if (thd_exit_requested || upgrade_requested) {
+            return 1;
+        }
+        if (poll(&pfd, 1, 0) == 1) {
+            return 0; // Another request or the connection closed, left to the frame loop
+        }
+    }
+}
+
+static int stream_records(int connfd, char* frame, size_t frame_len, uint64_t offset, uint64_t end, uint64_t record) {
+
+    /**
+     * Send the log bytes [offset, end) announced by an AESD_FRAME_SYNC, record by record so that the follower indexes the same records. A record starting in
+     * the range begins with an AESD_FRAME_RECORD, the rest of a record longer than a frame and
+     * the bytes of a record which started before offset follow in AESD_FRAME_DATA frames.
+     * @param record The record holding the byte at offset
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    uint64_t start = 0, record_end = 0;
+    size_t data_len = frame_len - sizeof (struct aesd_frame_header);
+
+    for (; offset < end; ++record) {
+        if (aesdlog_record_range(record, 1, &start, &record_end) == -1 || start > offset || record_end <= offset) {
+            printf("Failed to resolve record %llu at offset %llu.\n", (unsigned long long)record, (unsigned long long)offset); 
+            return -1; // Dropped by retention meanwhile, the follower resyncs when reconnecting
+        }
+        if (record_end > end) {
+            record_end = end; // Grown since the sync, the bytes after end go with the next pass
+        }
+        if (start == offset) {
+            uint64_t first_end = record_end - start < data_len ? record_end : start + data_len;
+            if (replay_range(connfd, frame, frame_len, start, first_end, AESD_FRAME_RECORD) == -1) {
+                return -1;
+            }
+            offset = first_end;
+        }
+        if (offset < record_end && replay_range(connfd, frame, frame_len, offset, record_end, AESD_FRAME_DATA) == -1) {
             return -1;
         }
-        sz += read_offset;
+        offset = record_end;
     }
-    printf("Read %s", read_buff);
+    return 0;
+}
 
-    if (close(fptr) < 0) {
-        printf("Failed to close %s.\n", user_file);
+static int reset_log(uint64_t offset, uint64_t record) {
+
+    /**
+     * Drop the local log and continue it empty from the primary offset and record, so that
+     * a follower keeps the offsets and record numbers of its primary
+     * @return Return 0 on success, or -1 if an error occure
+     */
+
+    aesdsched_gate_enter(&append_gate);
+    pthread_mutex_lock(&mutex);
+    int rc = aesdlog_reset(offset, record);
+    if (rc == -1) {
+        printf("Failed to reset %s.\n", persistent_file);
+    }
+    pthread_cond_broadcast(&appended);
+    pthread_mutex_unlock(&mutex);
+    aesdsched_gate_leave(&append_gate);
+    return rc;
+}
+
+static int connect_primary(void) {
+
+    /**
+     * Connect to the primary given with --follow
+     * @return Return the connected socket, or -1 if an error occure
+     */
+
+    struct addrinfo hints = {}, *addrs = NULL;
+    int fd = -1;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follow_host, follow_port, &hints, &addrs) != 0) {
+        printf("Failed to resolve primary %s:%s.\n", follow_host, follow_port); 
         return -1;
     }
-    #endif
+    for (struct addrinfo *ai = addrs; ai != NULL && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
 
-    return sz;
+static void* follow_primary(void *_args) {
+
+    /**
+     * Replicate the log of the primary into the local log, record by record and from the local
+     * end offset, and reconnect whenever the stream ends. The local log keeps the offsets and
+     * record numbers of the primary, and is reset when the primary streams from another offset
+     * than the local end, after it dropped or recreated its log. Replays are served from the local copy.
+     * @param _args The thread data
+     * @return Void pointer holding the return value
+     */
+
+    struct thread_data *args = (struct thread_data *)_args;
+    int *retval = (int *)malloc(sizeof (int));
+    *retval = 0;
+
+    char *frame = aesdpool_get(&frame_pool);
+    char *payload = frame + sizeof (struct aesd_frame_header);
+    struct aesd_frame_header hdr = {};
+    uint64_t u64[3];
+
+    if (frame == NULL) {
+        printf("Failed to allocate frame buffer to follow %s:%s.\n", follow_host, follow_port); 
+        *retval = 1;
+    }
+    while (frame != NULL && !thd_exit_requested && !upgrade_requested) {
+        int fd = connect_primary();
+        if (fd == -1) {
+            sleep(1); // Primary not up yet or restarting
+            continue;
+        }
+        uint64_t offset = aesdlog_end_offset();
+        printf("Following primary %s:%s from offset %llu.\n", follow_host, follow_port, (unsigned long long)offset); 
+        syslog(LOG_NOTICE, "Following primary %s:%s from offset %llu.", follow_host, follow_port, (unsigned long long)offset);
+
+        u64[0] = htobe64(offset);
+        memcpy(payload, u64, sizeof (u64[0]));
+        int rc = send_frame(fd, frame, AESD_FRAME_FOLLOW, sizeof (u64[0]));
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        while (rc == 0) {
+            if (poll(&pfd, 1, 1000) == 0) {
+                continue; // Idle primary
+            }
+            rc = recv_all(fd, (char *)&hdr, sizeof (hdr));
+            size_t len = ntohl(hdr.length);
+            if (rc == 0 && (hdr.magic != AESD_FRAME_MAGIC || len > AESD_FRAME_MAX_PAYLOAD)) {
+                printf("Failed to parse frame from primary.\n"); 
+                rc = -1;
+            }
+            if (rc != 0 || (len > 0 && (rc = recv_all(fd, payload, len)) != 0)) {
+                break;
+            }
+
+            if (hdr.type == AESD_FRAME_SYNC && len == sizeof (u64)) {
+                memcpy(u64, payload, sizeof (u64));
+                offset = be64toh(u64[0]);
+                if (offset != aesdlog_end_offset()) {
+                    // The primary dropped or recreated its log, the local bytes no longer match it
+                    printf("Primary streams from offset %llu, local log ends at %llu.\n",
+                        (unsigned long long)offset, (unsigned long long)aesdlog_end_offset()); 
+                    if (reset_log(offset, be64toh(u64[2])) == -1) {
+                        rc = -1;
+                        break;
+                    }
+                }
+                follow_primary_end = be64toh(u64[1]);
+                printf("Follower lag %llu bytes.\n", (unsigned long long)follow_lag_bytes()); 
+            } else if (hdr.type == AESD_FRAME_RECORD || hdr.type == AESD_FRAME_DATA) {
+                if (append_to_log(payload, len, hdr.type == AESD_FRAME_RECORD ? PACKAGE_RECORD : PACKAGE_CONTINUE) == -1) {
+                    rc = -1;
+                    break;
+                }
+            } else {
+                printf("Unexpected frame type 0x%02x from primary.\n", hdr.type); 
+                rc = -1;
+            }
+        }
+        close(fd);
+        if (!thd_exit_requested && !upgrade_requested) {
+            printf("Lost primary %s:%s, reconnecting.\n", follow_host, follow_port); 
+            sleep(1);
+        }
+    }
+
+    aesdpool_put(&frame_pool, frame);
+    args->completed = true;
+    return retval;
+}
+
+static uint64_t follow_lag_bytes(void) {
+    uint64_t end = follow_primary_end, offset = aesdlog_end_offset();
+    return end > offset ? end - offset : 0;
+}
+#endif
+
+static ssize_t replay_to_client(int connfd, char* buff, size_t buff_len) {
+
+    /**
+     * Send the full history of the persistent file to the client without holding
+     * the append mutex. In file mode the history is bounded by the end offset of the log
+     * observed on entry, so concurrent replays and appends don't wait for each other.
+     * @param connfd The socket connection to client
+     * @param buff Scratch buffer used to stream the file content
+     * @param buff_len Size of buff
+     * @return Return the number of bytes sent, or -1 if an error occure
+     */
+
+    #ifndef USE_AESD_CHAR_DEVICE
+    return replay_range(connfd, buff, buff_len, aesdlog_start_offset(), aesdlog_end_offset(), 0);
+    #else
+    ssize_t sz = 0;
+    ssize_t total = 0;
+    int fptr = open(persistent_file, O_RDONLY);
+    if (fptr == -1) {
+        printf("Failed to open %s.\n", persistent_file);
+        return -1;
+    }
+    while (true) {
+        aesdsched_gate_enter(&replay_gate); // Reads are admitted round-robin across connections, sends are not gated
+        sz = read(fptr, buff, buff_len);
+        aesdsched_gate_leave(&replay_gate);
+        if (sz == 0) {
+            break;
+        } else if (sz == -1) {
+            printf("Failed read from file %s.\n", persistent_file);
+            total = -1;
+            break;
+        }
+        if (send_all(connfd, buff, sz) == -1) {
+            printf("Failed to send packages to client fd %d.\n", connfd);
+            total = -1;
+            break;
+        }
+        total += sz;
+    }
+    close(fptr);
+    return total;
+    #endif
 }
 
 static void* msg_exchange(void *_args) { 
@@ -352,18 +1353,44 @@ static void* msg_exchange(void *_args) {
     
     struct thread_data *args = (struct thread_data *)_args;
     int connfd = args->connfd;
-    char* clientip = args->ip;
+    const char* clientip = args->ip;
     int *retval = (int *)malloc(sizeof (int));
     *retval = 0;
 
-    char *buff = (char*)malloc(MAX_PACKAGE_LEN_KB); // Allocate buffer for new thread
+    char *buff = aesdpool_get(&msg_pool); // MAX_PACKAGE_LEN_KB bytes and a spare one, not cleared
     ssize_t read_buff_total_len = 0;
-    ssize_t send_buff_current_len = 0;
-    ssize_t send_buff_total_len = 0;
+    uint64_t replay_start = 0;
+    aesdmetrics_add(AESDMETRICS_CONN_OPENED, 1);
+    #ifndef USE_AESD_CHAR_DEVICE
+    bool negotiated = false; // Text or binary framing chosen from the first byte received
+    #endif
+
+    if (buff == NULL) {
+        printf("Failed to allocate buffer for client fd %d.\n", connfd); 
+        *retval = 1;
+    }
+    while (buff != NULL && !thd_exit_requested) {
+        if (upgrade_requested) {
+            args->handoff = true; // Leave the connection open for the new instance
+            break; // goto thread_exit
+        }
+
+        #ifndef USE_AESD_CHAR_DEVICE
+        if (!negotiated) {
+            unsigned char first_byte = 0;
+            read_buff_total_len = recv(connfd, &first_byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (read_buff_total_len == -1 && errno == EAGAIN) {
+                continue;
+            }
+            negotiated = true;
+            if (read_buff_total_len == 1 && first_byte == AESD_FRAME_MAGIC) {
+                *retval = frame_exchange(args);
+                break; // goto thread_exit
+            }
+        }
+        #endif
 
-    while (!thd_exit_requested) {
         // Read the message from client non blocking and copy it in buffer 
-        memset(buff, '\0', MAX_PACKAGE_LEN_KB);
         read_buff_total_len = recv(connfd, buff, MAX_PACKAGE_LEN_KB, MSG_DONTWAIT /*none blocking io*/); 
         if (read_buff_total_len == -1 && errno == EAGAIN) {
             //printf("Waiting for incoming data from client fd %d.\n", connfd); 
@@ -378,38 +1405,52 @@ static void* msg_exchange(void *_args) {
             break; // goto thread_exit
         } else {
             if (read_buff_total_len > 0) {
+                aesdmetrics_add(AESDMETRICS_BYTES_IN, read_buff_total_len);
+                AESD_TRACE2(recv, connfd, read_buff_total_len);
                 // Check package termination (newline)
                 if (buff[read_buff_total_len-1] == '\n') {
-                    printf("Received package from client fd %d: %s", connfd, buff); 
+                    printf("Received package from client fd %d: %.*s", connfd, (int)read_buff_total_len, buff); 
+                    aesdmetrics_add(AESDMETRICS_PACKETS_IN, 1);
+                    aesdmetrics_add(AESDMETRICS_RATE_LIMIT_NS, aesdsched_bucket_take(&args->bucket, stop_requested));
+                    replay_start = aesdmetrics_now();
 
-                    // Write package to persistance file
-                    pthread_mutex_lock(&mutex);
-                    if (write_to_file(persistent_file, buff) == -1) {
+                    #ifndef USE_AESD_CHAR_DEVICE
+                    // Record queries are answered from the index and not logged
+                    int query_rc = replay_records(connfd, buff, read_buff_total_len, MAX_PACKAGE_LEN_KB + 1);
+                    if (query_rc == -1) {
+                        *retval = 1;
+                        break; // goto thread_exit
+                    } else if (query_rc == 1) {
+                        aesdmetrics_add(AESDMETRICS_PACKETS_OUT, 1);
+                        aesdmetrics_observe(AESDMETRICS_REPLAY, aesdmetrics_now() - replay_start);
+                        continue;
+                    }
+                    #endif
+
+                    // Write package to persistance file, a follower only replicates its primary
+                    #ifndef USE_AESD_CHAR_DEVICE
+                    if (follow_port != NULL) {
+                        printf("Read replica: package from client fd %d not appended.\n", connfd); 
+                    } else
+                    #endif
+                    if (append_to_log(buff, read_buff_total_len, PACKAGE_LINES) == -1) {
                         printf("Failed to log message to persistant file.\n");
                         *retval = 1;
                         break; // goto thread_exit
-                    } else {
-                        // Send all packages to the client
-                        memset(buff, '\0', MAX_PACKAGE_LEN_KB);
-                        read_buff_total_len = read_from_file(persistent_file, buff, read_buff_total_len);
-
-                        if (read_buff_total_len != -1) {
-                            while(send_buff_total_len < read_buff_total_len) { 
-                                //printf("Sending all packages to client fd %d.\n", connfd);
-                                send_buff_current_len = send(connfd, buff, read_buff_total_len, MSG_DONTWAIT);
-                                if (send_buff_current_len == -1 && errno == EAGAIN) {
-                                    continue;
-                                }
-                                send_buff_total_len += send_buff_current_len; 
-                            }
-                            //printf("%ld bytes sent.\n", send_buff_total_len); 
-                        } else {
-                            printf("Failed to read all packages from persistant file.\n");
-                            *retval = 1;
-                            break; // goto thread_exit
-                        }
                     }
-                    pthread_mutex_unlock(&mutex);
+
+                    // Send all packages to the client
+                    replay_start = aesdmetrics_now();
+                    AESD_TRACE1(replay__start, connfd);
+                    ssize_t replayed = replay_to_client(connfd, buff, MAX_PACKAGE_LEN_KB);
+                    AESD_TRACE2(replay__end, connfd, replayed);
+                    if (replayed == -1) {
+                        printf("Failed to send all packages from persistant file.\n");
+                        *retval = 1;
+                        break; // goto thread_exit
+                    }
+                    aesdmetrics_add(AESDMETRICS_PACKETS_OUT, 1);
+                    aesdmetrics_observe(AESDMETRICS_REPLAY, aesdmetrics_now() - replay_start);
                 } else {
                     printf("Failed to parse package: Missing package termination \\n from client fd %d.\n", connfd); 
                 }
@@ -418,11 +1459,15 @@ static void* msg_exchange(void *_args) {
     }
 
     args->completed = true;
+    aesdmetrics_add(AESDMETRICS_CONN_CLOSED, 1);
+    AESD_TRACE1(close, connfd);
 
-    free(buff);
+    aesdpool_put(&msg_pool, buff);
 
-    shutdown(connfd, SHUT_RDWR);
-    close(connfd);
+    if (!args->handoff) {
+        shutdown(connfd, SHUT_RDWR);
+        close(connfd);
+    }
 
     pthread_mutex_lock(&mutex);
     if (thd_exit_requested) *retval = 2; // Parent caught signal exit
@@ -432,6 +1477,90 @@ static void* msg_exchange(void *_args) {
     pthread_exit((void*)retval);
 } 
 
+static void* dgram_ingest(void *_args) {
+    /**
+     * Append the datagrams received on a socket, without reply. Every recvmmsg pulls up
+     * to DGRAM_BATCH datagrams, which are appended under a single mutex hold.
+     * A datagram is a record of its own even if it holds newlines, a missing newline termination is added.
+     * @param _args The thread data holding the datagram socket
+     * @return Void pointer holding the return value
+     */
+
+    struct thread_data *args = (struct thread_data *)_args;
+    int fd = args->ingestfd;
+    int *retval = (int *)malloc(sizeof (int));
+    *retval = 0;
+
+    // One slot per datagram, plus a byte for the newline termination
+    size_t slot_len = MAX_PACKAGE_LEN_KB + 1;
+    char *slots = malloc(DGRAM_BATCH * slot_len);
+    struct mmsghdr msgs[DGRAM_BATCH];
+    struct iovec iovs[DGRAM_BATCH];
+    for (int i = 0; slots != NULL && i < DGRAM_BATCH; ++i) {
+        iovs[i].iov_base = slots + i * slot_len;
+        iovs[i].iov_len = MAX_PACKAGE_LEN_KB;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    if (slots == NULL) {
+        printf("Failed to allocate datagram buffers for socket %d.\n", fd); 
+        syslog(LOG_ERR, "Failed to allocate datagram buffers for socket %d.", fd);
+        *retval = 1;
+    }
+    while (slots != NULL && !thd_exit_requested) {
+        // Wake up every second to notice exit requests
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < DGRAM_BATCH; ++i) {
+            memset(&msgs[i].msg_hdr, 0, sizeof (msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(fd, msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            continue;
+        }
+        AESD_TRACE2(recv, fd, n);
+
+        // Every datagram is appended as a record of its own, newlines inside it included
+        struct iovec packages[DGRAM_BATCH];
+        int packages_cnt = 0;
+        for (int i = 0; i < n; ++i) {
+            size_t len = msgs[i].msg_len;
+            char *datagram = iovs[i].iov_base;
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                printf("Failed with datagram length exeeding %d bytes: Discarded (socket %d).\n", (int)MAX_PACKAGE_LEN_KB, fd); 
+                continue;
+            }
+            if (len == 0) {
+                continue;
+            }
+            aesdmetrics_add(AESDMETRICS_BYTES_IN, len);
+            if (datagram[len - 1] != '\n') {
+                datagram[len++] = '\n'; // Spare byte of the slot
+            }
+            packages[packages_cnt++] = (struct iovec){ .iov_base = datagram, .iov_len = len };
+        }
+        aesdmetrics_add(AESDMETRICS_PACKETS_IN, packages_cnt);
+        if (packages_cnt > 0 && append_batch_to_log(packages, packages_cnt, PACKAGE_RECORD) == -1) {
+            printf("Failed to log datagrams to persistant file.\n");
+            *retval = 1;
+            break; // goto thread_exit
+        }
+    }
+
+    args->completed = true;
+    free(slots);
+    close(fd);
+
+    pthread_mutex_lock(&mutex);
+    if (thd_exit_requested) *retval = 2; // Parent caught signal exit
+    pthread_mutex_unlock(&mutex);
+
+    pthread_exit((void*)retval);
+}
+
 #ifndef USE_AESD_CHAR_DEVICE
 void * log_current_time(void *_args) {
     /**
@@ -444,12 +1573,14 @@ void * log_current_time(void *_args) {
     struct tm *tmp;
     char timestamp[50];
     time_t rawtime;
-    struct timespec tspec = { .tv_sec=10, .tv_nsec=0 }; // Sleep for 10 secs
+    struct timespec tspec = { .tv_sec=1, .tv_nsec=0 }; // Wake up every second to notice exit requests
+    int ticks = 0; // Log every 10 secs
     int *retval = (int *)malloc(sizeof (int));
     *retval = 0;
 
     while (!thd_exit_requested) {
-        if ((clock_nanosleep(CLOCK_MONOTONIC, 0, &tspec, NULL)) == 0) {
+        if ((clock_nanosleep(CLOCK_MONOTONIC, 0, &tspec, NULL)) == 0 && ++ticks == 10 && !thd_exit_requested) {
+            ticks = 0;
             rawtime = time(NULL);
             tmp = localtime(&rawtime);
             if (tmp == NULL) {
@@ -459,13 +1590,11 @@ void * log_current_time(void *_args) {
             }
             if ((strftime(timestamp, sizeof (timestamp), "timestamp:%Y-%m-%d %H:%M:%S\n", tmp) != 0)) {
                 //printf("Logging timestamp: %s", timestamp); 
-                pthread_mutex_lock(&mutex);
-                if (write_to_file(persistent_file, timestamp) == -1) {
+                if (append_to_log(timestamp, strlen(timestamp), PACKAGE_LINES) == -1) {
                     printf("Failed to log timestamp into persistant file.\n");
                     *retval = 1;
                     break; // goto thread_exit
-                } 
-                pthread_mutex_unlock(&mutex);
+                }
             } else {
                 // 0 Bbytes written
                 printf("Failed to get timestamp into buffer.\n"); 
@@ -484,4 +1613,4 @@ void * log_current_time(void *_args) {
 
     pthread_exit((void*)retval);
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,8 @@
 #ifndef AESD_SOCKET
 #define AESD_SOCKET
 
+#define _GNU_SOURCE // recvmmsg
+
 #include <stdio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
@@ -23,31 +25,80 @@
 #include <netinet/tcp.h>
 #include <stdbool.h>
 #include <sys/queue.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <aesdlog.h>
+#include <aesdupgrade.h>
+#include <aesdframe.h>
+#include <aesdmetrics.h>
+#include <aesdtrace.h>
+#include <aesdpool.h>
+#include <aesdsched.h>
+#include <aesd-circular-buffer.h>
+#include <endian.h>
 
 
 #define MAX_PACKAGE_LEN 1024
 #define MAX_PACKAGE_LEN_KB 4*MAX_PACKAGE_LEN  // 4 Kbytes maximal length of byte received on socket
 #define PORT "9000" // Socket port to bind to
 #define MAX_THREADS 100 // Maximal allowed threads
+#define DGRAM_BATCH 64 // Datagrams received per recvmmsg and appended under one mutex hold
+
+// How append_to_log indexes a package in the log
+enum package_mode {
+    PACKAGE_LINES, // One record per newline terminated line
+    PACKAGE_RECORD, // The package is one record
+    PACKAGE_CONTINUE, // The package continues the last record, as replicated by a follower
+};
 
 static struct addrinfo *result = NULL; // Socket address info
 static int sockfd = -1; // Server socket to listen for connection
 #ifndef USE_AESD_CHAR_DEVICE
-static char persistent_file[] = "/var/tmp/aesdsocketdata"; // Persistent file
+static char persistent_file[PATH_MAX] = "/var/tmp/aesdsocketdata"; // Persistent file, see --file
 #else
 static char persistent_file[] = "/dev/aesdchar"; // Persistent file
 #endif
+static char *listen_port = PORT; // Socket port to bind to, see --port
+static char upgrade_socket[sizeof (((struct sockaddr_un *)0)->sun_path)] = UPGRADE_SOCKET; // One per listen port
 static int daemon_flag = 0; // Don't run in daemon mode (default)
 static int help_flag = 0; // Enable commandline help output
+static int upgrade_flag = 0; // Take over the sockets of the running instance instead of binding
+static volatile int upgrade_requested = 0; // A new instance asked this one to hand over its sockets
+static int upgrade_connfd = -1; // Unix socket connection to the new instance
+static int wake_pipe[2] = {-1, -1}; // Wake the accept loop when an upgrade is requested
+static char *metrics_port = NULL; // Serve Prometheus metrics on this localhost port (disabled by default)
+static char *udp_port = NULL; // Append the datagrams received on this UDP port (disabled by default)
+static char *unix_dgram_path = NULL; // Append the datagrams received on this AF_UNIX socket (disabled by default)
+static struct aesdpool msg_pool; // Receive buffers of text connections, one spare byte to terminate queries
+#ifndef USE_AESD_CHAR_DEVICE
+static struct aesdpool frame_pool; // Frame buffers of binary connections
+static char follow_host[NI_MAXHOST]; // Replicate the log of the primary at follow_host:follow_port (disabled by default)
+static char *follow_port = NULL;
+static _Atomic uint64_t follow_primary_end = 0; // Primary log end offset last announced by an AESD_FRAME_SYNC
+#endif
 
 // Thread data
-static pthread_mutex_t mutex; // Lock and Unlock before and after write operation on persistent file
+static pthread_mutex_t mutex; // Serialize append operations on persistent file (replays don't take it)
+static pthread_cond_t appended = PTHREAD_COND_INITIALIZER; // Broadcast with mutex held after every append
+static struct aesdsched_gate append_gate; // FIFO admission of the appends to the mutex
+static struct aesdsched_gate replay_gate; // FIFO admission of the replay reads, one chunk per online cpu at once
+#ifndef USE_AESD_CHAR_DEVICE
+static struct aesdlog_config log_config = { // Segmented persistent log, see --help
+    .path = persistent_file,
+    .segment_size = AESDLOG_DEFAULT_SEGMENT_SIZE,
+};
+#endif
 static volatile int thd_exit_requested = 0; // Send exit request to all created threads
 struct thread_data {
     pthread_t id;
     int connfd; // cleint connection fd
-    char *ip; // Client ip
+    int ingestfd; // Datagram socket of an ingest thread, -1 otherwise
+    char ip[INET_ADDRSTRLEN]; // Client ip
+    struct aesdsched_bucket bucket; // Rate limit of the client connection
     bool completed; // Flag to check the thread completed
+    bool handoff; // Connection left open to be handed over to a new instance
     int *retval; // Hold retval
 };
 typedef struct slist_data_s slist_data_t;
@@ -57,10 +108,38 @@ struct slist_data_s {
 };
 
 static void* msg_exchange(void *);
-static int write_to_file(const char*, const char*);
+static int create_listener(void);
+static void start_client_thread(int, const struct in_addr*);
+static int create_dgram_listener(int, const char*);
+static void start_ingest_thread(int);
+static void* dgram_ingest(void *);
+static void reap_completed_threads(void);
+static bool stop_requested(void);
+static void* upgrade_wait(void *);
+static int upgrade_takeover(int*, size_t*);
+static void upgrade_handoff(void);
+static ssize_t append_to_log(const char*, size_t, enum package_mode);
+static ssize_t append_batch_to_log(const struct iovec*, int, enum package_mode);
+static ssize_t replay_to_client(int, char*, size_t);
+static int send_all(int, const char*, size_t);
+#ifdef USE_AESD_CHAR_DEVICE
+static int write_to_file(const char*, const char*, size_t);
+#else
 static ssize_t read_from_file(const char*, char*, size_t);
+static ssize_t replay_range(int, char*, size_t, uint64_t, uint64_t, uint8_t);
+static int send_frame(int, char*, uint8_t, size_t);
+static int recv_all(int, char*, size_t);
+static int frame_exchange(struct thread_data *);
+static int replay_records(int, char*, size_t, size_t);
+static int follow_stream(int, char*, size_t, uint64_t);
+static int stream_records(int, char*, size_t, uint64_t, uint64_t, uint64_t);
+static int reset_log(uint64_t, uint64_t);
+static int connect_primary(void);
+static void* follow_primary(void *);
+static uint64_t follow_lag_bytes(void);
+static void* log_current_time(void *);
+#endif
 static void print_usage (const char*);
 static void parse_cmdline_args(int, char *[]);
-// static void* log_current_time(void *);
 
 #endif // AESD_SOCKET
\ No newline at end of file
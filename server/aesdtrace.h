@@ -0,0 +1,26 @@
+#ifndef AESD_TRACE
+#define AESD_TRACE
+
+/*
+ * USDT probes of the aesdsocket provider, listed with
+ *   bpftrace -l 'usdt:/usr/bin/aesdsocket:*'
+ * Probes compile to a single nop when systemtap's sys/sdt.h is available,
+ * and to nothing otherwise.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESD_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef AESD_HAVE_SDT
+#define AESD_TRACE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define AESD_TRACE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#else
+#define AESD_TRACE1(name, a) do { (void)(a); } while (0)
+#define AESD_TRACE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
+
+#endif // AESD_TRACE
@@ -0,0 +1,119 @@
+#include <aesdupgrade.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct upgrade_msg {
+    uint32_t kind;
+    uint32_t nfds;
+};
+
+static int upgrade_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof (addr->sun_path)) {
+        printf("Upgrade socket path %s too long.\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (upgrade_addr(path, &addr) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        printf("Failed to open upgrade socket.\n");
+        return -1;
+    }
+    unlink(path); // Left by the instance this one took over from
+    if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen(fd, 1) != 0) {
+        printf("Failed to listen on upgrade socket %s.\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int upgrade_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (upgrade_addr(path, &addr) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        printf("Failed to open upgrade socket.\n");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
+        printf("Failed to connect to running instance on %s.\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int upgrade_send(int fd, enum upgrade_kind kind, const int *fds, size_t nfds) {
+    struct upgrade_msg msg = { .kind = kind, .nfds = nfds };
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof (msg) };
+    union {
+        char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof (int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (nfds > UPGRADE_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nfds > 0) {
+        memset(&control, 0, sizeof (control));
+        hdr.msg_control = control.buf;
+        hdr.msg_controllen = CMSG_SPACE(nfds * sizeof (int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof (int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof (int));
+    }
+
+    if (sendmsg(fd, &hdr, MSG_NOSIGNAL) != sizeof (msg)) {
+        printf("Failed to send upgrade message.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int upgrade_recv(int fd, enum upgrade_kind *kind, int *fds) {
+    struct upgrade_msg msg = {};
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof (msg) };
+    union {
+        char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof (int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof (control.buf) };
+
+    if (recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC) != sizeof (msg)) {
+        printf("Failed to receive upgrade message.\n");
+        return -1;
+    }
+
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof (int));
+        }
+    }
+    *kind = msg.kind;
+    return nfds;
+}
@@ -0,0 +1,41 @@
+#ifndef AESD_UPGRADE
+#define AESD_UPGRADE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPGRADE_SOCKET "/var/tmp/aesdsocket.upgrade" // Unix socket a new instance connects to for the handoff
+#define UPGRADE_MAX_FDS 64 // Maximal sockets passed per handoff message
+
+// Handoff message kinds, sent by the running instance in this order
+enum upgrade_kind {
+    UPGRADE_LISTENER = 1, // The listening socket(s)
+    UPGRADE_CLIENTS = 2, // A batch of live client connections
+    UPGRADE_DONE = 3, // Persistent log closed, the running instance exits
+};
+
+/**
+ * Create the Unix socket a new instance connects to when it starts with --upgrade
+ * @return Return the listening fd, or -1 if an error occure
+ */
+int upgrade_listen(const char *path);
+
+/**
+ * Connect to the Unix socket of the running instance
+ * @return Return the connected fd, or -1 if an error occure
+ */
+int upgrade_connect(const char *path);
+
+/**
+ * Send a handoff message passing the file descriptors fds with SCM_RIGHTS
+ * @return Return 0 on success, or -1 if an error occure
+ */
+int upgrade_send(int fd, enum upgrade_kind kind, const int *fds, size_t nfds);
+
+/**
+ * Receive a handoff message, up to UPGRADE_MAX_FDS file descriptors are stored in fds
+ * @return Return the number of file descriptors received, or -1 if an error occure
+ */
+int upgrade_recv(int fd, enum upgrade_kind *kind, int *fds);
+
+#endif // AESD_UPGRADE
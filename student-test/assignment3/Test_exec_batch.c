@@ -0,0 +1,57 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/**
+* Verify every command of a batch reports its own stdout and status, including a command
+* that can't be launched, with fewer commands running at a time than in the batch.
+*/
+void test_exec_batch_status_and_output()
+{
+    char *echo_argv[] = { "/bin/echo", "hello", NULL };
+    char *false_argv[] = { "/bin/false", NULL };
+    char *missing_argv[] = { "echo", "relative paths aren't searched", NULL };
+    char *sh_argv[] = { "/bin/sh", "-c", "printf 'a\\nb\\n'; exit 3", NULL };
+    struct exec_command commands[] = {
+        { .argv = echo_argv }, { .argv = false_argv }, { .argv = missing_argv }, { .argv = sh_argv },
+    };
+
+    TEST_ASSERT_FALSE(do_exec_batch(commands, 4, 2));
+    TEST_ASSERT_TRUE(commands[0].success);
+    TEST_ASSERT_EQUAL_STRING("hello\n", commands[0].output);
+    TEST_ASSERT_FALSE(commands[1].success);
+    TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(commands[1].status));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, commands[2].status, "Expected the command without full path not to launch");
+    TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(commands[3].status));
+    TEST_ASSERT_EQUAL_STRING("a\nb\n", commands[3].output);
+    for (int i = 0; i < 4; ++i) {
+        free(commands[i].output);
+    }
+}
+
+/**
+* Verify a batch larger than the concurrency limit runs every command, and that outputs
+* larger than a pipe buffer are captured whole.
+*/
+void test_exec_batch_many_commands()
+{
+    const int count = 200;
+    char *seq_argv[] = { "/usr/bin/seq", "100000", NULL };
+    char *true_argv[] = { "/bin/true", NULL };
+    struct exec_command commands[count];
+
+    for (int i = 0; i < count; ++i) {
+        commands[i].argv = i == 0 ? seq_argv : true_argv;
+    }
+    TEST_ASSERT_TRUE(do_exec_batch(commands, count, 8));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(588895, commands[0].output_len, "Expected the whole output of seq 100000");
+    TEST_ASSERT_EQUAL_STRING("100000\n", commands[0].output + commands[0].output_len - 7);
+    for (int i = 0; i < count; ++i) {
+        TEST_ASSERT_TRUE(commands[i].success);
+        TEST_ASSERT_TRUE(commands[i].duration_ns > 0);
+        free(commands[i].output);
+    }
+}
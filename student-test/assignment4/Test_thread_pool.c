@@ -0,0 +1,71 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../examples/threading/threading.h"
+
+static void *square(void *arg)
+{
+    intptr_t value = (intptr_t)arg;
+    return (void *)(value * value);
+}
+
+static void *sleep_100ms(void *arg)
+{
+    usleep(100000);
+    return arg;
+}
+
+/**
+* Verify every task submitted to a pool runs once and its future returns its result, with many
+* more tasks than futures so the descriptors are recycled.
+*/
+void test_thread_pool_futures()
+{
+    struct thread_pool *pool = thread_pool_create(4, 16);
+    struct thread_future *futures[16];
+    TEST_ASSERT_NOT_NULL(pool);
+
+    for (intptr_t round = 0; round < 100; ++round) {
+        for (intptr_t i = 0; i < 16; ++i) {
+            futures[i] = thread_pool_submit(pool, square, (void *)(round * 16 + i));
+            TEST_ASSERT_NOT_NULL(futures[i]);
+        }
+        TEST_ASSERT_NULL_MESSAGE(thread_pool_submit(pool, square, NULL), "Expected every future to be held");
+        for (intptr_t i = 0; i < 16; ++i) {
+            void *result;
+            TEST_ASSERT_TRUE(thread_future_wait(futures[i], -1, &result));
+            TEST_ASSERT_EQUAL_INT64((round * 16 + i) * (round * 16 + i), (intptr_t)result);
+            thread_future_release(futures[i]);
+        }
+    }
+    thread_pool_destroy(pool);
+}
+
+/**
+* Verify a wait times out on a task still running, that a future released after its task
+* completed is recycled at once, and that the mutex task of the pool holds the mutex as start_thread_obtaining_mutex.
+*/
+void test_thread_pool_timeout_and_mutex()
+{
+    struct thread_pool *pool = thread_pool_create(1, 2);
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    void *result;
+
+    struct thread_future *future = thread_pool_submit(pool, sleep_100ms, (void *)1);
+    TEST_ASSERT_FALSE_MESSAGE(thread_future_wait(future, 10, &result), "Expected the wait to time out");
+    TEST_ASSERT_TRUE(thread_future_wait(future, 1000, &result));
+    TEST_ASSERT_EQUAL_PTR((void *)1, result);
+    thread_future_release(future);
+
+    thread_future_release(thread_pool_submit(pool, sleep_100ms, NULL));
+    future = thread_pool_submit_obtaining_mutex(pool, &mutex, 0, 100);
+    TEST_ASSERT_NOT_NULL_MESSAGE(future, "Expected the released future to be recycled");
+    TEST_ASSERT_TRUE(thread_future_wait(future, -1, &result));
+    TEST_ASSERT_TRUE(((struct thread_data *)result)->thread_complete_success);
+    TEST_ASSERT_EQUAL_INT(0, pthread_mutex_trylock(&mutex));
+    pthread_mutex_unlock(&mutex);
+    thread_future_release(future);
+    thread_pool_destroy(pool);
+}
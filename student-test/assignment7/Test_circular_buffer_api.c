@@ -0,0 +1,246 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static void write_entries(struct aesd_circular_buffer *buffer, const char **cmds, size_t n)
+{
+    struct aesd_buffer_entry entry;
+    for (size_t i = 0; i < n; ++i) {
+        entry.buffptr = cmds[i];
+        entry.size = strlen(cmds[i]);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static size_t join_spans(const struct aesd_buffer_span *spans, size_t n, char *out)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        memcpy(out + len, spans[i].ptr, spans[i].len);
+        len += spans[i].len;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/**
+* Verify aesd_circular_buffer_spans() covers a byte range across entries, starting inside an entry
+* and stopping at max_len.
+*/
+void test_circular_buffer_spans()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_span spans[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    const char *cmds[] = { "write1\n", "write2\n", "write3\n" };
+    char out[128];
+    size_t total = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, &total),
+        "Expected no span for an empty buffer");
+    TEST_ASSERT_EQUAL_UINT32(0, total);
+
+    write_entries(&buffer, cmds, 3);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, &total),
+        "Expected one span per entry");
+    TEST_ASSERT_EQUAL_UINT32(21, total);
+    join_spans(spans, 3, out);
+    TEST_ASSERT_EQUAL_STRING("write1\nwrite2\nwrite3\n", out);
+
+    size_t n = aesd_circular_buffer_spans(&buffer, 3, 8, spans, 10, &total);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, n, "Expected the range to start inside the first entry");
+    TEST_ASSERT_EQUAL_UINT32(8, total);
+    join_spans(spans, n, out);
+    TEST_ASSERT_EQUAL_STRING("te1\nwrit", out);
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 1, &total),
+        "Expected max_spans to bound the spans");
+    TEST_ASSERT_EQUAL_UINT32(7, total);
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_spans(&buffer, 21, 100, spans, 10, &total));
+}
+
+/**
+* Verify the spans follow the oldest to newest order once the entry array wrapped around.
+*/
+void test_circular_buffer_spans_wraparound()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_span spans[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    const char *cmds[] = { "0\n", "1\n", "2\n", "3\n", "4\n", "5\n", "6\n", "7\n", "8\n", "9\n", "10\n", "11\n" };
+    char out[128];
+    size_t total = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, cmds, 12);
+    size_t n = aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, &total);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, n);
+    join_spans(spans, n, out);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n", out,
+        "Expected the two oldest entries to be overwritten");
+    TEST_ASSERT_EQUAL_UINT32(strlen(out), total);
+
+    n = aesd_circular_buffer_spans(&buffer, 15, 100, spans, 10, &total);
+    join_spans(spans, n, out);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("\n10\n11\n", out, "Expected the range to cross the end of the entry array");
+}
+
+static void collect_evicted(const struct aesd_buffer_entry *evicted, void *ctx)
+{
+    strcat((char *)ctx, evicted->buffptr);
+}
+
+/**
+* Verify aesd_circular_buffer_add_entry() returns the displaced entry and aesd_circular_buffer_add_entries()
+* reports every displaced entry, including batch entries beyond the buffer capacity.
+*/
+void test_circular_buffer_eviction()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_span spans[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    const char *cmds[] = { "0\n", "1\n", "2\n", "3\n", "4\n", "5\n", "6\n", "7\n", "8\n", "9\n" };
+    struct aesd_buffer_entry batch[13];
+    const char *batch_cmds[] = { "a\n", "b\n", "c\n", "d\n", "e\n", "f\n", "g\n", "h\n", "i\n", "j\n", "k\n", "l\n", "m\n" };
+    struct aesd_buffer_entry entry = { .buffptr = "x\n", .size = 2 };
+    char evicted[128] = "";
+    char out[128];
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, cmds, 9);
+    TEST_ASSERT_NULL(aesd_circular_buffer_add_entry(&buffer, &entry));
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(cmds[0], aesd_circular_buffer_add_entry(&buffer, &entry),
+        "Expected the oldest entry to be returned once overwritten");
+
+    for (size_t i = 0; i < 13; ++i) {
+        batch[i].buffptr = batch_cmds[i];
+        batch[i].size = 2;
+    }
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, cmds, 7);
+    aesd_circular_buffer_add_entries(&buffer, batch, 5, collect_evicted, evicted);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("0\n1\n", evicted, "Expected the two oldest entries to be evicted");
+    TEST_ASSERT_TRUE(buffer.full);
+    join_spans(spans, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, NULL), out);
+    TEST_ASSERT_EQUAL_STRING("2\n3\n4\n5\n6\na\nb\nc\nd\ne\n", out);
+
+    evicted[0] = '\0';
+    aesd_circular_buffer_add_entries(&buffer, batch, 13, collect_evicted, evicted);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("a\nb\nc\n2\n3\n4\n5\n6\na\nb\nc\nd\ne\n", evicted,
+        "Expected the batch overflow and every previous entry to be evicted");
+    join_spans(spans, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, NULL), out);
+    TEST_ASSERT_EQUAL_STRING("d\ne\nf\ng\nh\ni\nj\nk\nl\nm\n", out);
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_add_entries(&buffer, batch, 3, NULL, NULL);
+    TEST_ASSERT_FALSE(buffer.full);
+    join_spans(spans, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, NULL), out);
+    TEST_ASSERT_EQUAL_STRING("a\nb\nc\n", out);
+    TEST_ASSERT_NULL(aesd_circular_buffer_add_entry(&buffer, &entry));
+}
+
+/**
+* Verify aesd_circular_buffer_remove_entry() drops the oldest entry first, across the wraparound of the
+* entry array, and leaves room for new entries.
+*/
+void test_circular_buffer_remove_entry()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_span spans[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    const char *cmds[] = { "0\n", "1\n", "2\n", "3\n", "4\n", "5\n", "6\n", "7\n", "8\n", "9\n", "10\n", "11\n" };
+    struct aesd_buffer_entry removed;
+    struct aesd_buffer_entry entry = { .buffptr = "x\n", .size = 2 };
+    char out[128];
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_remove_entry(&buffer, &removed), "Expected nothing to remove");
+
+    write_entries(&buffer, cmds, 12);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(cmds[2], removed.buffptr, "Expected the oldest entry to be removed");
+    TEST_ASSERT_EQUAL_UINT32(2, removed.size);
+    TEST_ASSERT_FALSE(buffer.full);
+    for (int i = 3; i < 10; ++i) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    }
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(cmds[9], removed.buffptr, "Expected the entries removed in order");
+    join_spans(spans, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, NULL), out);
+    TEST_ASSERT_EQUAL_STRING("10\n11\n", out);
+
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_add_entry(&buffer, &entry), "Expected room for a new entry");
+    join_spans(spans, aesd_circular_buffer_spans(&buffer, 0, 100, spans, 10, NULL), out);
+    TEST_ASSERT_EQUAL_STRING("10\n11\nx\n", out);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    TEST_ASSERT_EQUAL_PTR(entry.buffptr, removed.buffptr);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+}
+
+/**
+* Verify aesd_circular_buffer_key_range() resolves time windows and sequence ranges to the file positions
+* of their entries, across the wraparound of the entry array and with entries committed at the same time.
+*/
+void test_circular_buffer_key_range()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry batch[3];
+    const char *cmds[] = { "0\n", "1\n", "2\n", "3\n", "4\n", "5\n", "6\n", "7\n", "8\n", "9\n", "10\n", "11\n" };
+    size_t start = 0, end = 0, first = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, aesd_circular_buffer_key_range(&buffer, false, 0, UINT64_MAX, &start, &end, &first),
+        "Expected no entry in an empty buffer");
+    TEST_ASSERT_EQUAL_UINT32(0, start);
+    TEST_ASSERT_EQUAL_UINT32(0, end);
+
+    // Entries i committed at time 100 * (i / 2), two per write
+    for (size_t i = 0; i < 12; ++i) {
+        entry.buffptr = cmds[i];
+        entry.size = strlen(cmds[i]);
+        entry.timestamp_ns = 100 * (i / 2);
+        entry.seq = i;
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, aesd_circular_buffer_key_range(&buffer, true, 4, 7, &start, &end, &first),
+        "Expected the sequence numbers 4 to 6");
+    TEST_ASSERT_EQUAL_UINT32(2, first);
+    TEST_ASSERT_EQUAL_UINT32(4, start);
+    TEST_ASSERT_EQUAL_UINT32(10, end);
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(4, aesd_circular_buffer_key_range(&buffer, false, 350, UINT64_MAX, &start, &end, &first),
+        "Expected both entries of every write since time 350");
+    TEST_ASSERT_EQUAL_UINT32(6, first);
+    TEST_ASSERT_EQUAL_UINT32(12, start);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(strlen("2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n"), end,
+        "Expected the range to cross the end of the entry array");
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, aesd_circular_buffer_key_range(&buffer, false, 0, 200, &start, &end, &first),
+        "Expected the entries overwritten to be skipped");
+    TEST_ASSERT_EQUAL_UINT32(0, start);
+    TEST_ASSERT_EQUAL_UINT32(4, end);
+
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_key_range(&buffer, false, 600, UINT64_MAX, &start, &end, &first));
+    TEST_ASSERT_EQUAL_UINT32(10, first);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(start, end, "Expected an empty range after the newest entry");
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_key_range(&buffer, true, 7, 5, &start, &end, &first));
+
+    // A batch displacing the oldest entries, positions stay relative to the new oldest entry
+    for (size_t i = 0; i < 3; ++i) {
+        batch[i].buffptr = cmds[i];
+        batch[i].size = strlen(cmds[i]);
+        batch[i].timestamp_ns = 600;
+        batch[i].seq = 12 + i;
+    }
+    aesd_circular_buffer_add_entries(&buffer, batch, 3, NULL, NULL);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(5, aesd_circular_buffer_key_range(&buffer, true, 10, UINT64_MAX, &start, &end, &first),
+        "Expected the sequence numbers 10 to 14");
+    TEST_ASSERT_EQUAL_UINT32(5, first);
+    TEST_ASSERT_EQUAL_UINT32(strlen("5\n6\n7\n8\n9\n"), start);
+    TEST_ASSERT_EQUAL_UINT32(strlen("5\n6\n7\n8\n9\n10\n11\n0\n1\n2\n"), end);
+    TEST_ASSERT_EQUAL_UINT32(3, aesd_circular_buffer_key_range(&buffer, false, 600, UINT64_MAX, &start, &end, &first));
+    TEST_ASSERT_EQUAL_UINT32(strlen("5\n6\n7\n8\n9\n10\n11\n"), start);
+}
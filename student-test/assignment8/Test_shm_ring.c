@@ -0,0 +1,122 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../../aesd-shm-ring/aesd-shm-ring.h"
+
+/**
+* Verify writes are split in newline terminated commands, read back at any fpos like /dev/aesdchar,
+* and that only the AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED newest commands are kept.
+*/
+void test_shm_ring_commands()
+{
+    struct aesd_shm_ring *ring = aesd_shm_ring_create("aesd-test", 4096);
+    char out[256];
+    uint64_t cursor = 0;
+
+    TEST_ASSERT_NOT_NULL(ring);
+    TEST_ASSERT_EQUAL_INT(0, aesd_shm_ring_read(ring, 0, out, sizeof (out)));
+    TEST_ASSERT_EQUAL_INT(8, aesd_shm_ring_write(ring, "a\nbb\nccc", 8));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, aesd_shm_ring_read(ring, 0, out, sizeof (out)),
+        "Expected the unterminated command to stay pending");
+    TEST_ASSERT_EQUAL_INT(2, aesd_shm_ring_write(ring, "c\n", 2));
+    TEST_ASSERT_EQUAL_INT(6, aesd_shm_ring_read(ring, 4, out, sizeof (out)));
+    out[6] = '\0';
+    TEST_ASSERT_EQUAL_STRING("\ncccc\n", out);
+
+    TEST_ASSERT_EQUAL_INT(10, aesd_shm_ring_tail(ring, &cursor, out, sizeof (out)));
+    TEST_ASSERT_EQUAL_UINT64(3, cursor);
+    TEST_ASSERT_EQUAL_INT(0, aesd_shm_ring_tail(ring, &cursor, out, sizeof (out)));
+
+    for (int i = 0; i < 12; ++i) {
+        int len = snprintf(out, sizeof (out), "%d\n", i);
+        aesd_shm_ring_write(ring, out, len);
+    }
+    ssize_t len = aesd_shm_ring_read(ring, 0, out, sizeof (out));
+    out[len] = '\0';
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n", out, "Expected the oldest commands to be dropped");
+
+    struct aesd_shm_ring *other = aesd_shm_ring_attach(aesd_shm_ring_fd(ring));
+    TEST_ASSERT_NOT_NULL(other);
+    TEST_ASSERT_EQUAL_INT(4, aesd_shm_ring_tail(other, &cursor, out, 5));
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(7, cursor, "Expected the dropped commands to be skipped");
+    out[4] = '\0';
+    TEST_ASSERT_EQUAL_STRING("2\n3\n", out);
+    aesd_shm_ring_close(other);
+    aesd_shm_ring_close(ring);
+}
+
+/**
+* Verify commands overwritten in the arena are dropped even if the index still holds them,
+* and that a command wrapping around the end of the arena reads back intact.
+*/
+void test_shm_ring_arena_wraparound()
+{
+    struct aesd_shm_ring *ring = aesd_shm_ring_create("aesd-test", 4096);
+    struct aesd_circular_buffer view;
+    char cmd[1500], out[8192];
+    uint64_t commands = 0;
+
+    for (int i = 0; i < 5; ++i) {
+        memset(cmd, 'a' + i, sizeof (cmd) - 1);
+        cmd[sizeof (cmd) - 1] = '\n';
+        TEST_ASSERT_EQUAL_INT(sizeof (cmd), aesd_shm_ring_write(ring, cmd, sizeof (cmd)));
+    }
+
+    ssize_t len = aesd_shm_ring_read(ring, 0, out, sizeof (out));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2 * sizeof (cmd), len, "Expected only the commands left in the arena");
+    TEST_ASSERT_TRUE(out[0] == 'd' && out[sizeof (cmd) - 2] == 'd' && out[len - 2] == 'e');
+
+    uint64_t oldest = aesd_shm_ring_view(ring, &view, &commands);
+    TEST_ASSERT_EQUAL_UINT64(5, commands);
+    TEST_ASSERT_TRUE(aesd_shm_ring_view_valid(ring, oldest));
+    memset(cmd, 'z', sizeof (cmd) - 1);
+    aesd_shm_ring_write(ring, cmd, sizeof (cmd));
+    TEST_ASSERT_FALSE_MESSAGE(aesd_shm_ring_view_valid(ring, oldest), "Expected the view to be invalidated");
+
+    memset(out, 'y', sizeof (out));
+    out[sizeof (out) - 1] = '\n';
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_shm_ring_write(ring, out, sizeof (out)),
+        "Expected a command larger than the arena to be rejected");
+    aesd_shm_ring_close(ring);
+}
+
+/**
+* Verify a process tailing the ring sees the commands of a writer process in order, without gaps
+* other than the commands dropped before it caught up.
+*/
+void test_shm_ring_processes()
+{
+    struct aesd_shm_ring *ring = aesd_shm_ring_create("aesd-test", 8192);
+    const int count = 2000;
+    char out[8192];
+    uint64_t cursor = 0;
+    int last = -1, status = 0;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        struct aesd_shm_ring *writer = aesd_shm_ring_attach(aesd_shm_ring_fd(ring));
+        for (int i = 0; i < count; ++i) {
+            char cmd[32];
+            int len = snprintf(cmd, sizeof (cmd), "%d\n", i);
+            aesd_shm_ring_write(writer, cmd, len);
+        }
+        _exit(0);
+    }
+
+    while (last < count - 1) {
+        ssize_t len = aesd_shm_ring_tail(ring, &cursor, out, sizeof (out) - 1);
+        TEST_ASSERT_TRUE(len >= 0);
+        out[len] = '\0';
+        for (char *line = strtok(out, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+            int value = atoi(line);
+            TEST_ASSERT_TRUE_MESSAGE(value > last, "Expected the commands in order");
+            last = value;
+        }
+    }
+    waitpid(pid, &status, 0);
+    TEST_ASSERT_EQUAL_UINT64(count, cursor);
+    aesd_shm_ring_close(ring);
+}